@@ -0,0 +1,269 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Measures the cpu time taken and the bytes produced by each compression
+// format and level built in, streaming a profile through
+// NewCompressingStream() as the agent does. The profile is an
+// uncompressed profile.proto given on the command line, or else a
+// synthetic one shaped like a Java cpu profile.
+//
+// Usage: compression_bench [profile.pb]
+
+#include <stdio.h>
+#include <time.h>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <vector>
+
+#include "src/chunked_buffer.h"
+#include "src/compression.h"
+#include "google/protobuf/io/coded_stream.h"
+#include "google/protobuf/io/zero_copy_stream_impl_lite.h"
+
+using cloud::profiler::ChunkedBuffer;
+using cloud::profiler::Compression;
+using cloud::profiler::CompressingStream;
+using cloud::profiler::NewCompressingStream;
+using google::protobuf::io::CodedOutputStream;
+using google::protobuf::io::StringOutputStream;
+
+namespace {
+
+// Writes a length-delimited field holding the given message bytes.
+void WriteMessage(int field, const string &message, CodedOutputStream *out) {
+  out->WriteTag(field << 3 | 2);
+  out->WriteVarint32(message.size());
+  out->WriteRaw(message.data(), message.size());
+}
+
+// Writes a packed repeated varint field.
+void WritePacked(int field, const std::vector<uint64_t> &values,
+                 CodedOutputStream *out) {
+  string packed;
+  {
+    StringOutputStream stream(&packed);
+    CodedOutputStream coded(&stream);
+    for (uint64_t value : values) {
+      coded.WriteVarint64(value);
+    }
+  }
+  WriteMessage(field, packed, out);
+}
+
+void WriteVarintField(int field, uint64_t value, CodedOutputStream *out) {
+  out->WriteTag(field << 3);
+  out->WriteVarint64(value);
+}
+
+// Builds a profile.proto with the structure of the ones of the agent: a
+// string table of Java names, functions, locations, and samples whose
+// stacks share long prefixes.
+string SyntheticProfile() {
+  const int kFunctions = 4000;
+  const int kLocations = 12000;
+  const int kSamples = 20000;
+  const char *kPackages[] = {"com.example.server", "com.example.storage",
+                             "io.netty.channel", "java.util.concurrent",
+                             "com.google.protobuf", "java.lang"};
+  const char *kVerbs[] = {"get", "put", "handle", "process", "read",
+                          "write", "invoke", "run", "apply", "lambda$"};
+  const char *kNouns[] = {"Request", "Response", "Buffer", "Entry", "Task",
+                          "Channel", "Message", "Value", "Index", "Batch"};
+  std::mt19937_64 random(7);
+
+  string profile;
+  StringOutputStream stream(&profile);
+  CodedOutputStream out(&stream);
+  std::vector<string> strings = {"", "samples", "count", "cpu",
+                                 "nanoseconds"};
+
+  // sample_type: {samples, count}, {cpu, nanoseconds}.
+  for (int i = 0; i < 2; i++) {
+    string type;
+    StringOutputStream type_stream(&type);
+    CodedOutputStream type_out(&type_stream);
+    WriteVarintField(1, 1 + 2 * i, &type_out);
+    WriteVarintField(2, 2 + 2 * i, &type_out);
+    type_out.Trim();
+    WriteMessage(1, type, &out);
+  }
+
+  // function: id, name, system_name, filename.
+  for (int f = 1; f <= kFunctions; f++) {
+    const char *package = kPackages[random() % 6];
+    std::ostringstream klass, method;
+    klass << package << "." << kNouns[random() % 10] << kVerbs[random() % 10]
+          << "er" << f % 97;
+    method << kVerbs[random() % 10] << kNouns[random() % 10];
+    strings.push_back("L" + klass.str() + ";");
+    strings.push_back(method.str());
+    strings.push_back(klass.str().substr(klass.str().rfind('.') + 1) +
+                      ".java");
+    string function;
+    StringOutputStream function_stream(&function);
+    CodedOutputStream function_out(&function_stream);
+    WriteVarintField(1, f, &function_out);
+    WriteVarintField(2, strings.size() - 2, &function_out);
+    WriteVarintField(3, strings.size() - 3, &function_out);
+    WriteVarintField(4, strings.size() - 1, &function_out);
+    function_out.Trim();
+    WriteMessage(5, function, &out);
+  }
+
+  // location: id, line {function_id, line}.
+  for (int l = 1; l <= kLocations; l++) {
+    string line;
+    StringOutputStream line_stream(&line);
+    CodedOutputStream line_out(&line_stream);
+    WriteVarintField(1, 1 + random() % kFunctions, &line_out);
+    WriteVarintField(2, 1 + random() % 800, &line_out);
+    line_out.Trim();
+    string location;
+    StringOutputStream location_stream(&location);
+    CodedOutputStream location_out(&location_stream);
+    WriteVarintField(1, l, &location_out);
+    WriteMessage(4, line, &location_out);
+    location_out.Trim();
+    WriteMessage(4, location, &out);
+  }
+
+  // sample: location_id leaf first, value {count, nanos}.
+  std::vector<std::vector<uint64_t>> stacks;
+  for (int s = 0; s < kSamples; s++) {
+    std::vector<uint64_t> stack;
+    if (!stacks.empty()) {
+      // Share the outer frames of an earlier stack.
+      const std::vector<uint64_t> &parent = stacks[random() % stacks.size()];
+      size_t shared = random() % parent.size();
+      stack.assign(parent.end() - shared, parent.end());
+    }
+    int leaves = 1 + random() % 20;
+    for (int i = 0; i < leaves && stack.size() < 128; i++) {
+      stack.insert(stack.begin(), 1 + random() % kLocations);
+    }
+    stacks.push_back(stack);
+    uint64_t count = 1 + (random() % 4 == 0 ? random() % 100 : 0);
+    string sample;
+    StringOutputStream sample_stream(&sample);
+    CodedOutputStream sample_out(&sample_stream);
+    WritePacked(1, stack, &sample_out);
+    WritePacked(2, {count, count * 10000000}, &sample_out);
+    sample_out.Trim();
+    WriteMessage(2, sample, &out);
+  }
+
+  for (const string &s : strings) {
+    WriteMessage(6, s, &out);
+  }
+  out.Trim();
+  return profile;
+}
+
+double CpuSeconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Streams the profile through the compression, in the chunks handed out
+// by the stream, and returns the size of the compressed profile.
+size_t Compress(const Compression &compression, const string &profile) {
+  ChunkedBuffer buffer;
+  ChunkedBuffer::OutputStream output(&buffer);
+  std::unique_ptr<CompressingStream> stream =
+      NewCompressingStream(compression, &output);
+  size_t written = 0;
+  while (written < profile.size()) {
+    void *data;
+    int size;
+    if (!stream->Next(&data, &size)) {
+      return 0;
+    }
+    size_t n = std::min(static_cast<size_t>(size), profile.size() - written);
+    memcpy(data, profile.data() + written, n);
+    stream->BackUp(size - n);
+    written += n;
+  }
+  if (!stream->Close()) {
+    return 0;
+  }
+  return buffer.size();
+}
+
+void Run(const char *name, const Compression &compression,
+         const string &profile) {
+  // Repeats for at least 200ms of cpu time.
+  const double kMinSeconds = 0.2;
+  size_t size = 0;
+  int runs = 0;
+  double start = CpuSeconds(), elapsed = 0;
+  do {
+    size = Compress(compression, profile);
+    runs++;
+    elapsed = CpuSeconds() - start;
+  } while (elapsed < kMinSeconds);
+  if (size == 0) {
+    printf("%-10s failed\n", name);
+    return;
+  }
+  double ms = elapsed * 1000 / runs;
+  printf("%-10s %9.2f %9.1f %10zu %7.2f%%\n", name, ms,
+         profile.size() / (ms * 1000), size, 100.0 * size / profile.size());
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  string profile;
+  if (argc > 1) {
+    std::ifstream file(argv[1], std::ios::binary);
+    if (!file) {
+      fprintf(stderr, "cannot read %s\n", argv[1]);
+      return 1;
+    }
+    std::ostringstream contents;
+    contents << file.rdbuf();
+    profile = contents.str();
+  } else {
+    profile = SyntheticProfile();
+  }
+  printf("%zu bytes of profile\n", profile.size());
+  printf("%-10s %9s %9s %10s %8s\n", "format", "cpu_ms", "MB/s", "bytes",
+         "ratio");
+
+  Run("none", Compression(Compression::kNone, 0), profile);
+  for (int level = 1; level <= 9; level++) {
+    string name = "gzip:" + std::to_string(level);
+    Run(name.c_str(), Compression(Compression::kGzip, level), profile);
+  }
+#ifdef CPROF_HAVE_ZSTD
+  for (int level : {-5, -1, 1, 3, 6, 9, 12, 15, 19}) {
+    string name = "zstd:" + std::to_string(level);
+    Run(name.c_str(), Compression(Compression::kZstd, level), profile);
+  }
+#endif
+#ifdef CPROF_HAVE_LZ4
+  // Negative levels are the accelerations of the fast mode, levels above
+  // 2 the high compression mode.
+  for (int level : {-8, 0, 3, 6, 9, 12}) {
+    string name = "lz4:" + std::to_string(level);
+    Run(name.c_str(), Compression(Compression::kLz4, level), profile);
+  }
+#endif
+  return 0;
+}
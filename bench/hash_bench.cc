@@ -0,0 +1,160 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Compares CalculateHash() with the one-at-a-time hash it replaced, for
+// the time taken per trace and the collisions over traces shaped like
+// Java stacks: deep, sharing long prefixes of outer frames, with method
+// IDs close to each other and small line numbers.
+//
+// Usage: hash_bench [num_traces] [num_frames]
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <chrono>  // NOLINT
+#include <cmath>
+#include <functional>
+#include <random>
+#include <unordered_set>
+#include <vector>
+
+#include "third_party/javaprofiler/stacktraces.h"
+
+using google::javaprofiler::CalculateHash;
+using google::javaprofiler::JVMPI_CallFrame;
+
+namespace {
+
+// The hash of CalculateHash() before it was replaced, for comparison.
+uint64_t OneAtATimeHash(int64_t attr, int num_frames,
+                        const JVMPI_CallFrame *frame) {
+  uint64_t h = attr;
+  h += h << 10;
+  h ^= h >> 6;
+  for (int i = 0; i < num_frames; i++) {
+    h += reinterpret_cast<uintptr_t>(frame[i].method_id);
+    h += h << 10;
+    h ^= h >> 6;
+    h += static_cast<uintptr_t>(frame[i].lineno);
+    h += h << 10;
+    h ^= h >> 6;
+  }
+  h += h << 3;
+  h ^= h >> 11;
+  return h;
+}
+
+typedef std::vector<JVMPI_CallFrame> Trace;
+
+// Builds distinct traces of num_frames frames, leaf first. Each trace
+// shares a random number of outer frames with an earlier one.
+std::vector<Trace> MakeTraces(int num_traces, int num_frames) {
+  const int kNumMethods = 20000;
+  const uintptr_t kMethodBase = 0x7f3a2c000000;
+  std::mt19937_64 random(42);
+  std::uniform_int_distribution<int> method(0, kNumMethods - 1);
+  std::uniform_int_distribution<int> lineno(1, 400);
+
+  std::vector<Trace> traces;
+  std::unordered_set<uint64_t> seen;
+  while (traces.size() < static_cast<size_t>(num_traces)) {
+    Trace trace(num_frames);
+    int shared = 0;
+    if (!traces.empty()) {
+      const Trace &parent = traces[random() % traces.size()];
+      shared = random() % num_frames;
+      for (int i = num_frames - shared; i < num_frames; i++) {
+        trace[i] = parent[i];
+      }
+    }
+    for (int i = 0; i < num_frames - shared; i++) {
+      // jmethodIDs are pointers to consecutive slots.
+      trace[i].method_id =
+          reinterpret_cast<jmethodID>(kMethodBase + method(random) * 8);
+      trace[i].lineno = lineno(random);
+    }
+    // Skip the rare duplicates, so that every collision is a real one.
+    std::hash<std::string> hash_bytes;
+    uint64_t key = hash_bytes(std::string(
+        reinterpret_cast<const char *>(trace.data()),
+        trace.size() * sizeof(trace[0])));
+    if (seen.insert(key).second) {
+      traces.push_back(trace);
+    }
+  }
+  return traces;
+}
+
+// Number of collisions expected from num_keys uniformly random keys in
+// num_buckets buckets.
+double ExpectedCollisions(double num_keys, double num_buckets) {
+  double occupied =
+      num_buckets * (1 - std::pow(1 - 1 / num_buckets, num_keys));
+  return num_keys - occupied;
+}
+
+void Run(const char *name,
+         uint64_t (*hash)(int64_t, int, const JVMPI_CallFrame *),
+         const std::vector<Trace> &traces) {
+  // The bucket of a trace in the default primary table of
+  // AsyncSafeTraceMultiset, indexed by the hash modulo its size.
+  const uint64_t kBuckets =
+      google::javaprofiler::AsyncSafeTraceMultiset::kDefaultMaxStackTraces;
+  const int kRepetitions = 20;
+
+  std::vector<uint64_t> hashes(traces.size());
+  uint64_t sink = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int r = 0; r < kRepetitions; r++) {
+    for (size_t i = 0; i < traces.size(); i++) {
+      hashes[i] = hash(r, traces[i].size(), traces[i].data());
+      sink ^= hashes[i];
+    }
+  }
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  double ns_per_trace =
+      std::chrono::duration<double, std::nano>(elapsed).count() /
+      (kRepetitions * traces.size());
+
+  // Collisions of the last repetition, over the full hashes and over the
+  // buckets of the first kBuckets traces, as in a table being filled.
+  std::unordered_set<uint64_t> full(hashes.begin(), hashes.end());
+  std::unordered_set<uint64_t> buckets;
+  size_t filled = std::min<size_t>(hashes.size(), kBuckets);
+  for (size_t i = 0; i < filled; i++) {
+    buckets.insert(hashes[i] % kBuckets);
+  }
+  printf("%-14s %8.1f ns/trace %8.2f ns/frame %6zu full collisions "
+         "%6zu bucket collisions (%.0f expected)  [%llx]\n",
+         name, ns_per_trace, ns_per_trace / traces[0].size(),
+         hashes.size() - full.size(), filled - buckets.size(),
+         ExpectedCollisions(filled, kBuckets),
+         static_cast<unsigned long long>(sink & 0xf));  // NOLINT
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  int num_traces = argc > 1 ? atoi(argv[1]) : 100000;
+  int num_frames = argc > 2 ? atoi(argv[2]) : 128;
+  if (num_traces <= 0 || num_frames <= 0) {
+    fprintf(stderr, "usage: %s [num_traces] [num_frames]\n", argv[0]);
+    return 1;
+  }
+  std::vector<Trace> traces = MakeTraces(num_traces, num_frames);
+  printf("%d traces of %d frames\n", num_traces, num_frames);
+  Run("one-at-a-time", &OneAtATimeHash, traces);
+  Run("multiply-mix", &CalculateHash, traces);
+  return 0;
+}
@@ -0,0 +1,212 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Measures the time taken by a SIGPROF handler to record a trace, against
+// the number of threads taking the signals, with all the threads sharing
+// one AsyncSafeTraceMultiset and with the threads spread across shards
+// as done by --cprof_trace_table_shards. The threads spin, so run it with
+// at most one thread per core to measure contention rather than
+// scheduling.
+//
+// Usage: signal_latency_bench [seconds_per_run] [max_threads]
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <thread>  // NOLINT
+#include <vector>
+
+#include "third_party/javaprofiler/stacktraces.h"
+
+using google::javaprofiler::AsyncSafeTraceMultiset;
+using google::javaprofiler::HarvestSamples;
+using google::javaprofiler::JVMPI_CallFrame;
+using google::javaprofiler::JVMPI_CallTrace;
+using google::javaprofiler::TraceMultiset;
+
+namespace {
+
+// Same sizing of the shards as Profiler::Reset().
+const int64_t kMinShardTraces = 512;
+
+// Distinct traces recorded by the threads, shared by all of them as when
+// the threads of a pool run the same code.
+const int kNumTraces = 32;
+const int kFramesPerTrace = 24;
+
+// Latencies kept per thread, later ones are dropped.
+const int kMaxLatencies = 1 << 16;
+
+struct ThreadLatencies {
+  uint32_t nanos[kMaxLatencies];
+  int count;
+};
+
+JVMPI_CallFrame frames[kNumTraces][kFramesPerTrace];
+AsyncSafeTraceMultiset **tables;
+int num_tables;
+
+__thread int current_ordinal;
+__thread ThreadLatencies *current_latencies;
+__thread uint64_t current_random;
+
+int64_t NowNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void Handle(int signum, siginfo_t *info, void *context) {
+  ThreadLatencies *latencies = current_latencies;
+  if (latencies == nullptr) {
+    return;
+  }
+  current_random = current_random * 6364136223846793005ULL + 1;
+  JVMPI_CallTrace trace = {nullptr, kFramesPerTrace,
+                           frames[(current_random >> 33) % kNumTraces]};
+  int64_t start = NowNanos();
+  tables[current_ordinal % num_tables]->Add(0, &trace);
+  int64_t elapsed = NowNanos() - start;
+  if (latencies->count < kMaxLatencies) {
+    latencies->nanos[latencies->count++] = elapsed;
+  }
+}
+
+void Spin(int ordinal, ThreadLatencies *latencies,
+          std::atomic<pid_t> *tid, const std::atomic<bool> *done) {
+  current_ordinal = ordinal;
+  current_random = ordinal + 1;
+  current_latencies = latencies;
+  tid->store(syscall(SYS_gettid));
+  while (!done->load(std::memory_order_relaxed)) {
+  }
+  current_latencies = nullptr;
+}
+
+// Signals num_threads spinning threads every period for the given time,
+// with the threads spread over num_shards tables, and prints the latency
+// percentiles of the handler.
+void Run(int num_threads, int num_shards, int seconds) {
+  int64_t max_traces =
+      std::max(AsyncSafeTraceMultiset::kDefaultMaxStackTraces / num_shards,
+               kMinShardTraces);
+  tables = new AsyncSafeTraceMultiset *[num_shards];
+  for (int i = 0; i < num_shards; i++) {
+    tables[i] = new AsyncSafeTraceMultiset(max_traces);
+  }
+  num_tables = num_shards;
+
+  std::vector<ThreadLatencies> latencies(num_threads);
+  std::vector<std::atomic<pid_t>> tids(num_threads);
+  std::atomic<bool> done(false);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < num_threads; i++) {
+    latencies[i].count = 0;
+    tids[i] = 0;
+    threads.emplace_back(Spin, i, &latencies[i], &tids[i], &done);
+  }
+  for (int i = 0; i < num_threads; i++) {
+    while (tids[i].load() == 0) {
+    }
+  }
+
+  // Signals every thread each round, and harvests every 10ms as the
+  // profiler does.
+  const int64_t kPeriodNanos = 100000;
+  const int64_t kHarvestNanos = 10000000;
+  TraceMultiset harvested;
+  pid_t pid = getpid();
+  int64_t end = NowNanos() + seconds * 1000000000LL;
+  int64_t next_harvest = NowNanos() + kHarvestNanos;
+  for (int64_t now = NowNanos(); now < end; now = NowNanos()) {
+    for (int i = 0; i < num_threads; i++) {
+      syscall(SYS_tgkill, pid, tids[i].load(), SIGPROF);
+    }
+    if (now >= next_harvest) {
+      for (int i = 0; i < num_shards; i++) {
+        HarvestSamples(tables[i], &harvested);
+      }
+      next_harvest = now + kHarvestNanos;
+    }
+    struct timespec period = {0, kPeriodNanos};
+    nanosleep(&period, nullptr);
+  }
+  done = true;
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+
+  std::vector<uint32_t> all;
+  for (const ThreadLatencies &thread : latencies) {
+    all.insert(all.end(), thread.nanos, thread.nanos + thread.count);
+  }
+  std::sort(all.begin(), all.end());
+  if (all.empty()) {
+    printf("%7d %6d  no samples\n", num_threads, num_shards);
+  } else {
+    double sum = 0;
+    for (uint32_t nanos : all) {
+      sum += nanos;
+    }
+    printf("%7d %6d %9zu %9.0f %9u %9u %9u\n", num_threads, num_shards,
+           all.size(), sum / all.size(), all[all.size() / 2],
+           all[all.size() * 99 / 100], all.back());
+  }
+
+  // Signals may still be pending for the threads that exited, so the
+  // tables are left allocated, as in the profiler.
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  int seconds = argc > 1 ? atoi(argv[1]) : 2;
+  int max_threads =
+      argc > 2 ? atoi(argv[2]) : std::thread::hardware_concurrency();
+  if (seconds <= 0 || max_threads <= 0) {
+    fprintf(stderr, "usage: %s [seconds_per_run] [max_threads]\n", argv[0]);
+    return 1;
+  }
+
+  for (int t = 0; t < kNumTraces; t++) {
+    for (int i = 0; i < kFramesPerTrace; i++) {
+      frames[t][i].lineno = i;
+      frames[t][i].method_id =
+          reinterpret_cast<jmethodID>(0x7f3a2c000000 + (t * 64 + i) * 8);
+    }
+  }
+  struct sigaction action;
+  action.sa_sigaction = Handle;
+  action.sa_flags = SA_RESTART | SA_SIGINFO;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGPROF, &action, nullptr);
+
+  printf("threads shards   samples   mean_ns    p50_ns    p99_ns    max_ns\n");
+  for (int threads = 1;; threads = std::min(threads * 2, max_threads)) {
+    Run(threads, 1, seconds);
+    if (threads > 1) {
+      Run(threads, threads, seconds);
+    }
+    if (threads == max_threads) {
+      break;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,258 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Stress test of AsyncSafeTraceMultiset: many threads call Add() while
+// another one keeps harvesting the set, which retires and reuses the
+// locations under the adders. Checks that every sample added is
+// harvested exactly once, with the frames it was added with.
+//
+// By default the set is harvested back to back, which keeps most
+// locations retired, so many Add() calls fail: only the samples added
+// successfully are expected back. Given harvest_ms, the set is harvested
+// at that interval instead, as the profiler does every 100ms, the threads
+// adding at a sampling rate rather than back to back, and the
+// test fails if more than max_drop_percent of the Add() calls fail or a
+// harvest takes more than max_harvest_ms of cpu time. The failures are
+// reported apart for the calls made during a harvest, which finds the
+// overflow segments sealed, and between harvests, which only fail when
+// the free locations are exhausted.
+//
+// Usage: trace_multiset_stress_test [seconds] [threads]
+//            [harvest_ms max_drop_percent max_harvest_ms]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>  // NOLINT
+#include <thread>  // NOLINT
+#include <vector>
+
+#include "third_party/javaprofiler/stacktraces.h"
+
+using google::javaprofiler::AsyncSafeTraceMultiset;
+using google::javaprofiler::HarvestSamples;
+using google::javaprofiler::JVMPI_CallFrame;
+using google::javaprofiler::JVMPI_CallTrace;
+using google::javaprofiler::TraceMultiset;
+using google::javaprofiler::kMaxFramesToCapture;
+
+namespace {
+
+// Distinct traces added by each thread.
+const int kVariants = 200;
+// Small enough for the overflow segments to be used and filled up.
+const int64_t kMaxTraces = 256;
+
+// Pause between the calls to Add() of a thread when harvesting at an
+// interval, for 5000 samples per second and thread, fifty times the
+// default cpu sampling rate.
+const int kPauseMicros = 200;
+
+// Frame i of the given variant of the traces of a thread. The method ID
+// encodes all three, so that a harvested frame can be checked.
+JVMPI_CallFrame ExpectedFrame(int thread, int variant, int i) {
+  JVMPI_CallFrame frame;
+  frame.lineno = i;
+  frame.method_id = reinterpret_cast<jmethodID>(
+      (((static_cast<uintptr_t>(thread) << 16 | variant) << 8 | i) << 3));
+  return frame;
+}
+
+// Averages fewer frames than the arenas are sized for, so that Add() only
+// fails when the tables are full.
+int NumFrames(int variant) { return 1 + variant * 7 % 48; }
+
+// Set while the set is being harvested.
+std::atomic<bool> harvesting(false);
+
+// Counts of the calls to Add() of a thread.
+struct AddCounts {
+  int64_t added = 0;
+  int64_t dropped_harvesting = 0;
+  int64_t dropped_idle = 0;
+};
+
+// Adds traces until done, pausing pause_us between them unless zero.
+void Adder(AsyncSafeTraceMultiset *set, int thread, int pause_us,
+           const std::atomic<bool> *done, AddCounts *counts) {
+  std::vector<std::vector<JVMPI_CallFrame>> traces(kVariants);
+  for (int v = 0; v < kVariants; v++) {
+    for (int i = 0; i < NumFrames(v); i++) {
+      traces[v].push_back(ExpectedFrame(thread, v, i));
+    }
+  }
+  uint64_t random = thread + 1;
+  while (!done->load(std::memory_order_relaxed)) {
+    random = random * 6364136223846793005ULL + 1442695040888963407ULL;
+    int v = (random >> 33) % kVariants;
+    JVMPI_CallTrace trace = {nullptr, NumFrames(v), traces[v].data()};
+    bool during_harvest = harvesting.load(std::memory_order_relaxed);
+    if (set->Add(thread, &trace)) {
+      counts->added++;
+    } else if (during_harvest) {
+      counts->dropped_harvesting++;
+    } else {
+      counts->dropped_idle++;
+    }
+    if (pause_us > 0) {
+      std::this_thread::sleep_for(std::chrono::microseconds(pause_us));
+    }
+  }
+}
+
+// Checks the traces harvested so far and returns their total count, or
+// -1 if any of them is corrupted.
+int64_t CheckHarvested(const TraceMultiset &harvested, int num_threads) {
+  int64_t total = 0;
+  for (const TraceMultiset::Trace &trace : harvested) {
+    const JVMPI_CallFrame &leaf = harvested.NodeAt(trace.node).frame;
+    uintptr_t id = reinterpret_cast<uintptr_t>(leaf.method_id) >> 11;
+    int variant = id & 0xffff;
+    int thread = id >> 16;
+    if (thread != trace.attr || thread >= num_threads ||
+        variant >= kVariants || trace.num_frames != NumFrames(variant)) {
+      fprintf(stderr, "unexpected trace of attr %lld with %d frames\n",
+              static_cast<long long>(trace.attr),  // NOLINT
+              trace.num_frames);
+      return -1;
+    }
+    int64_t node = trace.node;
+    for (int i = 0; i < trace.num_frames; i++) {
+      JVMPI_CallFrame expected = ExpectedFrame(thread, variant, i);
+      const JVMPI_CallFrame &frame = harvested.NodeAt(node).frame;
+      if (frame.method_id != expected.method_id ||
+          frame.lineno != expected.lineno) {
+        fprintf(stderr, "frame %d of trace %d/%d is corrupted\n", i, thread,
+                variant);
+        return -1;
+      }
+      node = harvested.NodeAt(node).parent;
+    }
+    if (node != TraceMultiset::kNoNode) {
+      fprintf(stderr, "trace %d/%d has extra frames\n", thread, variant);
+      return -1;
+    }
+    total += trace.count;
+  }
+  return total;
+}
+
+double ThreadCpuMillis() {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec * 1e-6;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  int seconds = argc > 1 ? atoi(argv[1]) : 3;
+  int num_threads =
+      argc > 2 ? atoi(argv[2])
+               : std::max(16u, 4 * std::thread::hardware_concurrency());
+  int harvest_ms = argc > 3 ? atoi(argv[3]) : 0;
+  double max_drop_percent = argc > 4 ? atof(argv[4]) : 100;
+  double max_harvest_ms = argc > 5 ? atof(argv[5]) : 1e9;
+  if (seconds <= 0 || num_threads <= 0 || harvest_ms < 0) {
+    fprintf(stderr,
+            "usage: %s [seconds] [threads] "
+            "[harvest_ms max_drop_percent max_harvest_ms]\n",
+            argv[0]);
+    return 1;
+  }
+
+  AsyncSafeTraceMultiset set(kMaxTraces);
+  TraceMultiset harvested;
+  std::atomic<bool> done(false);
+  std::vector<AddCounts> counts(num_threads);
+  std::vector<std::thread> adders;
+  for (int t = 0; t < num_threads; t++) {
+    adders.emplace_back(Adder, &set, t, harvest_ms > 0 ? kPauseMicros : 0,
+                        &done, &counts[t]);
+  }
+
+  typedef std::chrono::steady_clock Clock;
+  Clock::time_point end = Clock::now() + std::chrono::seconds(seconds);
+  Clock::duration longest_harvest = Clock::duration::zero();
+  double longest_harvest_cpu_ms = 0;
+  int64_t harvests = 0;
+  while (Clock::now() < end) {
+    if (harvest_ms > 0) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(harvest_ms));
+    }
+    Clock::time_point start = Clock::now();
+    double start_cpu_ms = ThreadCpuMillis();
+    harvesting = true;
+    HarvestSamples(&set, &harvested);
+    harvesting = false;
+    longest_harvest_cpu_ms =
+        std::max(longest_harvest_cpu_ms, ThreadCpuMillis() - start_cpu_ms);
+    longest_harvest = std::max(longest_harvest, Clock::now() - start);
+    harvests++;
+  }
+  done = true;
+  for (std::thread &adder : adders) {
+    adder.join();
+  }
+  // Two rounds: the first may only retire the last locations extracted.
+  HarvestSamples(&set, &harvested);
+  HarvestSamples(&set, &harvested);
+  if (HarvestSamples(&set, &harvested) != 0) {
+    fprintf(stderr, "traces left after the adders stopped\n");
+    return 1;
+  }
+
+  int64_t total_added = 0, dropped_harvesting = 0, dropped_idle = 0;
+  for (const AddCounts &thread : counts) {
+    total_added += thread.added;
+    dropped_harvesting += thread.dropped_harvesting;
+    dropped_idle += thread.dropped_idle;
+  }
+  int64_t total_dropped = dropped_harvesting + dropped_idle;
+  double drop_percent =
+      100.0 * total_dropped / std::max<int64_t>(total_added + total_dropped, 1);
+  int64_t total_harvested = CheckHarvested(harvested, num_threads);
+  printf("%d threads: %lld added, %lld dropped (%.3f%%: %lld during "
+         "harvests, %lld between), %lld harvested in %lld harvests, "
+         "longest %.3f ms, %.3f ms of cpu\n",
+         num_threads, static_cast<long long>(total_added),  // NOLINT
+         static_cast<long long>(total_dropped), drop_percent,  // NOLINT
+         static_cast<long long>(dropped_harvesting),           // NOLINT
+         static_cast<long long>(dropped_idle),                 // NOLINT
+         static_cast<long long>(total_harvested),              // NOLINT
+         static_cast<long long>(harvests),                     // NOLINT
+         std::chrono::duration<double, std::milli>(longest_harvest).count(),
+         longest_harvest_cpu_ms);
+  if (total_harvested != total_added) {
+    fprintf(stderr, "FAILED: harvested %lld samples, added %lld\n",
+            static_cast<long long>(total_harvested),  // NOLINT
+            static_cast<long long>(total_added));     // NOLINT
+    return 1;
+  }
+  if (drop_percent > max_drop_percent) {
+    fprintf(stderr, "FAILED: %.3f%% of the samples dropped, over %.3f%%\n",
+            drop_percent, max_drop_percent);
+    return 1;
+  }
+  if (longest_harvest_cpu_ms > max_harvest_ms) {
+    fprintf(stderr, "FAILED: a harvest took %.3f ms of cpu, over %.3f ms\n",
+            longest_harvest_cpu_ms, max_harvest_ms);
+    return 1;
+  }
+  printf("PASSED\n");
+  return 0;
+}
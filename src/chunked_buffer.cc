@@ -0,0 +1,63 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "src/chunked_buffer.h"
+
+#include <algorithm>
+
+namespace cloud {
+namespace profiler {
+
+namespace {
+
+// Chunks start small to suit small profiles, and double in size up to
+// kMaxChunkSize to keep their count low for large ones.
+const size_t kMinChunkSize = 8 * 1024;
+const size_t kMaxChunkSize = 1024 * 1024;
+
+}  // namespace
+
+bool ChunkedBuffer::OutputStream::Next(void **data, int *size) {
+  std::vector<std::shared_ptr<Chunk>> &chunks = buffer_->chunks_;
+  if (chunks.empty() || chunks.back()->size == chunks.back()->capacity) {
+    size_t capacity =
+        chunks.empty() ? kMinChunkSize
+                       : std::min(2 * chunks.back()->capacity, kMaxChunkSize);
+    chunks.push_back(std::make_shared<Chunk>(capacity));
+  }
+
+  Chunk *chunk = chunks.back().get();
+  *data = chunk->data.get() + chunk->size;
+  *size = chunk->capacity - chunk->size;
+  chunk->size = chunk->capacity;
+  buffer_->size_ += *size;
+  return true;
+}
+
+void ChunkedBuffer::OutputStream::BackUp(int count) {
+  buffer_->chunks_.back()->size -= count;
+  buffer_->size_ -= count;
+}
+
+string ChunkedBuffer::ToString() const {
+  string data;
+  data.reserve(size_);
+  for (const auto &chunk : chunks_) {
+    data.append(chunk->data.get(), chunk->size);
+  }
+  return data;
+}
+
+}  // namespace profiler
+}  // namespace cloud
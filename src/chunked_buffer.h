@@ -0,0 +1,81 @@
+/*
+ * Copyright 2018 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CLOUD_PROFILER_AGENT_JAVA_CHUNKED_BUFFER_H_
+#define CLOUD_PROFILER_AGENT_JAVA_CHUNKED_BUFFER_H_
+
+#include <memory>
+#include <vector>
+
+#include "src/globals.h"
+#include "google/protobuf/io/zero_copy_stream.h"
+
+namespace cloud {
+namespace profiler {
+
+// ChunkedBuffer holds data in a list of separately allocated chunks, so
+// that it grows without moving the data already written. The chunks are
+// reference counted, which lets the transports send them as is, even
+// past the lifetime of the buffer.
+class ChunkedBuffer {
+ public:
+  // A chunk of data, of which the first size bytes are used.
+  struct Chunk {
+    explicit Chunk(size_t capacity)
+        : data(new char[capacity]), size(0), capacity(capacity) {}
+
+    std::unique_ptr<char[]> data;
+    size_t size;
+    size_t capacity;
+  };
+
+  // Output stream appending to a ChunkedBuffer, which must outlive it.
+  class OutputStream : public google::protobuf::io::ZeroCopyOutputStream {
+   public:
+    explicit OutputStream(ChunkedBuffer *buffer) : buffer_(buffer) {}
+
+    bool Next(void **data, int *size) override;
+    void BackUp(int count) override;
+    int64_t ByteCount() const override { return buffer_->size_; }
+
+   private:
+    ChunkedBuffer *buffer_;
+    DISALLOW_COPY_AND_ASSIGN(OutputStream);
+  };
+
+  ChunkedBuffer() : size_(0) {}
+  ChunkedBuffer(ChunkedBuffer &&other) = default;
+  ChunkedBuffer &operator=(ChunkedBuffer &&other) = default;
+
+  // Returns the number of bytes in the buffer.
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+  const std::vector<std::shared_ptr<Chunk>> &chunks() const { return chunks_; }
+
+  // Returns a contiguous copy of the data, for the consumers needing it.
+  string ToString() const;
+
+ private:
+  std::vector<std::shared_ptr<Chunk>> chunks_;
+  size_t size_;
+  DISALLOW_COPY_AND_ASSIGN(ChunkedBuffer);
+};
+
+}  // namespace profiler
+}  // namespace cloud
+
+#endif  // CLOUD_PROFILER_AGENT_JAVA_CHUNKED_BUFFER_H_
@@ -0,0 +1,374 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "src/compression.h"
+
+#include <errno.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include "google/protobuf/io/gzip_stream.h"
+
+#ifdef CPROF_HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef CPROF_HAVE_LZ4
+#include <lz4frame.h>
+#endif
+
+namespace cloud {
+namespace profiler {
+
+constexpr int Compression::kDefaultLevel;
+
+namespace {
+
+using google::protobuf::io::GzipOutputStream;
+using google::protobuf::io::ZeroCopyOutputStream;
+
+#ifdef CPROF_HAVE_LZ4
+// Maximum acceleration of the lz4 fast mode.
+const int kLz4MaxAcceleration = 65537;
+#endif
+
+// Size of the uncompressed blocks handed to zstd and lz4.
+const int kBlockSize = 64 * 1024;
+
+// Stores the data as is.
+class UncompressedStream : public CompressingStream {
+ public:
+  explicit UncompressedStream(ZeroCopyOutputStream *output)
+      : output_(output) {}
+
+  bool Next(void **data, int *size) override {
+    return output_->Next(data, size);
+  }
+  void BackUp(int count) override { output_->BackUp(count); }
+  int64_t ByteCount() const override { return output_->ByteCount(); }
+  bool Close() override { return true; }
+
+ private:
+  ZeroCopyOutputStream *output_;
+  DISALLOW_COPY_AND_ASSIGN(UncompressedStream);
+};
+
+class GzipStream : public CompressingStream {
+ public:
+  GzipStream(ZeroCopyOutputStream *output, int level)
+      : gzip_(output, Options(level)) {}
+
+  bool Next(void **data, int *size) override { return gzip_.Next(data, size); }
+  void BackUp(int count) override { gzip_.BackUp(count); }
+  int64_t ByteCount() const override { return gzip_.ByteCount(); }
+  bool Close() override { return gzip_.Close(); }
+
+ private:
+  static GzipOutputStream::Options Options(int level) {
+    GzipOutputStream::Options options;
+    if (level != Compression::kDefaultLevel) {
+      options.compression_level = level;
+    }
+    return options;
+  }
+
+  GzipOutputStream gzip_;
+  DISALLOW_COPY_AND_ASSIGN(GzipStream);
+};
+
+// Base of the streams compressing whole blocks at a time: the data is
+// gathered into a block, which is compressed once full.
+class BlockCompressingStream : public CompressingStream {
+ public:
+  explicit BlockCompressingStream(ZeroCopyOutputStream *output)
+      : output_(output), block_(new char[kBlockSize]), used_(0), total_(0) {}
+
+  bool Next(void **data, int *size) override {
+    if (used_ == kBlockSize) {
+      if (!Compress(block_.get(), used_, false)) {
+        return false;
+      }
+      total_ += used_;
+      used_ = 0;
+    }
+    *data = block_.get() + used_;
+    *size = kBlockSize - used_;
+    used_ = kBlockSize;
+    return true;
+  }
+
+  void BackUp(int count) override { used_ -= count; }
+
+  int64_t ByteCount() const override { return total_ + used_; }
+
+  bool Close() override {
+    bool ok = Compress(block_.get(), used_, true);
+    total_ += used_;
+    used_ = 0;
+    return ok;
+  }
+
+ protected:
+  // Compresses size bytes of data into the output, finishing the
+  // compressed stream when last is true. Returns false on error.
+  virtual bool Compress(const char *data, int size, bool last) = 0;
+
+  // Copies compressed data to the output. Returns false on error.
+  bool Write(const char *data, size_t size) {
+    while (size > 0) {
+      void *buffer;
+      int buffer_size;
+      if (!output_->Next(&buffer, &buffer_size)) {
+        return false;
+      }
+      size_t n = std::min(size, static_cast<size_t>(buffer_size));
+      memcpy(buffer, data, n);
+      output_->BackUp(buffer_size - n);
+      data += n;
+      size -= n;
+    }
+    return true;
+  }
+
+ private:
+  ZeroCopyOutputStream *output_;
+  std::unique_ptr<char[]> block_;
+  int used_;
+  int64_t total_;
+  DISALLOW_COPY_AND_ASSIGN(BlockCompressingStream);
+};
+
+#ifdef CPROF_HAVE_ZSTD
+class ZstdStream : public BlockCompressingStream {
+ public:
+  ZstdStream(ZeroCopyOutputStream *output, int level)
+      : BlockCompressingStream(output),
+        cctx_(ZSTD_createCCtx()),
+        out_size_(ZSTD_CStreamOutSize()),
+        out_(new char[out_size_]) {
+    if (level != Compression::kDefaultLevel) {
+      ZSTD_CCtx_setParameter(cctx_, ZSTD_c_compressionLevel, level);
+    }
+  }
+
+  ~ZstdStream() override { ZSTD_freeCCtx(cctx_); }
+
+ protected:
+  bool Compress(const char *data, int size, bool last) override {
+    ZSTD_inBuffer in = {data, static_cast<size_t>(size), 0};
+    while (true) {
+      ZSTD_outBuffer out = {out_.get(), out_size_, 0};
+      size_t remaining = ZSTD_compressStream2(
+          cctx_, &out, &in, last ? ZSTD_e_end : ZSTD_e_continue);
+      if (ZSTD_isError(remaining)) {
+        LOG(ERROR) << "zstd compression failed: "
+                   << ZSTD_getErrorName(remaining);
+        return false;
+      }
+      if (!Write(out_.get(), out.pos)) {
+        return false;
+      }
+      if (last ? remaining == 0 : in.pos == in.size) {
+        return true;
+      }
+    }
+  }
+
+ private:
+  ZSTD_CCtx *cctx_;
+  size_t out_size_;
+  std::unique_ptr<char[]> out_;
+  DISALLOW_COPY_AND_ASSIGN(ZstdStream);
+};
+#endif  // CPROF_HAVE_ZSTD
+
+#ifdef CPROF_HAVE_LZ4
+class Lz4Stream : public BlockCompressingStream {
+ public:
+  Lz4Stream(ZeroCopyOutputStream *output, int level)
+      : BlockCompressingStream(output), ctx_(nullptr), started_(false) {
+    memset(&preferences_, 0, sizeof(preferences_));
+    if (level != Compression::kDefaultLevel) {
+      preferences_.compressionLevel = level;
+    }
+    // The bound covers a full block along with the frame footer, and is
+    // larger than the frame header.
+    out_size_ = LZ4F_compressBound(kBlockSize, &preferences_);
+    out_.reset(new char[out_size_]);
+    if (LZ4F_isError(LZ4F_createCompressionContext(&ctx_, LZ4F_VERSION))) {
+      ctx_ = nullptr;
+    }
+  }
+
+  ~Lz4Stream() override { LZ4F_freeCompressionContext(ctx_); }
+
+ protected:
+  bool Compress(const char *data, int size, bool last) override {
+    if (ctx_ == nullptr) {
+      LOG(ERROR) << "Failed to create the lz4 compression context";
+      return false;
+    }
+    if (!started_) {
+      started_ = true;
+      if (!Check(LZ4F_compressBegin(ctx_, out_.get(), out_size_,
+                                    &preferences_))) {
+        return false;
+      }
+    }
+    if (size > 0 && !Check(LZ4F_compressUpdate(ctx_, out_.get(), out_size_,
+                                               data, size, nullptr))) {
+      return false;
+    }
+    return !last ||
+           Check(LZ4F_compressEnd(ctx_, out_.get(), out_size_, nullptr));
+  }
+
+ private:
+  // Writes the output of an lz4 call returning a size or an error code.
+  bool Check(size_t result) {
+    if (LZ4F_isError(result)) {
+      LOG(ERROR) << "lz4 compression failed: " << LZ4F_getErrorName(result);
+      return false;
+    }
+    return Write(out_.get(), result);
+  }
+
+  LZ4F_compressionContext_t ctx_;
+  LZ4F_preferences_t preferences_;
+  bool started_;
+  size_t out_size_;
+  std::unique_ptr<char[]> out_;
+  DISALLOW_COPY_AND_ASSIGN(Lz4Stream);
+};
+#endif  // CPROF_HAVE_LZ4
+
+// Gets the range of the levels accepted by a format.
+void LevelRange(Compression::Format format, int *min_level, int *max_level) {
+  switch (format) {
+    case Compression::kNone:
+      *min_level = 0;
+      *max_level = 0;
+      return;
+    case Compression::kGzip:
+      // -1 selects the default level of zlib.
+      *min_level = -1;
+      *max_level = 9;
+      return;
+    case Compression::kZstd:
+#ifdef CPROF_HAVE_ZSTD
+      *min_level = ZSTD_minCLevel();
+      *max_level = ZSTD_maxCLevel();
+      return;
+#else
+      break;
+#endif
+    case Compression::kLz4:
+#ifdef CPROF_HAVE_LZ4
+      // Negative levels select the fast mode with that acceleration, the
+      // levels above 2 the high compression mode.
+      *min_level = -kLz4MaxAcceleration;
+      *max_level = LZ4F_compressionLevel_max();
+      return;
+#else
+      break;
+#endif
+  }
+  *min_level = 0;
+  *max_level = 0;
+}
+
+}  // namespace
+
+bool ParseCompression(const string &spec, Compression *compression) {
+  size_t colon = spec.find(':');
+  string format = spec.substr(0, colon);
+
+  Compression parsed;
+  if (format == "none") {
+    parsed.format = Compression::kNone;
+  } else if (format == "gzip") {
+    parsed.format = Compression::kGzip;
+#ifdef CPROF_HAVE_ZSTD
+  } else if (format == "zstd") {
+    parsed.format = Compression::kZstd;
+#endif
+#ifdef CPROF_HAVE_LZ4
+  } else if (format == "lz4") {
+    parsed.format = Compression::kLz4;
+#endif
+  } else {
+    LOG(ERROR) << "Unknown or unavailable compression format in '" << spec
+               << "'";
+    return false;
+  }
+
+  if (colon != string::npos) {
+    const char *level_str = spec.c_str() + colon + 1;
+    char *end;
+    errno = 0;
+    long value = strtol(level_str, &end, 10);  // NOLINT(runtime/int)
+    int min_level, max_level;
+    LevelRange(parsed.format, &min_level, &max_level);
+    if (errno != 0 || end == level_str || *end != '\0' || value < min_level ||
+        value > max_level) {
+      LOG(ERROR) << "Invalid compression level in '" << spec << "', "
+                 << format << " levels range from " << min_level << " to "
+                 << max_level;
+      return false;
+    }
+    parsed.level = value;
+  }
+  *compression = parsed;
+  return true;
+}
+
+const char *CompressionExtension(const Compression &compression) {
+  switch (compression.format) {
+    case Compression::kNone:
+      return ".pb";
+    case Compression::kGzip:
+      return ".pb.gz";
+    case Compression::kZstd:
+      return ".pb.zst";
+    case Compression::kLz4:
+      return ".pb.lz4";
+  }
+  return ".pb";
+}
+
+std::unique_ptr<CompressingStream> NewCompressingStream(
+    const Compression &compression, ZeroCopyOutputStream *output) {
+  switch (compression.format) {
+    case Compression::kNone:
+      return std::unique_ptr<CompressingStream>(
+          new UncompressedStream(output));
+#ifdef CPROF_HAVE_ZSTD
+    case Compression::kZstd:
+      return std::unique_ptr<CompressingStream>(
+          new ZstdStream(output, compression.level));
+#endif
+#ifdef CPROF_HAVE_LZ4
+    case Compression::kLz4:
+      return std::unique_ptr<CompressingStream>(
+          new Lz4Stream(output, compression.level));
+#endif
+    default:
+      return std::unique_ptr<CompressingStream>(
+          new GzipStream(output, compression.level));
+  }
+}
+
+}  // namespace profiler
+}  // namespace cloud
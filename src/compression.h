@@ -0,0 +1,70 @@
+/*
+ * Copyright 2018 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CLOUD_PROFILER_AGENT_JAVA_COMPRESSION_H_
+#define CLOUD_PROFILER_AGENT_JAVA_COMPRESSION_H_
+
+#include <limits>
+#include <memory>
+
+#include "src/globals.h"
+#include "google/protobuf/io/zero_copy_stream.h"
+
+namespace cloud {
+namespace profiler {
+
+// Compression of the encoded profiles. zstd and lz4 are only available
+// when the agent is built with their libraries (CPROF_HAVE_ZSTD and
+// CPROF_HAVE_LZ4), and only gzip profiles can be read by pprof.
+struct Compression {
+  enum Format { kNone, kGzip, kZstd, kLz4 };
+
+  // Selects the default level of the format.
+  static constexpr int kDefaultLevel = std::numeric_limits<int>::min();
+
+  Compression() : format(kGzip), level(kDefaultLevel) {}
+  Compression(Format format, int level) : format(format), level(level) {}
+
+  Format format;
+  int level;
+};
+
+// Parses a compression given as "<format>[:<level>]", where format is
+// one of none, gzip, zstd or lz4, e.g. "gzip:9". Returns false if the
+// format is unknown or was not built in, or if the level is out of the
+// range of the format.
+bool ParseCompression(const string &spec, Compression *compression);
+
+// Returns the file name extension of profiles compressed this way.
+const char *CompressionExtension(const Compression &compression);
+
+// Output stream compressing the data written to it into another stream.
+class CompressingStream : public google::protobuf::io::ZeroCopyOutputStream {
+ public:
+  // Writes the remaining compressed data to the underlying stream.
+  // Returns false on error. Nothing can be written after this.
+  virtual bool Close() = 0;
+};
+
+// Returns a stream compressing into output, which must outlive it.
+std::unique_ptr<CompressingStream> NewCompressingStream(
+    const Compression &compression,
+    google::protobuf::io::ZeroCopyOutputStream *output);
+
+}  // namespace profiler
+}  // namespace cloud
+
+#endif  // CLOUD_PROFILER_AGENT_JAVA_COMPRESSION_H_
@@ -0,0 +1,255 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "src/contention_profiler.h"
+
+#include <math.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <memory>
+#include <mutex>  // NOLINT
+#include <vector>
+
+#include "src/clock.h"
+#include "src/proto.h"
+
+DEFINE_bool(cprof_enable_contention_profiling, false,
+            "when true, collect profiles of the time spent waiting to enter "
+            "contended Java monitors");
+DEFINE_int32(cprof_contention_sampling_period_usec, 1000,
+             "average monitor contention delay between two recorded stacks, "
+             "in microseconds; 0 records the stacks of all the contentions");
+
+namespace cloud {
+namespace profiler {
+
+std::atomic<bool> ContentionMonitor::enabled_;
+
+namespace {
+
+// Maximum number of contentions recorded in a profile, the ones beyond
+// are dropped.
+const size_t kMaxContentions = 64 * 1024;
+
+struct Contention {
+  int64_t delay_nanos;
+  std::vector<google::javaprofiler::JVMPI_CallFrame> frames;
+};
+
+// Protects the contentions recorded for the current profile.
+std::mutex contentions_mutex;
+std::vector<Contention> contentions;
+// Monotonic time at which the recording of the current profile started,
+// 0 when not recording.
+std::atomic<int64_t> recording_since_nanos;
+std::atomic<int64_t> dropped_contentions;
+
+// Monotonic time at which the current thread started to wait on a monitor.
+__thread int64_t contended_since_nanos;
+// State of the random number generator of the current thread.
+__thread uint64_t random_state;
+
+int64_t MonotonicNanos() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return TimeSpecToNanos(now);
+}
+
+// Returns a random number uniformly distributed in [0, 1), from a
+// xorshift generator private to the current thread.
+double NextRandom() {
+  if (random_state == 0) {
+    random_state = static_cast<uint64_t>(MonotonicNanos()) | 1;
+  }
+  random_state ^= random_state << 13;
+  random_state ^= random_state >> 7;
+  random_state ^= random_state << 17;
+  return (random_state >> 11) * (1.0 / (uint64_t(1) << 53));
+}
+
+// Picks the contentions to record as a Poisson process over their delay,
+// so that a contention is recorded with probability 1-exp(-D/P) for a
+// delay D and a sampling period P.
+bool SampleContention(int64_t delay_nanos) {
+  double period_nanos =
+      FLAGS_cprof_contention_sampling_period_usec * 1000.0;
+  if (period_nanos <= 0) {
+    return true;
+  }
+  return NextRandom() < 1 - exp(-delay_nanos / period_nanos);
+}
+
+void JNICALL OnMonitorContendedEnter(jvmtiEnv *jvmti, JNIEnv *jni,
+                                     jthread thread, jobject object) {
+  IMPLICITLY_USE(jvmti);
+  IMPLICITLY_USE(jni);
+  IMPLICITLY_USE(thread);
+  IMPLICITLY_USE(object);
+  contended_since_nanos = MonotonicNanos();
+}
+
+void JNICALL OnMonitorContendedEntered(jvmtiEnv *jvmti, JNIEnv *jni,
+                                       jthread thread, jobject object) {
+  IMPLICITLY_USE(jni);
+  IMPLICITLY_USE(object);
+  int64_t since = recording_since_nanos.load(std::memory_order_acquire);
+  if (since == 0 || contended_since_nanos < since) {
+    // Not recording, or the wait started before the recording.
+    return;
+  }
+  int64_t delay_nanos = MonotonicNanos() - contended_since_nanos;
+  if (!SampleContention(delay_nanos)) {
+    return;
+  }
+
+  jvmtiFrameInfo frames[kMaxFramesToCapture];
+  jint frame_count = 0;
+  if (jvmti->GetStackTrace(thread, 0, kMaxFramesToCapture, frames,
+                           &frame_count) != JVMTI_ERROR_NONE) {
+    return;
+  }
+  Contention contention;
+  contention.delay_nanos = delay_nanos;
+  contention.frames.resize(frame_count);
+  for (int i = 0; i < frame_count; i++) {
+    contention.frames[i].lineno = static_cast<jint>(frames[i].location);
+    contention.frames[i].method_id = frames[i].method;
+  }
+
+  std::lock_guard<std::mutex> lock(contentions_mutex);
+  if (contentions.size() >= kMaxContentions) {
+    dropped_contentions.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  contentions.push_back(std::move(contention));
+}
+
+// Sets the notification mode of the monitor contention events.
+bool SetContentionEvents(jvmtiEnv *jvmti, jvmtiEventMode mode) {
+  JVMTI_ERROR_1(jvmti->SetEventNotificationMode(
+                    mode, JVMTI_EVENT_MONITOR_CONTENDED_ENTER, nullptr),
+                false);
+  JVMTI_ERROR_1(jvmti->SetEventNotificationMode(
+                    mode, JVMTI_EVENT_MONITOR_CONTENDED_ENTERED, nullptr),
+                false);
+  return true;
+}
+
+}  // namespace
+
+bool ContentionMonitor::AddCapabilities(jvmtiEnv *jvmti) {
+  if (!FLAGS_cprof_enable_contention_profiling) {
+    return false;
+  }
+  jvmtiCapabilities all_caps;
+  jvmtiError err = jvmti->GetPotentialCapabilities(&all_caps);
+  if (err != JVMTI_ERROR_NONE || !all_caps.can_generate_monitor_events) {
+    LOG(WARNING) << "Monitor events are not supported by this JVM, "
+                 << "contention profiles disabled";
+    return false;
+  }
+
+  jvmtiCapabilities caps;
+  memset(&caps, 0, sizeof(caps));
+  caps.can_generate_monitor_events = 1;
+  if ((err = jvmti->AddCapabilities(&caps)) != JVMTI_ERROR_NONE) {
+    LOG(ERROR) << "Failed to add monitor event capabilities with error "
+               << err;
+    return false;
+  }
+  enabled_.store(true, std::memory_order_release);
+  return true;
+}
+
+void ContentionMonitor::AddCallbacks(jvmtiEventCallbacks *callbacks) {
+  if (Enabled()) {
+    callbacks->MonitorContendedEnter = &OnMonitorContendedEnter;
+    callbacks->MonitorContendedEntered = &OnMonitorContendedEntered;
+  }
+}
+
+ChunkedBuffer ContentionMonitor::Collect(jvmtiEnv *jvmti,
+                                         int64_t duration_nanos,
+                                         const Compression &compression) {
+  if (!Enabled()) {
+    LOG(ERROR) << "Contention profiling is disabled, no profile collected";
+    return ChunkedBuffer();
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(contentions_mutex);
+    contentions.clear();
+  }
+  dropped_contentions.store(0, std::memory_order_relaxed);
+  recording_since_nanos.store(MonotonicNanos(), std::memory_order_release);
+  bool ok = SetContentionEvents(jvmti, JVMTI_ENABLE);
+  if (ok) {
+    DefaultClock()->SleepFor(NanosToTimeSpec(duration_nanos));
+  }
+  SetContentionEvents(jvmti, JVMTI_DISABLE);
+  recording_since_nanos.store(0, std::memory_order_release);
+  if (!ok) {
+    return ChunkedBuffer();
+  }
+
+  std::vector<Contention> recorded;
+  {
+    std::lock_guard<std::mutex> lock(contentions_mutex);
+    recorded.swap(contentions);
+  }
+
+  // The builder does not unsample the contention profiles, so each
+  // recorded contention is scaled by the inverse of its probability.
+  int64_t period_micros = FLAGS_cprof_contention_sampling_period_usec;
+  std::vector<google::javaprofiler::JVMPI_CallTrace> traces(recorded.size());
+  std::vector<google::javaprofiler::ProfileStackTrace> stack_traces(
+      recorded.size());
+  std::vector<int32_t> counts(recorded.size());
+  for (size_t i = 0; i < recorded.size(); i++) {
+    Contention &contention = recorded[i];
+    int64_t delay_nanos = std::max<int64_t>(contention.delay_nanos, 1);
+    double ratio = google::javaprofiler::CalculateSamplingRatio(
+        period_micros * 1000, 1, delay_nanos);
+    traces[i].env_id = nullptr;
+    traces[i].num_frames = contention.frames.size();
+    traces[i].frames = contention.frames.data();
+    stack_traces[i].trace = &traces[i];
+    stack_traces[i].metric_value = llround(delay_nanos * ratio / 1000);
+    counts[i] = static_cast<int32_t>(llround(ratio));
+  }
+
+  JavaFrameCache cache;
+  std::unique_ptr<google::javaprofiler::ProfileProtoBuilder> builder =
+      google::javaprofiler::ProfileProtoBuilder::ForContention(
+          jvmti, period_micros, &cache);
+  builder->AddTraces(stack_traces.data(), counts.data(), stack_traces.size());
+  std::unique_ptr<perftools::profiles::Profile> profile =
+      builder->CreateProto();
+  profile->set_duration_nanos(duration_nanos);
+  ChunkedBuffer output = EncodeProfile(*profile, compression);
+  if (output.empty()) {
+    LOG(ERROR) << "Failed to encode the contention profile";
+    return ChunkedBuffer();
+  }
+  LOG(INFO) << "Collected a contention profile: " << recorded.size()
+            << " contentions recorded, "
+            << dropped_contentions.load(std::memory_order_relaxed)
+            << " dropped";
+  return output;
+}
+
+}  // namespace profiler
+}  // namespace cloud
@@ -0,0 +1,61 @@
+/*
+ * Copyright 2018 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CLOUD_PROFILER_AGENT_JAVA_CONTENTION_PROFILER_H_
+#define CLOUD_PROFILER_AGENT_JAVA_CONTENTION_PROFILER_H_
+
+#include <atomic>
+
+#include "src/chunked_buffer.h"
+#include "src/compression.h"
+#include "src/globals.h"
+
+namespace cloud {
+namespace profiler {
+
+// ContentionMonitor profiles the time the Java threads wait to enter
+// contended monitors, through the MonitorContendedEnter and
+// MonitorContendedEntered events. The events are only enabled while a
+// profile is collected. The stacks are only recorded for a sample of the
+// contentions, picked with a probability growing with their delay.
+class ContentionMonitor {
+ public:
+  // Adds the capabilities needed by the contention profiles when they are
+  // requested and supported by the JVM. Must be called while the agent is
+  // loaded. Returns whether contention profiles can be collected.
+  static bool AddCapabilities(jvmtiEnv *jvmti);
+
+  // Sets the callbacks of the monitor events, if their capabilities were
+  // added.
+  static void AddCallbacks(jvmtiEventCallbacks *callbacks);
+
+  static bool Enabled() { return enabled_.load(std::memory_order_acquire); }
+
+  // Records the contentions for the given duration, and returns their
+  // profile compressed as requested, or an empty buffer on error.
+  static ChunkedBuffer Collect(jvmtiEnv *jvmti, int64_t duration_nanos,
+                               const Compression &compression);
+
+ private:
+  static std::atomic<bool> enabled_;
+
+  DISALLOW_IMPLICIT_CONSTRUCTORS(ContentionMonitor);
+};
+
+}  // namespace profiler
+}  // namespace cloud
+
+#endif  // CLOUD_PROFILER_AGENT_JAVA_CONTENTION_PROFILER_H_
@@ -16,6 +16,8 @@
 
 #include <string>
 
+#include "src/contention_profiler.h"
+#include "src/heap_profiler.h"
 #include "src/string.h"
 #include "src/worker.h"
 #include "third_party/javaprofiler/globals.h"
@@ -111,6 +113,7 @@ void JNICALL OnVMInit(jvmtiEnv *jvmti, JNIEnv *jni_env, jthread thread) {
     jclass klass = class_list[i];
     CreateJMethodIDsForClass(jvmti, klass);
   }
+  HeapMonitor::Enable(jvmti, jni_env);
   worker->Start(jni_env);
 }
 
@@ -126,9 +129,9 @@ void JNICALL OnClassPrepare(jvmtiEnv *jvmti_env, JNIEnv *jni_env,
 }
 
 void JNICALL OnVMDeath(jvmtiEnv *jvmti_env, JNIEnv *jni_env) {
-  IMPLICITLY_USE(jvmti_env);
   IMPLICITLY_USE(jni_env);
   LOG(INFO) << "On VM death";
+  HeapMonitor::Disable(jvmti_env);
   worker->Stop();
   delete worker;
   worker = NULL;
@@ -201,6 +204,11 @@ static bool RegisterJvmti(jvmtiEnv *jvmti) {
     events.push_back(JVMTI_EVENT_COMPILED_METHOD_LOAD);
   }
 
+  // The heap sampling events are enabled once the VM is initialized, and
+  // the monitor events only while collecting a contention profile.
+  HeapMonitor::AddCallbacks(callbacks);
+  ContentionMonitor::AddCallbacks(callbacks);
+
   JVMTI_ERROR_1(
       (jvmti->SetEventCallbacks(callbacks, sizeof(jvmtiEventCallbacks))),
       false);
@@ -261,6 +269,9 @@ jint JNICALL Agent_OnLoad(JavaVM *vm, char *options, void *reserved) {
     LOG(ERROR) << "Failed to initialize JVMTI.  Continuing...";
     return 0;
   }
+  // Optional, the other profiles are still collected without them.
+  HeapMonitor::AddCapabilities(jvmti);
+  ContentionMonitor::AddCapabilities(jvmti);
 
   // The process exit will free the memory. See comments to the variable on why.
   // Initialize before registering the JVMTI callbacks to avoid the unlikely
@@ -0,0 +1,442 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "src/heap_profiler.h"
+
+#include <string.h>
+
+#include <chrono>              // NOLINT(build/c++11)
+#include <condition_variable>  // NOLINT(build/c++11)
+#include <memory>
+#include <mutex>  // NOLINT
+#include <vector>
+
+#include "src/clock.h"
+#include "src/proto.h"
+
+DEFINE_bool(cprof_enable_heap_sampling, false,
+            "when true, sample the allocations of the JVM to collect heap "
+            "profiles; requires JDK 11 or later");
+DEFINE_int32(cprof_heap_sampling_interval, 512 * 1024,
+             "average number of bytes allocated between two sampled objects");
+DEFINE_int32(cprof_heap_max_samples, 64 * 1024,
+             "maximum number of sampled objects tracked at a time, the "
+             "samples beyond are dropped");
+
+namespace cloud {
+namespace profiler {
+
+std::atomic<bool> HeapMonitor::enabled_;
+
+namespace {
+
+// Number of slots tried when recording a sample before dropping it.
+const int kMaxProbes = 16;
+
+// Longest delay before the samples of the collected objects are released,
+// in case the garbage collection notification was missed.
+const int kSweepTimeoutMillis = 1000;
+
+struct HeapSample {
+  jweak object;
+  int64_t size;
+  std::vector<google::javaprofiler::JVMPI_CallFrame> frames;
+  // Whether the sample was already part of an alloc profile.
+  bool reported;
+};
+
+// HeapSampleTable tracks the sampled objects. Samples are recorded from
+// the allocating threads without locking, in a fixed array of slots. The
+// samples are only released and read while holding the mutex of the
+// table, which the allocating threads never take.
+class HeapSampleTable {
+ public:
+  explicit HeapSampleTable(int capacity)
+      : capacity_(capacity),
+        slots_(new std::atomic<HeapSample *>[capacity]),
+        cursor_(0),
+        dropped_(0) {
+    for (int i = 0; i < capacity_; i++) {
+      slots_[i].store(nullptr, std::memory_order_relaxed);
+    }
+  }
+
+  // Records a sample in a free slot. Returns false when no free slot was
+  // found, in which case the sample remains owned by the caller.
+  bool Add(HeapSample *sample) {
+    uint64_t start = cursor_.fetch_add(1, std::memory_order_relaxed);
+    for (int i = 0; i < kMaxProbes; i++) {
+      std::atomic<HeapSample *> &slot = slots_[(start + i) % capacity_];
+      HeapSample *expected = nullptr;
+      if (slot.load(std::memory_order_relaxed) == nullptr &&
+          slot.compare_exchange_strong(expected, sample,
+                                       std::memory_order_release,
+                                       std::memory_order_relaxed)) {
+        return true;
+      }
+    }
+    dropped_.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+
+  // Releases the samples of the objects that were garbage collected. The
+  // ones not reported yet are kept for the next alloc profile.
+  void Sweep(JNIEnv *jni) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    SweepLocked(jni);
+  }
+
+  // Calls fn with the samples of the live objects. The samples are only
+  // valid during the call, which holds the lock of the table.
+  template <typename Fn>
+  void WithLive(JNIEnv *jni, Fn fn) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    SweepLocked(jni);
+    std::vector<HeapSample *> live;
+    for (int i = 0; i < capacity_; i++) {
+      HeapSample *sample = slots_[i].load(std::memory_order_acquire);
+      if (sample != nullptr) {
+        live.push_back(sample);
+      }
+    }
+    fn(live);
+  }
+
+  // Calls fn with the samples not reported yet, of live or collected
+  // objects, and marks them as reported.
+  template <typename Fn>
+  void WithUnreported(JNIEnv *jni, Fn fn) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    SweepLocked(jni);
+    std::vector<HeapSample *> unreported;
+    for (int i = 0; i < capacity_; i++) {
+      HeapSample *sample = slots_[i].load(std::memory_order_acquire);
+      if (sample != nullptr && !sample->reported) {
+        unreported.push_back(sample);
+      }
+    }
+    for (const auto &sample : collected_) {
+      unreported.push_back(sample.get());
+    }
+    fn(unreported);
+    for (HeapSample *sample : unreported) {
+      sample->reported = true;
+    }
+    collected_.clear();
+  }
+
+  int64_t Dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+ private:
+  void SweepLocked(JNIEnv *jni) {
+    for (int i = 0; i < capacity_; i++) {
+      HeapSample *sample = slots_[i].load(std::memory_order_acquire);
+      if (sample == nullptr || !jni->IsSameObject(sample->object, nullptr)) {
+        continue;
+      }
+      // Only the sweep empties the slots, so nothing replaced the sample.
+      slots_[i].store(nullptr, std::memory_order_relaxed);
+      jni->DeleteWeakGlobalRef(sample->object);
+      sample->object = nullptr;
+      if (!sample->reported && collected_.size() < capacity_) {
+        collected_.emplace_back(sample);
+      } else {
+        delete sample;
+      }
+    }
+  }
+
+  const int capacity_;
+  std::unique_ptr<std::atomic<HeapSample *>[]> slots_;
+  // Spreads the concurrent additions over the slots.
+  std::atomic<uint64_t> cursor_;
+  std::atomic<int64_t> dropped_;
+
+  std::mutex mutex_;
+  // Samples of the collected objects, waiting for the next alloc profile.
+  std::vector<std::unique_ptr<HeapSample>> collected_;
+
+  DISALLOW_COPY_AND_ASSIGN(HeapSampleTable);
+};
+
+// Never deallocated, as the allocation events may still be delivered
+// while the agent is unloading.
+HeapSampleTable *samples;
+
+#ifdef CPROF_HAVE_HEAP_SAMPLING
+// Synchronizes the garbage collections with the sweeping thread.
+std::mutex sweep_mutex;
+std::condition_variable sweep_cv;
+std::atomic<int64_t> gc_count;
+bool sweeper_running;
+bool sweeper_stopping;
+
+void JNICALL OnSampledObjectAlloc(jvmtiEnv *jvmti, JNIEnv *jni, jthread thread,
+                                  jobject object, jclass klass, jlong size) {
+  IMPLICITLY_USE(klass);
+  jvmtiFrameInfo frames[kMaxFramesToCapture];
+  jint frame_count = 0;
+  if (samples == nullptr ||
+      jvmti->GetStackTrace(thread, 0, kMaxFramesToCapture, frames,
+                           &frame_count) != JVMTI_ERROR_NONE) {
+    return;
+  }
+
+  HeapSample *sample = new HeapSample();
+  sample->size = size;
+  sample->reported = false;
+  sample->frames.resize(frame_count);
+  for (int i = 0; i < frame_count; i++) {
+    sample->frames[i].lineno = static_cast<jint>(frames[i].location);
+    sample->frames[i].method_id = frames[i].method;
+  }
+  sample->object = jni->NewWeakGlobalRef(object);
+  if (sample->object == nullptr || !samples->Add(sample)) {
+    if (sample->object != nullptr) {
+      jni->DeleteWeakGlobalRef(sample->object);
+    }
+    delete sample;
+  }
+}
+
+// Runs at the end of the garbage collections, where JNI cannot be used:
+// the samples are released by the sweeping thread instead.
+void JNICALL OnGarbageCollectionFinish(jvmtiEnv *jvmti) {
+  IMPLICITLY_USE(jvmti);
+  gc_count.fetch_add(1, std::memory_order_release);
+  sweep_cv.notify_all();
+}
+
+void SweepThread(jvmtiEnv *jvmti_env, JNIEnv *jni_env, void *arg) {
+  IMPLICITLY_USE(jvmti_env);
+  IMPLICITLY_USE(arg);
+  int64_t swept = gc_count.load(std::memory_order_acquire);
+  std::unique_lock<std::mutex> lock(sweep_mutex);
+  while (!sweeper_stopping) {
+    // The notification of the collection does not hold the mutex and can
+    // be missed, so wake up periodically as well.
+    sweep_cv.wait_for(lock, std::chrono::milliseconds(kSweepTimeoutMillis),
+                      [&swept] {
+                        return sweeper_stopping ||
+                               gc_count.load(std::memory_order_acquire) !=
+                                   swept;
+                      });
+    int64_t count = gc_count.load(std::memory_order_acquire);
+    if (sweeper_stopping || count == swept) {
+      continue;
+    }
+    swept = count;
+    lock.unlock();
+    samples->Sweep(jni_env);
+    lock.lock();
+  }
+  sweeper_running = false;
+  sweep_cv.notify_all();
+}
+
+// Asks the sweeping thread to exit, and waits for it.
+void StopSweepThread() {
+  std::unique_lock<std::mutex> lock(sweep_mutex);
+  sweeper_stopping = true;
+  sweep_cv.notify_all();
+  sweep_cv.wait(lock, [] { return !sweeper_running; });
+}
+#endif  // CPROF_HAVE_HEAP_SAMPLING
+
+struct timespec last_alloc_profile;
+
+// Encodes the samples into a profile, compressed as requested.
+ChunkedBuffer BuildProfile(
+    google::javaprofiler::ProfileProtoBuilder *builder,
+    const std::vector<HeapSample *> &heap_samples,
+    int64_t duration_nanos, const Compression &compression) {
+  std::vector<google::javaprofiler::JVMPI_CallTrace> traces(
+      heap_samples.size());
+  std::vector<google::javaprofiler::ProfileStackTrace> stack_traces(
+      heap_samples.size());
+  for (size_t i = 0; i < heap_samples.size(); i++) {
+    const HeapSample *sample = heap_samples[i];
+    traces[i].env_id = nullptr;
+    traces[i].num_frames = sample->frames.size();
+    traces[i].frames =
+        const_cast<google::javaprofiler::JVMPI_CallFrame *>(
+            sample->frames.data());
+    stack_traces[i].trace = &traces[i];
+    stack_traces[i].metric_value = sample->size;
+  }
+  builder->AddTraces(stack_traces.data(), stack_traces.size());
+
+  std::unique_ptr<perftools::profiles::Profile> profile =
+      builder->CreateProto();
+  if (duration_nanos > 0) {
+    profile->set_duration_nanos(duration_nanos);
+  }
+  ChunkedBuffer output = EncodeProfile(*profile, compression);
+  if (output.empty()) {
+    LOG(ERROR) << "Failed to encode the heap profile";
+    return ChunkedBuffer();
+  }
+  LOG(INFO) << "Collected a heap profile: " << heap_samples.size()
+            << " samples, " << (samples != nullptr ? samples->Dropped() : 0)
+            << " dropped overall";
+  return output;
+}
+
+}  // namespace
+
+bool HeapMonitor::AddCapabilities(jvmtiEnv *jvmti) {
+  if (!FLAGS_cprof_enable_heap_sampling) {
+    return false;
+  }
+#ifdef CPROF_HAVE_HEAP_SAMPLING
+  jvmtiCapabilities all_caps;
+  jvmtiError err = jvmti->GetPotentialCapabilities(&all_caps);
+  if (err != JVMTI_ERROR_NONE ||
+      !all_caps.can_generate_sampled_object_alloc_events ||
+      !all_caps.can_generate_garbage_collection_events) {
+    LOG(WARNING) << "Heap sampling is not supported by this JVM, "
+                 << "heap profiles disabled";
+    return false;
+  }
+
+  jvmtiCapabilities caps;
+  memset(&caps, 0, sizeof(caps));
+  caps.can_generate_sampled_object_alloc_events = 1;
+  caps.can_generate_garbage_collection_events = 1;
+  if ((err = jvmti->AddCapabilities(&caps)) != JVMTI_ERROR_NONE) {
+    LOG(ERROR) << "Failed to add heap sampling capabilities with error "
+               << err;
+    return false;
+  }
+  samples = new HeapSampleTable(FLAGS_cprof_heap_max_samples);
+  return true;
+#else
+  LOG(WARNING) << "Heap sampling was not built in, it requires the jvmti.h "
+               << "of JDK 11 or later";
+  return false;
+#endif
+}
+
+void HeapMonitor::AddCallbacks(jvmtiEventCallbacks *callbacks) {
+#ifdef CPROF_HAVE_HEAP_SAMPLING
+  if (samples != nullptr) {
+    callbacks->SampledObjectAlloc = &OnSampledObjectAlloc;
+    callbacks->GarbageCollectionFinish = &OnGarbageCollectionFinish;
+  }
+#endif
+}
+
+bool HeapMonitor::Enable(jvmtiEnv *jvmti, JNIEnv *jni) {
+#ifdef CPROF_HAVE_HEAP_SAMPLING
+  if (samples == nullptr) {
+    return false;
+  }
+
+  jclass cls = jni->FindClass("java/lang/Thread");
+  jmethodID constructor = jni->GetMethodID(cls, "<init>", "()V");
+  jobject thread = jni->NewGlobalRef(jni->NewObject(cls, constructor));
+  if (thread == nullptr) {
+    LOG(ERROR) << "Failed to construct cloud profiler heap sweeping thread";
+    return false;
+  }
+  sweeper_running = true;
+  if (jvmti->RunAgentThread(thread, SweepThread, nullptr,
+                            JVMTI_THREAD_MIN_PRIORITY) != JVMTI_ERROR_NONE) {
+    LOG(ERROR) << "Failed to start cloud profiler heap sweeping thread";
+    sweeper_running = false;
+    return false;
+  }
+
+  jvmtiError err = jvmti->SetHeapSamplingInterval(
+      FLAGS_cprof_heap_sampling_interval);
+  if (err == JVMTI_ERROR_NONE) {
+    err = jvmti->SetEventNotificationMode(
+        JVMTI_ENABLE, JVMTI_EVENT_GARBAGE_COLLECTION_FINISH, nullptr);
+  }
+  if (err == JVMTI_ERROR_NONE) {
+    err = jvmti->SetEventNotificationMode(
+        JVMTI_ENABLE, JVMTI_EVENT_SAMPLED_OBJECT_ALLOC, nullptr);
+  }
+  if (err != JVMTI_ERROR_NONE) {
+    LOG(ERROR) << "Failed to enable the heap sampling with error " << err;
+    jvmti->SetEventNotificationMode(
+        JVMTI_DISABLE, JVMTI_EVENT_GARBAGE_COLLECTION_FINISH, nullptr);
+    StopSweepThread();
+    return false;
+  }
+  last_alloc_profile = DefaultClock()->Now();
+  enabled_.store(true, std::memory_order_release);
+  LOG(INFO) << "Sampling the heap every "
+            << FLAGS_cprof_heap_sampling_interval << " bytes";
+  return true;
+#else
+  return false;
+#endif
+}
+
+void HeapMonitor::Disable(jvmtiEnv *jvmti) {
+#ifdef CPROF_HAVE_HEAP_SAMPLING
+  if (!enabled_.exchange(false)) {
+    return;
+  }
+  JVMTI_ERROR(jvmti->SetEventNotificationMode(
+      JVMTI_DISABLE, JVMTI_EVENT_SAMPLED_OBJECT_ALLOC, nullptr));
+  JVMTI_ERROR(jvmti->SetEventNotificationMode(
+      JVMTI_DISABLE, JVMTI_EVENT_GARBAGE_COLLECTION_FINISH, nullptr));
+  StopSweepThread();
+#endif
+}
+
+ChunkedBuffer HeapMonitor::InuseProfile(jvmtiEnv *jvmti, JNIEnv *jni,
+                                        const Compression &compression) {
+  if (!Enabled()) {
+    LOG(ERROR) << "Heap sampling is disabled, no heap profile collected";
+    return ChunkedBuffer();
+  }
+  JavaFrameCache cache;
+  std::unique_ptr<google::javaprofiler::ProfileProtoBuilder> builder =
+      google::javaprofiler::ProfileProtoBuilder::ForHeap(
+          jvmti, FLAGS_cprof_heap_sampling_interval, &cache);
+  ChunkedBuffer profile;
+  samples->WithLive(jni, [&](const std::vector<HeapSample *> &live) {
+    profile = BuildProfile(builder.get(), live, 0, compression);
+  });
+  return profile;
+}
+
+ChunkedBuffer HeapMonitor::AllocProfile(jvmtiEnv *jvmti, JNIEnv *jni,
+                                        const Compression &compression) {
+  if (!Enabled()) {
+    LOG(ERROR) << "Heap sampling is disabled, no alloc profile collected";
+    return ChunkedBuffer();
+  }
+  JavaFrameCache cache;
+  std::unique_ptr<google::javaprofiler::ProfileProtoBuilder> builder =
+      google::javaprofiler::ProfileProtoBuilder::ForHeapAlloc(
+          jvmti, FLAGS_cprof_heap_sampling_interval, &cache);
+  struct timespec now = DefaultClock()->Now();
+  int64_t duration_nanos =
+      TimeSpecToNanos(now) - TimeSpecToNanos(last_alloc_profile);
+  last_alloc_profile = now;
+  ChunkedBuffer profile;
+  samples->WithUnreported(
+      jni, [&](const std::vector<HeapSample *> &allocated) {
+        profile = BuildProfile(builder.get(), allocated, duration_nanos,
+                               compression);
+      });
+  return profile;
+}
+
+}  // namespace profiler
+}  // namespace cloud
@@ -0,0 +1,76 @@
+/*
+ * Copyright 2018 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CLOUD_PROFILER_AGENT_JAVA_HEAP_PROFILER_H_
+#define CLOUD_PROFILER_AGENT_JAVA_HEAP_PROFILER_H_
+
+#include <atomic>
+
+#include "src/chunked_buffer.h"
+#include "src/compression.h"
+#include "src/globals.h"
+
+namespace cloud {
+namespace profiler {
+
+// HeapMonitor samples the allocations of the JVM through the
+// SampledObjectAlloc event of JDK 11, and keeps the stacks of the sampled
+// objects until they are garbage collected. It builds the profiles of the
+// sampled objects still alive (inuse) and of all the sampled ones (alloc).
+// The heap sampling is only available when built against the jvmti.h of
+// JDK 11 or later, and run on such a JVM.
+class HeapMonitor {
+ public:
+  // Adds the capabilities needed by the heap sampling when it is
+  // requested and supported by the JVM. Must be called while the agent
+  // is loaded. Returns whether the heap sampling can be enabled.
+  static bool AddCapabilities(jvmtiEnv *jvmti);
+
+  // Sets the callbacks of the heap sampling events, if its capabilities
+  // were added.
+  static void AddCallbacks(jvmtiEventCallbacks *callbacks);
+
+  // Starts sampling the allocations, and the thread releasing the samples
+  // of the collected objects after each garbage collection. Must be
+  // called once the VM is initialized.
+  static bool Enable(jvmtiEnv *jvmti, JNIEnv *jni);
+
+  // Stops sampling the allocations, and waits for the thread releasing
+  // the samples to exit.
+  static void Disable(jvmtiEnv *jvmti);
+
+  static bool Enabled() { return enabled_.load(std::memory_order_acquire); }
+
+  // Returns the profile of the sampled objects still alive, compressed as
+  // requested, or an empty buffer on error.
+  static ChunkedBuffer InuseProfile(jvmtiEnv *jvmti, JNIEnv *jni,
+                                    const Compression &compression);
+
+  // Returns the profile of the objects sampled since the previous alloc
+  // profile, whether still alive or not, or an empty buffer on error.
+  static ChunkedBuffer AllocProfile(jvmtiEnv *jvmti, JNIEnv *jni,
+                                    const Compression &compression);
+
+ private:
+  static std::atomic<bool> enabled_;
+
+  DISALLOW_IMPLICIT_CONSTRUCTORS(HeapMonitor);
+};
+
+}  // namespace profiler
+}  // namespace cloud
+
+#endif  // CLOUD_PROFILER_AGENT_JAVA_HEAP_PROFILER_H_
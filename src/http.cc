@@ -14,6 +14,10 @@
 
 #include "src/http.h"
 
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
 #include "curl/curl.h"
 
 namespace cloud {
@@ -21,6 +25,59 @@ namespace profiler {
 
 typedef long curl_long_t;  // NOLINT 'long'
 
+namespace {
+
+// Position of the next byte to upload from a ChunkedBuffer.
+struct ChunkedReader {
+  const ChunkedBuffer* buffer;
+  size_t chunk;
+  size_t offset;
+};
+
+// Curl read callback copying the next bytes of a ChunkedBuffer into the
+// upload buffer of curl.
+size_t ReadChunks(char* data, size_t size, size_t nitems, void* arg) {
+  ChunkedReader* reader = static_cast<ChunkedReader*>(arg);
+  const auto& chunks = reader->buffer->chunks();
+  size_t capacity = size * nitems;
+  size_t copied = 0;
+  while (copied < capacity && reader->chunk < chunks.size()) {
+    const ChunkedBuffer::Chunk& chunk = *chunks[reader->chunk];
+    size_t n = std::min(capacity - copied, chunk.size - reader->offset);
+    memcpy(data + copied, chunk.data.get() + reader->offset, n);
+    copied += n;
+    reader->offset += n;
+    if (reader->offset == chunk.size) {
+      reader->chunk++;
+      reader->offset = 0;
+    }
+  }
+  return copied;
+}
+
+// Curl seek callback moving the position of a ChunkedBuffer reader, for
+// curl to rewind the body on redirects and authentication retries.
+int SeekChunks(void* arg, curl_off_t offset, int origin) {
+  ChunkedReader* reader = static_cast<ChunkedReader*>(arg);
+  if (origin != SEEK_SET || offset < 0 ||
+      static_cast<size_t>(offset) > reader->buffer->size()) {
+    return CURL_SEEKFUNC_CANTSEEK;
+  }
+  const auto& chunks = reader->buffer->chunks();
+  size_t remaining = offset;
+  reader->chunk = 0;
+  reader->offset = 0;
+  while (reader->chunk < chunks.size() &&
+         remaining >= chunks[reader->chunk]->size) {
+    remaining -= chunks[reader->chunk]->size;
+    reader->chunk++;
+  }
+  reader->offset = remaining;
+  return CURL_SEEKFUNC_OK;
+}
+
+}  // namespace
+
 HTTPRequest::HTTPRequest() : headers_(nullptr) {
   curl_ = curl_easy_init();
   if (!curl_) {
@@ -63,10 +120,17 @@ bool HTTPRequest::DoGet(const string& url, string *data) {
   return DoRequest(url);
 }
 
-bool HTTPRequest::DoPut(const string& url, const string& data) {
-  curl_easy_setopt(curl_, CURLOPT_CUSTOMREQUEST, "PUT");
-  curl_easy_setopt(curl_, CURLOPT_POSTFIELDS, data.c_str());  // does not copy
-  curl_easy_setopt(curl_, CURLOPT_POSTFIELDSIZE, (curl_long_t)data.size());
+bool HTTPRequest::DoPut(const string& url, const ChunkedBuffer& data) {
+  ChunkedReader reader = {&data, 0, 0};
+  // Uploads are sent as PUT requests. Skip the "Expect: 100-continue"
+  // round trip curl would otherwise make for large bodies.
+  AddHeader("Expect", "");
+  curl_easy_setopt(curl_, CURLOPT_UPLOAD, (curl_long_t)1);
+  curl_easy_setopt(curl_, CURLOPT_READFUNCTION, ReadChunks);
+  curl_easy_setopt(curl_, CURLOPT_READDATA, &reader);
+  curl_easy_setopt(curl_, CURLOPT_SEEKFUNCTION, SeekChunks);
+  curl_easy_setopt(curl_, CURLOPT_SEEKDATA, &reader);
+  curl_easy_setopt(curl_, CURLOPT_INFILESIZE_LARGE, (curl_off_t)data.size());
   return DoRequest(url);
 }
 
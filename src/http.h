@@ -17,6 +17,7 @@
 #ifndef CLOUD_PROFILER_AGENT_JAVA_HTTP_H_
 #define CLOUD_PROFILER_AGENT_JAVA_HTTP_H_
 
+#include "src/chunked_buffer.h"
 #include "src/globals.h"
 
 typedef void CURL;
@@ -39,7 +40,8 @@ class HTTPRequest {
   virtual void SetTimeout(int timeout_sec);
 
   virtual bool DoGet(const string& url, string *data);
-  virtual bool DoPut(const string& url, const string& data);
+  // Sends data straight from its chunks, without gathering it first.
+  virtual bool DoPut(const string& url, const ChunkedBuffer& data);
 
   virtual int GetResponseCode();
 
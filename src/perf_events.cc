@@ -0,0 +1,168 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "src/perf_events.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include "src/threads.h"
+
+namespace cloud {
+namespace profiler {
+
+namespace {
+
+// Returns the IDs of all the threads of the process.
+std::vector<pid_t> ListThreads() {
+  std::vector<pid_t> tids;
+  DIR *dir = opendir("/proc/self/task");
+  if (dir == nullptr) {
+    LOG(ERROR) << "Failed to list the threads, error " << errno;
+    return tids;
+  }
+  while (struct dirent *entry = readdir(dir)) {
+    if (entry->d_name[0] != '.') {
+      tids.push_back(atoi(entry->d_name));
+    }
+  }
+  closedir(dir);
+  std::sort(tids.begin(), tids.end());
+  return tids;
+}
+
+}  // namespace
+
+bool LookupHardwareEvent(const string &profile_type, PerfEvent *event,
+                         int64_t *default_period) {
+  if (profile_type == "cycles") {
+    *event = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES};
+    *default_period = 10 * 1000 * 1000;
+  } else if (profile_type == "instructions") {
+    *event = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS};
+    *default_period = 10 * 1000 * 1000;
+  } else if (profile_type == "llc-misses") {
+    *event = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES};
+    *default_period = 10 * 1000;
+  } else if (profile_type == "branch-misses") {
+    *event = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES};
+    *default_period = 10 * 1000;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+bool PerfEventSampler::Start(const PerfEvent &event, int64_t period) {
+  Stop();
+  event_ = event;
+  period_ = period;
+  for (pid_t tid : ListThreads()) {
+    int fd = Open(tid);
+    if (fd != -1) {
+      fds_[tid] = fd;
+    } else if (tid == GetTid()) {
+      // The event is not available to this process.
+      LOG(WARNING) << "perf_event_open failed with error " << errno;
+      Stop();
+      return false;
+    }
+  }
+  return true;
+}
+
+void PerfEventSampler::Refresh() {
+  if (!Active()) {
+    return;
+  }
+
+  std::vector<pid_t> tids = ListThreads();
+  for (auto it = fds_.begin(); it != fds_.end();) {
+    if (!std::binary_search(tids.begin(), tids.end(), it->first)) {
+      close(it->second);
+      it = fds_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  for (pid_t tid : tids) {
+    if (fds_.find(tid) == fds_.end()) {
+      int fd = Open(tid);
+      if (fd != -1) {
+        fds_[tid] = fd;
+      }
+    }
+  }
+}
+
+void PerfEventSampler::Stop() {
+  for (const auto &entry : fds_) {
+    ioctl(entry.second, PERF_EVENT_IOC_DISABLE, 0);
+    close(entry.second);
+  }
+  fds_.clear();
+  period_ = 0;
+}
+
+int PerfEventSampler::Open(pid_t tid) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = event_.type;
+  attr.config = event_.config;
+  attr.sample_period = period_;
+  attr.wakeup_events = 1;
+  attr.disabled = 1;
+
+  int fd = syscall(__NR_perf_event_open, &attr, tid, -1, -1, 0);
+  if (fd == -1 && errno == EACCES) {
+    // Unprivileged processes may only count the events of user mode.
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    fd = syscall(__NR_perf_event_open, &attr, tid, -1, -1, 0);
+  }
+  if (fd == -1) {
+    return -1;
+  }
+
+  // Deliver the overflow signals to the counted thread.
+  struct f_owner_ex owner;
+  owner.type = F_OWNER_TID;
+  owner.pid = tid;
+  if (fcntl(fd, F_SETFD, FD_CLOEXEC) == -1 ||
+      fcntl(fd, F_SETSIG, SIGPROF) == -1 ||
+      fcntl(fd, F_SETOWN_EX, &owner) == -1 ||
+      fcntl(fd, F_SETFL, O_ASYNC) == -1 ||
+      ioctl(fd, PERF_EVENT_IOC_ENABLE, 0) == -1) {
+    int err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+  }
+  return fd;
+}
+
+}  // namespace profiler
+}  // namespace cloud
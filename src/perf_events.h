@@ -0,0 +1,83 @@
+/*
+ * Copyright 2018 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CLOUD_PROFILER_AGENT_JAVA_PERF_EVENTS_H_
+#define CLOUD_PROFILER_AGENT_JAVA_PERF_EVENTS_H_
+
+#include <linux/perf_event.h>
+#include <sys/types.h>
+
+#include <map>
+
+#include "src/globals.h"
+
+namespace cloud {
+namespace profiler {
+
+// An event to count, as the type and config of a perf_event_attr.
+struct PerfEvent {
+  uint32_t type;
+  uint64_t config;
+};
+
+// Counts the cpu time of a thread, in nanoseconds.
+constexpr PerfEvent kTaskClockEvent = {PERF_TYPE_SOFTWARE,
+                                       PERF_COUNT_SW_TASK_CLOCK};
+
+// Looks up the hardware event of a profile type, one of cycles,
+// instructions, llc-misses and branch-misses, along with the default
+// number of events between samples. Returns false for other types.
+bool LookupHardwareEvent(const string &profile_type, PerfEvent *event,
+                         int64_t *default_period);
+
+// PerfEventSampler samples an event on every thread of the process,
+// native ones included, with a perf_event counter per thread. Each
+// counter delivers SIGPROF to its own thread every period occurrences of
+// the event. Threads are discovered through /proc/self/task.
+class PerfEventSampler {
+ public:
+  PerfEventSampler() : event_(kTaskClockEvent), period_(0) {}
+  ~PerfEventSampler() { Stop(); }
+
+  // Starts the counters of the threads currently running. Returns false
+  // when the event is not available, in which case nothing is started.
+  bool Start(const PerfEvent &event, int64_t period);
+
+  // Starts the counters of the threads created since the last call, and
+  // releases those of the threads which exited. No-op when not started.
+  void Refresh();
+
+  // Stops and releases all the counters.
+  void Stop();
+
+  bool Active() const { return period_ > 0; }
+
+ private:
+  // Opens and enables the counter of a thread. Returns -1 on error.
+  int Open(pid_t tid);
+
+  PerfEvent event_;
+  int64_t period_;
+  // Counter file descriptors, by thread ID.
+  std::map<pid_t, int> fds_;
+
+  DISALLOW_COPY_AND_ASSIGN(PerfEventSampler);
+};
+
+}  // namespace profiler
+}  // namespace cloud
+
+#endif  // CLOUD_PROFILER_AGENT_JAVA_PERF_EVENTS_H_
@@ -18,9 +18,13 @@
 #include <execinfo.h>
 #include <sys/time.h>
 #include <sys/ucontext.h>
+#include <unistd.h>
 
+#include <algorithm>
 #include <cstdlib>
 #include <cstring>
+#include <limits>
+#include <unordered_set>
 
 #include "src/clock.h"
 #include "src/globals.h"
@@ -30,18 +34,108 @@ DEFINE_int32(cprof_wall_num_threads_cutoff, 4096,
              "Do not take wall profiles if more than this # of threads exist.");
 DEFINE_int32(cprof_wall_max_threads_per_sec, 160,
              "Max total # of threads to wake up per second in wall profiling.");
+DEFINE_bool(cprof_wall_thread_state, false,
+            "when true, label each wall sample with the run state of its "
+            "thread (running, sleeping, disk sleep...) read from /proc "
+            "just before sampling it");
+DEFINE_bool(cprof_wall_adaptive, false,
+            "when true, the wall profiler only signals every "
+            "cprof_wall_idle_rounds rounds the threads which used less than "
+            "1% of a cpu since the previous round, and counts their last "
+            "stack again in between, so that the threads budget of "
+            "cprof_wall_max_threads_per_sec goes to the busy threads");
+DEFINE_int32(cprof_wall_idle_rounds, 10,
+             "in adaptive wall profiling, max number of rounds an idle "
+             "thread goes without being signaled");
+DEFINE_bool(cprof_wall_rt_signal, true,
+            "when true, the wall profiler signals the threads with the "
+            "real-time signal SIGRTMIN+4 rather than SIGPROF. SIGPROF does "
+            "not queue: when the cpu and wall profiles are collected "
+            "concurrently, a wall signal sent to a thread with a cpu signal "
+            "pending is dropped, or the reverse, under-sampling the threads "
+            "running on a cpu in the wall profile and losing cpu samples");
 // Off by default since it may cause rare crashes, b/27615794.
 DEFINE_bool(cprof_record_native_stack, false,
             "Whether to unwind native stack and put atop of the Java one.");
+DEFINE_bool(cprof_cpu_use_perf_events, false,
+            "when true, sample the cpu time of every thread, native ones "
+            "included, with perf_event task-clock counters; falls back to "
+            "the timers otherwise used when perf events are unavailable");
+DEFINE_int64(cprof_perf_event_period, 0,
+             "number of hardware events between two samples of the "
+             "hardware event profiles, 0 for a default for each event");
+DEFINE_int32(cprof_trace_table_shards, 1,
+             "Number of tables to record samples into during collection, "
+             "with registered threads spread across them to reduce "
+             "contention between cores. Each table gets an equal share of "
+             "the default capacity, with a minimum of 512 entries.");
 
 namespace cloud {
 namespace profiler {
 
-google::javaprofiler::AsyncSafeTraceMultiset *Profiler::fixed_traces_ = nullptr;
-std::atomic<int> Profiler::failures_[kNumCallTraceErrors + 1];
+Profiler::SignalTables Profiler::tables_[kNumSignalSources];
+int Profiler::num_sampling_ = 0;
 
 namespace {
 
+// Minimum number of entries in the primary table of each shard.
+const int64_t kMinShardTraces = 512;
+
+// Interval at which the cpu profiler flushes the fixed tables.
+const struct timespec kFlushInterval = {0, 100 * 1000 * 1000};  // 100 ms
+
+// Percentage of a cpu under which a thread is idle for the adaptive wall
+// profiling.
+const int64_t kIdleCpuPercent = 1;
+
+// Offset from SIGRTMIN of the signal of the wall profiler, past the first
+// real-time signals, more likely to be used by libraries.
+const int kWallRtSignalOffset = 4;
+
+// Returns the signal the profilers of a source are sampling with.
+int SourceSignal(SignalSource source) {
+  if (source == kWallSignal && FLAGS_cprof_wall_rt_signal) {
+    return SIGRTMIN + kWallRtSignalOffset;
+  }
+  return SIGPROF;
+}
+
+// Number of rounds after which a wall signal not handled yet is assumed
+// lost, and the thread signaled again.
+const int64_t kLostSignalRounds = 4;
+
+// Keeps the trace recorded for a wall signal in the state queued along with
+// it, if the state has room for it, and hands the state back to the wall
+// profiler. The trace is null if none could be recorded.
+void ReleaseWallThreadState(WallThreadState *state, int attr,
+                            const JVMPI_CallTrace *trace) {
+  if (state == nullptr) {
+    return;
+  }
+  if (trace != nullptr && state->frames != nullptr) {
+    // memcpy is not async safe
+    JVMPI_CallFrame *frames = state->frames.get();
+    for (int i = 0; i < trace->num_frames; i++) {
+      frames[i].lineno = trace->frames[i].lineno;
+      frames[i].method_id = trace->frames[i].method_id;
+    }
+    state->attr = attr;
+    state->num_frames = trace->num_frames;
+  }
+  state->in_flight.store(false, std::memory_order_release);
+}
+
+// Returns the number of threads the wall profiler expects to signal at
+// each round, out of num_threads.
+int64_t WallSignalsPerRound(int64_t num_threads) {
+  if (!FLAGS_cprof_wall_adaptive) {
+    return num_threads;
+  }
+  // Assume most threads are idle, so only signaled every few rounds.
+  int64_t rounds = std::max(FLAGS_cprof_wall_idle_rounds, 0) + 1;
+  return (num_threads + rounds - 1) / rounds;
+}
+
 // Helper class to store and reset errno when in a signal handler.
 class ErrnoRaii {
  public:
@@ -56,11 +150,32 @@ class ErrnoRaii {
 
 }  // namespace
 
+google::javaprofiler::AsyncSafeTraceMultiset *Profiler::CurrentTraces(
+    SignalTables *tables) {
+  return tables->traces[ThreadTable::CurrentOrdinal() % tables->num_traces];
+}
+
 void Profiler::Handle(int signum, siginfo_t *info, void *context) {
-  IMPLICITLY_USE(signum);
-  IMPLICITLY_USE(info);
   ErrnoRaii err_storage;  // stores and resets errno
 
+  // The wall profiler signals the threads with tgkill, or queues the
+  // signals along with the thread sampling state, while the cpu profiler
+  // relies on timers: when both use SIGPROF, the signal code tells them
+  // apart.
+  bool wall = signum != SIGPROF || info->si_code == SI_TKILL ||
+              info->si_code == SI_QUEUE;
+  // Only trust the state of the signals queued by this process.
+  WallThreadState *state =
+      info->si_code == SI_QUEUE && info->si_pid == getpid()
+          ? static_cast<WallThreadState *>(info->si_value.sival_ptr)
+          : nullptr;
+  SignalTables *tables = &tables_[wall ? kWallSignal : kCpuSignal];
+  if (tables->traces == nullptr) {
+    // Not sent by a profiler.
+    ReleaseWallThreadState(state, 0, nullptr);
+    return;
+  }
+
   JVMPI_CallTrace trace;
   JVMPI_CallFrame frames[kMaxFramesToCapture];
 
@@ -69,6 +184,9 @@ void Profiler::Handle(int signum, siginfo_t *info, void *context) {
   trace.env_id = env;
   trace.num_frames = 0;
   int attr = google::javaprofiler::Accessors::GetAttribute();
+  if (state != nullptr) {
+    attr = AttrWithRunState(attr, state->run_state);
+  }
 
   if (env != nullptr) {
     // This is a java thread.
@@ -82,15 +200,17 @@ void Profiler::Handle(int signum, siginfo_t *info, void *context) {
       if (idx > kNumCallTraceErrors) {
         idx = -kUnknownState;
       }
-      failures_[idx]++;
+      tables->failures[idx]++;
+      ReleaseWallThreadState(state, attr, nullptr);
       return;
     }
 
     if (frames[0].lineno >= 0) {
       // Leaf is a java frame, return java trace.
-      if (!fixed_traces_->Add(attr, &trace)) {
-        failures_[-kUnknownState]++;
+      if (!CurrentTraces(tables)->Add(attr, &trace)) {
+        tables->failures[-kUnknownState]++;
       }
+      ReleaseWallThreadState(state, attr, &trace);
       return;
     }
   }
@@ -136,9 +256,10 @@ void Profiler::Handle(int signum, siginfo_t *info, void *context) {
     ++trace.num_frames;
   }
 
-  if (!fixed_traces_->Add(attr, &trace)) {
-    failures_[-kUnknownState]++;
+  if (!CurrentTraces(tables)->Add(attr, &trace)) {
+    tables->failures[-kUnknownState]++;
   }
+  ReleaseWallThreadState(state, attr, &trace);
 }
 
 // This method schedules the SIGPROF timer to go off every specified interval.
@@ -156,8 +277,9 @@ bool SignalHandler::SetSigprofInterval(int64_t period_usec) {
   return true;
 }
 
-struct sigaction SignalHandler::SetAction(void (*action)(int, siginfo_t *,
-                                                         void *)) {
+struct sigaction SignalHandler::SetAction(int signum,
+                                         void (*action)(int, siginfo_t *,
+                                                        void *)) {
   struct sigaction sa;
   sa.sa_handler = NULL;
   sa.sa_sigaction = action;
@@ -166,7 +288,7 @@ struct sigaction SignalHandler::SetAction(void (*action)(int, siginfo_t *,
   sigemptyset(&sa.sa_mask);
 
   struct sigaction old_handler;
-  if (sigaction(SIGPROF, &sa, &old_handler) != 0) {
+  if (sigaction(signum, &sa, &old_handler) != 0) {
     LOG(ERROR) << "Scheduling profiler action failed with error " << errno;
     return old_handler;
   }
@@ -175,12 +297,30 @@ struct sigaction SignalHandler::SetAction(void (*action)(int, siginfo_t *,
 }
 
 void Profiler::Reset() {
-  if (fixed_traces_ == nullptr) {
-    fixed_traces_ = new google::javaprofiler::AsyncSafeTraceMultiset();
+  SignalTables *tables = &tables_[source_];
+  if (tables->traces == nullptr) {
+    int shards = std::max(FLAGS_cprof_trace_table_shards, 1);
+    int64_t max_traces = std::max(
+        google::javaprofiler::AsyncSafeTraceMultiset::kDefaultMaxStackTraces /
+            shards,
+        kMinShardTraces);
+    google::javaprofiler::AsyncSafeTraceMultiset **traces =
+        new google::javaprofiler::AsyncSafeTraceMultiset *[shards];
+    for (int i = 0; i < shards; i++) {
+      traces[i] = new google::javaprofiler::AsyncSafeTraceMultiset(max_traces);
+    }
+    tables->num_traces = shards;
+    // Published last, as the signal handler checks it.
+    std::atomic_thread_fence(std::memory_order_release);
+    tables->traces = traces;
   } else {
-    fixed_traces_->Reset();
+    for (int i = 0; i < tables->num_traces; i++) {
+      tables->traces[i]->Reset();
+    }
+  }
+  for (int i = 0; i <= kNumCallTraceErrors; i++) {
+    tables->failures[i] = 0;
   }
-  memset(failures_, 0, sizeof(failures_));
 
   if (FLAGS_cprof_record_native_stack) {
     // When native stack collection requested, gather a single backtrace before
@@ -192,7 +332,16 @@ void Profiler::Reset() {
 
   // old_action_ is stored, but never used.  This is in case of future
   // refactorings that need it.
-  old_action_ = handler_.SetAction(&Profiler::Handle);
+  old_action_ = handler_.SetAction(SourceSignal(source_), &Profiler::Handle);
+}
+
+int Profiler::Flush() {
+  int trace_count = 0;
+  SignalTables *tables = &tables_[source_];
+  for (int i = 0; i < tables->num_traces; i++) {
+    trace_count += HarvestSamples(tables->traces[i], aggregated_traces_.get());
+  }
+  return trace_count;
 }
 
 string CallTraceErrorToName(int err) {
@@ -222,20 +371,75 @@ string CallTraceErrorToName(int err) {
   }
 }
 
-string Profiler::SerializeProfile(
-    const google::javaprofiler::NativeProcessInfo &native_info) {
+bool Profiler::Collect() {
+  Reset();
+
+  if (!Start()) {
+    return false;
+  }
 
+  struct timespec finish_line =
+      TimeAdd(DefaultClock()->Now(), NanosToTimeSpec(duration_nanos_));
+  bool ok = Sample(finish_line);
+  Stop();
+  Flush();
+  return ok;
+}
+
+std::unique_ptr<Profiler::Window> Profiler::TakeWindow() {
+  std::unique_ptr<Window> window(new Window());
+  window->profile_type = ProfileType();
+  window->profile_unit = ProfileUnit();
+  window->duration_nanos = duration_nanos_;
+  window->period_nanos = period_nanos_;
+  // The signal handler only records into the fixed tables, so swapping
+  // the aggregated traces cuts the windows without losing samples.
+  window->traces = std::move(aggregated_traces_);
+  aggregated_traces_.reset(new google::javaprofiler::TraceMultiset());
+  for (int i = 0; i <= kNumCallTraceErrors; i++) {
+    window->failures[i] = tables_[source_].failures[i].exchange(0);
+  }
+  return window;
+}
+
+ChunkedBuffer Profiler::SerializeProfile(
+    const google::javaprofiler::NativeProcessInfo &native_info,
+    const Compression &compression, AgentThreadPool *symbolizers) {
+  return SerializeWindow(jvmti_, TakeWindow().get(), native_info, compression,
+                         symbolizers);
+}
+
+ChunkedBuffer Profiler::SerializeWindow(
+    jvmtiEnv *jvmti, Window *window,
+    const google::javaprofiler::NativeProcessInfo &native_info,
+    const Compression &compression, AgentThreadPool *symbolizers) {
   std::vector<FrameCount> extra_frames;
   for (int i = 0; i <= kNumCallTraceErrors; i++) {
-    if (failures_[i] > 0) {
+    if (window->failures[i] > 0) {
       extra_frames.emplace_back(
-          FrameCount{CallTraceErrorToName(-i), failures_[i]});
+          FrameCount{CallTraceErrorToName(-i), window->failures[i]});
     }
   }
 
-  return SerializeAndClearJavaCpuTraces(jvmti_, native_info, ProfileType(),
-                                        extra_frames, duration_nanos_,
-                                        period_nanos_, &aggregated_traces_);
+  return SerializeAndClearJavaCpuTraces(
+      jvmti, native_info, window->profile_type.c_str(),
+      window->profile_unit.c_str(), "attr", extra_frames,
+      window->duration_nanos, window->period_nanos, compression, symbolizers,
+      window->traces.get());
+}
+
+void Profiler::SamplingStarted() {
+  num_sampling_++;
+}
+
+void Profiler::SamplingStopped() {
+  if (--num_sampling_ == 0) {
+    // Breaks encapsulation, but whatever.
+    signal(SIGPROF, SIG_IGN);
+    if (SourceSignal(kWallSignal) != SIGPROF) {
+      signal(SourceSignal(kWallSignal), SIG_IGN);
+    }
+  }
 }
 
 bool AlmostThere(const struct timespec &finish, const struct timespec &lap) {
@@ -250,59 +454,89 @@ bool AlmostThere(const struct timespec &finish, const struct timespec &lap) {
   return TimeLessThan(finish, TimeAdd(now, laps));
 }
 
-bool CPUProfiler::Collect() {
-  Reset();
-
-  if (!Start()) {
-    return false;
-  }
-
+bool CPUProfiler::Sample(const struct timespec &finish_line) {
   Clock *clock = DefaultClock();
-  // Flush the async table every 100 ms
-  struct timespec flush_interval = {0, 100 * 1000 * 1000};  // 100 millisec
-  struct timespec finish_line =
-      TimeAdd(clock->Now(), NanosToTimeSpec(duration_nanos_));
-
   // Sleep until finish_line, but wakeup periodically to flush the
   // internal tables.
-  while (!AlmostThere(finish_line, flush_interval)) {
-    clock->SleepFor(flush_interval);
+  while (!AlmostThere(finish_line, kFlushInterval)) {
+    clock->SleepFor(kFlushInterval);
     Flush();
+    // Pick up the threads created since the last flush.
+    perf_events_.Refresh();
   }
   clock->SleepUntil(finish_line);
-  Stop();
-  // Delay to allow last signals to be processed.
-  clock->SleepUntil(TimeAdd(finish_line, flush_interval));
-  Flush();
+  perf_events_.Refresh();
   return true;
 }
 
 bool CPUProfiler::Start() {
   int period_usec = period_nanos_ / 1000;
-  if (threads_->UseTimers()) {
-    threads_->StartTimers(period_usec);
-    return true;
-  } else {
-    return handler_.SetSigprofInterval(period_usec);
+  bool use_perf_events =
+      FLAGS_cprof_cpu_use_perf_events &&
+      perf_events_.Start(kTaskClockEvent, period_nanos_);
+  if (!use_perf_events) {
+    if (threads_->UseTimers()) {
+      threads_->StartTimers(period_usec);
+    } else if (!handler_.SetSigprofInterval(period_usec)) {
+      return false;
+    }
   }
+  SamplingStarted();
+  return true;
 }
 
 void CPUProfiler::Stop() {
-  if (threads_->UseTimers()) {
+  if (perf_events_.Active()) {
+    perf_events_.Stop();
+  } else if (threads_->UseTimers()) {
     threads_->StopTimers();
   } else {
     handler_.SetSigprofInterval(0);
   }
-  // Breaks encapsulation, but whatever.
-  signal(SIGPROF, SIG_IGN);
+  SamplingStopped();
+  // Delay to allow last signals to be processed.
+  DefaultClock()->SleepFor(kFlushInterval);
+}
+
+PerfEventProfiler::PerfEventProfiler(jvmtiEnv *jvmti, ThreadTable *threads,
+                                     int64_t duration_nanos,
+                                     const string &profile_type,
+                                     int64_t cpu_period_nanos)
+    : CPUProfiler(jvmti, threads, duration_nanos, cpu_period_nanos),
+      profile_type_(profile_type),
+      event_(kTaskClockEvent),
+      cpu_period_nanos_(cpu_period_nanos),
+      fallback_(false) {
+  int64_t period;
+  if (!LookupHardwareEvent(profile_type, &event_, &period)) {
+    LOG(ERROR) << "Unknown hardware event '" << profile_type << "'";
+    fallback_ = true;
+    return;
+  }
+  period_nanos_ =
+      FLAGS_cprof_perf_event_period > 0 ? FLAGS_cprof_perf_event_period : period;
+}
+
+bool PerfEventProfiler::Start() {
+  if (!fallback_ && perf_events_.Start(event_, period_nanos_)) {
+    SamplingStarted();
+    return true;
+  }
+  LOG(WARNING) << "Hardware event '" << profile_type_
+               << "' not available, collecting a cpu profile instead";
+  fallback_ = true;
+  period_nanos_ = cpu_period_nanos_;
+  return CPUProfiler::Start();
 }
 
 WallProfiler::WallProfiler(jvmtiEnv *jvmti, ThreadTable *threads,
                            int64_t duration_nanos, int64_t period_nanos)
     : Profiler(jvmti, threads, duration_nanos,
-               EffectivePeriodNanos(period_nanos, threads->Size(),
+               EffectivePeriodNanos(period_nanos,
+                                    WallSignalsPerRound(threads->Size()),
                                     FLAGS_cprof_wall_max_threads_per_sec,
-                                    duration_nanos)) {}
+                                    duration_nanos),
+               kWallSignal) {}
 
 int64_t WallProfiler::EffectivePeriodNanos(int64_t period_nanos,
                                            int64_t num_threads,
@@ -326,50 +560,238 @@ int64_t WallProfiler::EffectivePeriodNanos(int64_t period_nanos,
   return period_nanos;
 }
 
-bool WallProfiler::Collect() {
-  Reset();
+bool WallProfiler::Start() {
+  next_ = DefaultClock()->Now();
+  round_ = 0;
+  SamplingStarted();
+  return true;
+}
+
+bool WallProfiler::Sample(const struct timespec &finish_line) {
   pid_t my_tid = GetTid();
 
   Clock *clock = DefaultClock();
   struct timespec profile_period = {0, period_nanos_};
-  struct timespec finish_line =
-      TimeAdd(clock->Now(), NanosToTimeSpec(duration_nanos_));
+
+  // In adaptive mode, the period is computed for the idle threads to be
+  // signaled every few rounds: cap the signals of each round to the
+  // threads budget in case more threads are busy.
+  int64_t max_signals = std::numeric_limits<int64_t>::max();
+  if (FLAGS_cprof_wall_adaptive) {
+    max_signals = std::max<int64_t>(
+        FLAGS_cprof_wall_max_threads_per_sec * period_nanos_ / kNanosPerSecond,
+        1);
+  }
 
   // Send signals to all threads to wakeup and report themselves. Stop
   // after we reach the finish line.
-  struct timespec next = clock->Now();
-
   int64_t count = 0;
   const int kFlushPeriod = 128;  // Flush table every 128 samples
-  while (TimeLessThan(next, finish_line)) {
+  while (TimeLessThan(next_, finish_line)) {
     if (count > kFlushPeriod) {
       count = 0;
       // Periodically flush the internal tables.
       Flush();
+      PruneThreads();
     }
-    clock->SleepUntil(next);
-    std::vector<pid_t> threads = threads_->Threads();
-    if (threads.size() > FLAGS_cprof_wall_num_threads_cutoff) {
+    clock->SleepUntil(next_);
+    int64_t num_threads = threads_->Size();
+    if (num_threads > FLAGS_cprof_wall_num_threads_cutoff) {
       LOG(WARNING) << "Aborting wall profiling due to too many threads. "
-                   << "Got " << threads.size() << " threads. "
+                   << "Got " << num_threads << " threads. "
                    << "Want up to " << FLAGS_cprof_wall_num_threads_cutoff;
       return false;  // Too many threads, abort
     }
-    count += threads.size();
-    for (pid_t tid : threads) {
-      if (tid != my_tid) {
-        // Skip profiler worker thread.
-        TgKill(tid, SIGPROF);
-      }
+    // Rotate the first thread of each round, so that the same threads are
+    // not always the ones over the budget.
+    int64_t signals = 0;
+    threads_->ForEachThread(
+        [this, my_tid, max_signals, &signals](pid_t tid) {
+          if (tid == my_tid) {
+            // Skip profiler worker thread.
+            return;
+          }
+          if (SampleThread(tid, signals >= max_signals)) {
+            signals++;
+          }
+        },
+        round_);
+    count += signals;
+    round_++;
+    next_ = TimeAdd(next_, profile_period);
+  }
+  // Count the skipped rounds in the window being sampled.
+  FlushThreadStates(nullptr);
+  return true;
+}
+
+bool WallProfiler::SampleThread(pid_t tid, bool over_budget) {
+  if (!FLAGS_cprof_wall_thread_state && !FLAGS_cprof_wall_adaptive) {
+    return TgKill(tid, SourceSignal(kWallSignal));
+  }
+
+  std::unique_ptr<WallThreadState> &state = thread_states_[tid];
+  if (state == nullptr) {
+    state.reset(NewThreadState());
+  }
+  if (InFlight(*state)) {
+    if (round_ - state->signaled_round < kLostSignalRounds) {
+      // The previous signal is still pending, and would absorb this one.
+      return false;
     }
-    next = TimeAdd(next, profile_period);
+    // The signal may still be delivered late, so its state is kept until
+    // the handler is done with it, and the thread gets a new one. The
+    // pending samples go to the first trace of the new state.
+    std::unique_ptr<WallThreadState> fresh(NewThreadState());
+    fresh->cpu_nanos = state->cpu_nanos;
+    fresh->skipped_rounds = state->skipped_rounds;
+    fresh->pending_samples = state->pending_samples;
+    lost_states_.push_back(std::move(state));
+    state = std::move(fresh);
+  }
+
+  if (FLAGS_cprof_wall_adaptive) {
+    int64_t cpu_nanos = ThreadCpuNanos(tid);
+    bool idle = state->cpu_nanos >= 0 && cpu_nanos >= state->cpu_nanos &&
+                (cpu_nanos - state->cpu_nanos) * 100 <
+                    period_nanos_ * kIdleCpuPercent;
+    state->cpu_nanos = cpu_nanos;
+    // A thread without a trace yet is still skipped when over the budget,
+    // its pending samples going to its first trace.
+    if (over_budget ||
+        (idle && state->num_frames > 0 &&
+         state->skipped_rounds < FLAGS_cprof_wall_idle_rounds)) {
+      state->skipped_rounds++;
+      state->pending_samples++;
+      return false;
+    }
+    // The trace is about to be replaced.
+    AddPendingSamples(state.get());
+    state->skipped_rounds = 0;
+  }
+
+  if (FLAGS_cprof_wall_thread_state) {
+    // Read before the signal wakes the thread up.
+    state->run_state = run_states_.Read(tid);
+  }
+  state->signaled_round = round_;
+  state->in_flight.store(true, std::memory_order_relaxed);
+  if (!TgSigQueue(tid, SourceSignal(kWallSignal), state.get())) {
+    state->in_flight.store(false, std::memory_order_relaxed);
+    return false;
   }
-  // Delay to allow last signals to be processed.
-  clock->SleepUntil(TimeAdd(next, profile_period));
-  signal(SIGPROF, SIG_IGN);
-  Flush();
   return true;
 }
 
+WallThreadState *WallProfiler::NewThreadState() {
+  WallThreadState *state = new WallThreadState();
+  if (FLAGS_cprof_wall_adaptive) {
+    state->frames.reset(
+        new google::javaprofiler::JVMPI_CallFrame[kMaxFramesToCapture]);
+  }
+  return state;
+}
+
+bool WallProfiler::InFlight(const WallThreadState &state) {
+  return state.in_flight.load(std::memory_order_acquire);
+}
+
+void WallProfiler::AddPendingSamples(WallThreadState *state) {
+  if (state->pending_samples > 0 && state->num_frames > 0 &&
+      !InFlight(*state)) {
+    AddSamples(state->attr, state->num_frames, state->frames.get(),
+               state->pending_samples);
+    state->pending_samples = 0;
+  }
+}
+
+void WallProfiler::FlushThreadStates(const std::vector<pid_t> *live) {
+  std::unordered_set<pid_t> live_set;
+  if (live != nullptr) {
+    live_set.insert(live->begin(), live->end());
+  }
+  for (auto it = thread_states_.begin(); it != thread_states_.end();) {
+    WallThreadState *state = it->second.get();
+    AddPendingSamples(state);
+    if (live != nullptr && live_set.count(it->first) == 0 &&
+        !InFlight(*state)) {
+      it = thread_states_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  lost_states_.erase(
+      std::remove_if(lost_states_.begin(), lost_states_.end(),
+                     [](const std::unique_ptr<WallThreadState> &state) {
+                       return !InFlight(*state);
+                     }),
+      lost_states_.end());
+}
+
+void WallProfiler::PruneThreads() {
+  std::vector<pid_t> live = threads_->Threads();
+  run_states_.Prune(live);
+  FlushThreadStates(&live);
+}
+
+void WallProfiler::Stop() {
+  // Delay to allow last signals to be processed.
+  DefaultClock()->SleepUntil(TimeAdd(next_, {0, period_nanos_}));
+  SamplingStopped();
+  run_states_.Close();
+  FlushThreadStates(nullptr);
+  for (auto &entry : thread_states_) {
+    if (InFlight(*entry.second)) {
+      // Leaked, as a signal that was not handled yet still points to it.
+      entry.second.release();
+    }
+  }
+  thread_states_.clear();
+  for (auto &state : lost_states_) {
+    if (InFlight(*state)) {
+      state.release();
+    }
+  }
+  lost_states_.clear();
+}
+
+void CollectConcurrently(CPUProfiler *cpu, WallProfiler *wall,
+                         int64_t duration_nanos, bool *cpu_ok, bool *wall_ok) {
+  cpu->Reset();
+  wall->Reset();
+  *cpu_ok = cpu->Start();
+  *wall_ok = wall->Start();
+
+  Clock *clock = DefaultClock();
+  struct timespec finish_line =
+      TimeAdd(clock->Now(), NanosToTimeSpec(duration_nanos));
+
+  // Send the wall signals in slices of the cpu flush interval, flushing
+  // the tables of both in between.
+  struct timespec slice_end = clock->Now();
+  while (TimeLessThan(slice_end, finish_line)) {
+    slice_end = TimeAdd(slice_end, kFlushInterval);
+    if (TimeLessThan(finish_line, slice_end)) {
+      slice_end = finish_line;
+    }
+    if (*wall_ok) {
+      *wall_ok = wall->Sample(slice_end);
+      // A slice only holds a few rounds of wall signals, too few for the
+      // periodic flush of Sample() to kick in.
+      wall->Flush();
+      wall->PruneThreads();
+    }
+    cpu->Sample(slice_end);
+    cpu->Flush();
+  }
+
+  wall->Stop();
+  if (*cpu_ok) {
+    cpu->Stop();
+  }
+  cpu->Flush();
+  wall->Flush();
+}
+
 }  // namespace profiler
 }  // namespace cloud
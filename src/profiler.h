@@ -19,8 +19,17 @@
 
 #include <signal.h>
 
-#include <atomic>
+#include <time.h>
 
+#include <atomic>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "src/chunked_buffer.h"
+#include "src/compression.h"
+#include "src/perf_events.h"
+#include "src/thread_pool.h"
 #include "src/threads.h"
 #include "third_party/javaprofiler/stacktraces.h"
 
@@ -31,7 +40,8 @@ class SignalHandler {
  public:
   SignalHandler() {}
 
-  struct sigaction SetAction(void (*sigaction)(int, siginfo_t *, void *));
+  struct sigaction SetAction(int signum,
+                             void (*sigaction)(int, siginfo_t *, void *));
 
   bool SetSigprofInterval(int64_t period_usec);
 
@@ -39,25 +49,73 @@ class SignalHandler {
   DISALLOW_COPY_AND_ASSIGN(SignalHandler);
 };
 
+// Sources of the profiling signals. The signal handler records the traces
+// of each source into separate tables, so that profilers of different
+// sources can sample at the same time.
+enum SignalSource {
+  kCpuSignal,   // SIGPROF of the cpu timers and perf event counters.
+  kWallSignal,  // Signals sent to each thread by the wall profiler, a
+                // real-time signal unless --cprof_wall_rt_signal=false.
+  kNumSignalSources
+};
+
 class Profiler {
  public:
+  // The traces and errors collected over a window of a collection.
+  struct Window {
+    string profile_type;
+    string profile_unit;
+    int64_t duration_nanos;
+    int64_t period_nanos;
+    std::unique_ptr<google::javaprofiler::TraceMultiset> traces;
+    int64_t failures[google::javaprofiler::kNumCallTraceErrors + 1];
+  };
+
   Profiler(jvmtiEnv *jvmti, ThreadTable *threads, int64_t duration_nanos,
-           int64_t period_nanos)
+           int64_t period_nanos, SignalSource source)
       : threads_(threads),
         duration_nanos_(duration_nanos),
         period_nanos_(period_nanos),
-        jvmti_(jvmti) {
+        aggregated_traces_(new google::javaprofiler::TraceMultiset()),
+        jvmti_(jvmti),
+        source_(source) {
     Reset();
   }
   virtual ~Profiler() {}
 
   // Collect performance data.
   // Implicitly does a Reset() before starting collection.
-  virtual bool Collect() = 0;
-
-  // Serialize the collected traces into a compressed serialized profile.proto
-  string SerializeProfile(
-      const google::javaprofiler::NativeProcessInfo &native_info);
+  bool Collect();
+
+  // Start sampling, after a Reset(). Returns false on error.
+  virtual bool Start() = 0;
+
+  // Collect samples until finish_line, flushing the fixed tables along
+  // the way. Can be called repeatedly to sample back to back windows.
+  // Returns false if the collection had to be aborted.
+  virtual bool Sample(const struct timespec &finish_line) = 0;
+
+  // Stop sampling, and wait for the signals in flight to be handled.
+  virtual void Stop() = 0;
+
+  // Move the traces and errors collected so far into a window, and start
+  // a new one. Sampling is not interrupted: samples not yet flushed from
+  // the fixed tables go to the new window.
+  std::unique_ptr<Window> TakeWindow();
+
+  // Serialize the collected traces into a compressed serialized profile.proto.
+  // Methods are resolved on symbolizers when not null.
+  ChunkedBuffer SerializeProfile(
+      const google::javaprofiler::NativeProcessInfo &native_info,
+      const Compression &compression, AgentThreadPool *symbolizers);
+
+  // Serialize a window into a compressed serialized profile.proto. Does
+  // not touch the state of the profiler, so it can run on another thread
+  // while the next window is being sampled.
+  static ChunkedBuffer SerializeWindow(
+      jvmtiEnv *jvmti, Window *window,
+      const google::javaprofiler::NativeProcessInfo &native_info,
+      const Compression &compression, AgentThreadPool *symbolizers);
 
   // Signal handler, which records the current stack trace into the profile.
   static void Handle(int signum, siginfo_t *info, void *context);
@@ -65,69 +123,168 @@ class Profiler {
   // Reset internal state to support data collection.
   void Reset();
 
-  // Migrate data from fixed internal table into growable data structure.
+  // Migrate data from fixed internal tables into growable data structure.
   // Returns number of entries extracted.
-  int Flush() { return HarvestSamples(fixed_traces_, &aggregated_traces_); }
+  int Flush();
 
   // String description of the profile type
   virtual const char *ProfileType() = 0;
 
+  // Unit of the sampling period, and of the values of the profile.
+  virtual const char *ProfileUnit() { return "nanoseconds"; }
+
  protected:
   ThreadTable *threads_;
   SignalHandler handler_;
   int64_t duration_nanos_;
   int64_t period_nanos_;
 
+  // Track the profilers sampling, so that SIGPROF only gets ignored once
+  // the last of them stops.
+  static void SamplingStarted();
+  static void SamplingStopped();
+
+  // Adds count samples of a trace to the aggregated traces, bypassing the
+  // signal handler.
+  void AddSamples(int64_t attr, int num_frames,
+                  const google::javaprofiler::JVMPI_CallFrame *frames,
+                  int64_t count) {
+    aggregated_traces_->Add(attr, num_frames, frames, count);
+  }
+
  private:
-  // Points to a fixed multiset of traces used during collection. This
-  // is allocated on the first call to Reset(). Will be reused by
-  // subsequent allocations. Cannot be deallocated as it could be in
-  // use by other threads, triggered from a signal handler.
-  static google::javaprofiler::AsyncSafeTraceMultiset *fixed_traces_;
+  // The fixed tables and error counts of a signal source.
+  struct SignalTables {
+    // Points to the fixed multisets of traces used during collection,
+    // with registered threads spread across them. These are allocated on
+    // the first call to Reset(). Will be reused by subsequent
+    // allocations. Cannot be deallocated as they could be in use by
+    // other threads, triggered from a signal handler.
+    google::javaprofiler::AsyncSafeTraceMultiset **traces;
+    int num_traces;
+
+    std::atomic<int> failures[
+        google::javaprofiler::kNumCallTraceErrors + 1];  // 1-indexed.
+  };
+
+  // Returns the fixed multiset the current thread records its traces in.
+  static google::javaprofiler::AsyncSafeTraceMultiset *CurrentTraces(
+      SignalTables *tables);
+
+  static SignalTables tables_[kNumSignalSources];
+  // Number of profilers between SamplingStarted() and SamplingStopped().
+  static int num_sampling_;
 
   // Aggregated profile data, populated using data extracted from
   // fixed_traces.
-  google::javaprofiler::TraceMultiset aggregated_traces_;
+  std::unique_ptr<google::javaprofiler::TraceMultiset> aggregated_traces_;
   jvmtiEnv *jvmti_;
+  SignalSource source_;
 
   struct sigaction old_action_;
 
-  static std::atomic<int> failures_[
-      google::javaprofiler::kNumCallTraceErrors + 1];  // 1-indexed.
-
   DISALLOW_COPY_AND_ASSIGN(Profiler);
 };
 
 // CPUProfiler collects cpu profiles by setting up a CPU timer and
-// collecting a sample each time it is triggered (via SIGPROF).
+// collecting a sample each time it is triggered (via SIGPROF). The timer
+// is a perf_event counter per thread when enabled and available, else
+// per-thread POSIX timers or the process-wide ITIMER_PROF.
 class CPUProfiler : public Profiler {
  public:
-  using Profiler::Profiler;
+  CPUProfiler(jvmtiEnv *jvmti, ThreadTable *threads, int64_t duration_nanos,
+              int64_t period_nanos)
+      : Profiler(jvmti, threads, duration_nanos, period_nanos, kCpuSignal) {}
+
+  // Initiate data collection at a fixed interval
+  bool Start() override;
+
+  bool Sample(const struct timespec &finish_line) override;
 
-  // Collect profiling data.
-  bool Collect() override;
+  // Stop data collection
+  void Stop() override;
 
   const char *ProfileType() override { return "cpu"; }
 
+ protected:
+  PerfEventSampler perf_events_;
+
  private:
-  // Initiate data collection at a fixed interval
-  bool Start();
+  DISALLOW_COPY_AND_ASSIGN(CPUProfiler);
+};
 
-  // Stop data collection
-  void Stop();
+// PerfEventProfiler collects profiles of a hardware event, such as cycles
+// or cache misses, sampling every period occurrences of the event on each
+// thread. When the event is not available, as on most virtual machines,
+// it collects a cpu profile at cpu_period_nanos instead.
+class PerfEventProfiler : public CPUProfiler {
+ public:
+  // profile_type is one of the types known to LookupHardwareEvent().
+  PerfEventProfiler(jvmtiEnv *jvmti, ThreadTable *threads,
+                    int64_t duration_nanos, const string &profile_type,
+                    int64_t cpu_period_nanos);
 
-  DISALLOW_COPY_AND_ASSIGN(CPUProfiler);
+  bool Start() override;
+
+  const char *ProfileType() override {
+    return fallback_ ? CPUProfiler::ProfileType() : profile_type_.c_str();
+  }
+  const char *ProfileUnit() override {
+    return fallback_ ? CPUProfiler::ProfileUnit() : "count";
+  }
+
+ private:
+  string profile_type_;
+  PerfEvent event_;
+  int64_t cpu_period_nanos_;
+  // Whether the cpu time is sampled, the event being unavailable.
+  bool fallback_;
+
+  DISALLOW_COPY_AND_ASSIGN(PerfEventProfiler);
+};
+
+// Sampling state of a thread of the wall profiler. Its address is queued
+// along with the signals sent to the thread, so that the signal handler can
+// label the trace with the run state of the thread, and keep the trace for
+// the wall profiler to reuse while the thread stays idle.
+struct WallThreadState {
+  // Read by the wall profiler just before signaling the thread.
+  ThreadRunState run_state = kRunStateUnknown;
+  // Set while a signal is queued, cleared by the signal handler once done
+  // with the state.
+  std::atomic<bool> in_flight{false};
+  // Round at which the last signal was queued. A SIGPROF queued while
+  // another one is pending is dropped by the kernel, and real-time signals
+  // are discarded if the thread exits first, so a signal still in
+  // flight after a few rounds is assumed lost and the thread is given a
+  // new state, this one being kept until in_flight is cleared.
+  int64_t signaled_round = 0;
+
+  // Last trace recorded by the signal handler, when frames is allocated.
+  int attr = 0;
+  int num_frames = 0;
+  std::unique_ptr<google::javaprofiler::JVMPI_CallFrame[]> frames;
+
+  // Cpu time of the thread at the previous round, -1 if unknown.
+  int64_t cpu_nanos = -1;
+  // Rounds since the thread was last signaled.
+  int skipped_rounds = 0;
+  // Samples of the skipped rounds, to add with the last trace.
+  int64_t pending_samples = 0;
 };
 
 // WallProfiler collects wallclock profiles by explicitly sending
-// SIGPROF to each thread in the thread table.
+// a signal to each thread in the thread table. In adaptive mode, the threads
+// which barely used the cpu since the previous round are only signaled
+// every few rounds, their last trace being counted again in between.
 class WallProfiler : public Profiler {
  public:
   WallProfiler(jvmtiEnv *jvmti, ThreadTable *threads, int64_t duration_nanos,
                int64_t period_nanos);
 
-  // Collect profiling data.
-  bool Collect() override;
+  bool Start() override;
+  bool Sample(const struct timespec &finish_line) override;
+  void Stop() override;
 
   // Compute effective period based on desired overhead parameters.
   static int64_t EffectivePeriodNanos(int64_t num_threads,
@@ -137,10 +294,49 @@ class WallProfiler : public Profiler {
 
   const char *ProfileType() override { return "wall"; }
 
+  // Forgets the state kept for the threads no longer registered.
+  void PruneThreads();
+
  private:
+  // Sends the signal of a round to a thread, or counts its last trace
+  // again if it is idle. Returns whether a signal was sent.
+  bool SampleThread(pid_t tid, bool over_budget);
+
+  // Adds the samples of the skipped rounds of a thread with its last trace.
+  void AddPendingSamples(WallThreadState *state);
+
+  // Returns a new sampling state, with room for a trace in adaptive mode.
+  static WallThreadState *NewThreadState();
+
+  // Returns whether a signal queued along with a state may still be
+  // handled. The state must then not be freed, nor its trace read.
+  static bool InFlight(const WallThreadState &state);
+
+  // Adds the pending samples of all the threads, forgets the threads not
+  // in live, if any, and frees the lost states the handler is done with.
+  void FlushThreadStates(const std::vector<pid_t> *live);
+
+  // Time at which to send the next round of signals.
+  struct timespec next_;
+  // Number of rounds of signals sent so far.
+  int64_t round_;
+  // Run states of the threads, sent along with their signals.
+  RunStateReader run_states_;
+  // Sampling states of the threads, when queued along with the signals.
+  std::unordered_map<pid_t, std::unique_ptr<WallThreadState>> thread_states_;
+  // States of the signals assumed lost, replaced in thread_states_ but
+  // still pointed to by the signals if they are delivered late.
+  std::vector<std::unique_ptr<WallThreadState>> lost_states_;
+
   DISALLOW_COPY_AND_ASSIGN(WallProfiler);
 };
 
+// Collects a cpu and a wall profile over the same window of duration_nanos,
+// with both sampling at the same time. Implicitly resets both profilers.
+// Sets cpu_ok and wall_ok to whether each collection succeeded.
+void CollectConcurrently(CPUProfiler *cpu, WallProfiler *wall,
+                         int64_t duration_nanos, bool *cpu_ok, bool *wall_ok);
+
 }  // namespace profiler
 }  // namespace cloud
 
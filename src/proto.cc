@@ -19,43 +19,66 @@
 #include <sys/time.h>
 #include <map>
 #include <string>
+#include <utility>
 
 #include "perftools/profiles/proto/builder.h"
 #include "third_party/javaprofiler/display.h"
+#include "third_party/javaprofiler/method_cache.h"
 #include "third_party/javaprofiler/stacktrace_fixer.h"
 
 namespace cloud {
 namespace profiler {
 
+namespace {
+
+// Returns the cache of method symbols shared by all the profiles. It is
+// only used from the thread serializing profiles, and never deallocated.
+google::javaprofiler::MethodCache *ProfileMethodCache(jvmtiEnv *jvmti) {
+  static google::javaprofiler::MethodCache *cache =
+      new google::javaprofiler::MethodCache(jvmti);
+  return cache;
+}
+
+}  // namespace
+
 // Encodes a set of java stack traces into a CPU profile, symbolized using
 // the jvmti.
 class ProfileProtoBuilder {
  public:
   ProfileProtoBuilder(
       jvmtiEnv *jvmti,
-      const google::javaprofiler::NativeProcessInfo &native_info)
-      : jvmti_(jvmti), native_info_(native_info) {
+      const google::javaprofiler::NativeProcessInfo &native_info,
+      const Compression &compression, AgentThreadPool *symbolizers)
+      : jvmti_(jvmti),
+        method_cache_(ProfileMethodCache(jvmti)),
+        symbolizers_(symbolizers),
+        output_stream_(&output_),
+        compressed_stream_(NewCompressingStream(compression, &output_stream_)),
+        native_info_(native_info) {
+    method_cache_->BeginProfile();
+    builder_.StreamSamples(compressed_stream_.get());
     for (const auto &it : google::javaprofiler::AttributeTable::GetStrings()) {
       builder_.StringId(it.c_str());
     }
   }
 
   // Populate the profile with a set of traces
-  void Populate(const char *profile_type,
+  void Populate(const char *profile_type, const char *profile_unit,
+                const char *attr_key,
                 const google::javaprofiler::TraceMultiset &traces,
-                int64_t duration_ns, int64_t period_ns);
+                int64_t duration_ns, int64_t period);
   void AddArtificialSample(const string &name, int64_t count, int64_t weight,
                            int64_t attr);
   int64_t TotalCount() const;
   int64_t TotalWeight() const;
 
-  string Emit() {
-    string out;
-    builder_.Emit(&out);
-    return out;
-  }
-  void Encode(perftools::profiles::Profile *p) {
-    p->Swap(builder_.mutable_profile());
+  // Returns the compressed profile. The samples are compressed as they
+  // are added, so only the remaining tables are encoded here.
+  ChunkedBuffer Emit() {
+    if (!builder_.FinishStream() || !compressed_stream_->Close()) {
+      return ChunkedBuffer();
+    }
+    return std::move(output_);
   }
 
  private:
@@ -68,9 +91,18 @@ class ProfileProtoBuilder {
                       int line_number);
 
   jvmtiEnv *jvmti_;
+  google::javaprofiler::MethodCache *method_cache_;
+  AgentThreadPool *symbolizers_;
+  ChunkedBuffer output_;
+  ChunkedBuffer::OutputStream output_stream_;
+  std::unique_ptr<CompressingStream> compressed_stream_;
   int64_t total_count_ = 0;
   int64_t total_weight_ = 0;
+  // String id of the label key of the trace attributes.
+  int64_t attr_key_ = 0;
   perftools::profiles::Builder builder_;
+  // Reused across samples to keep their buffers.
+  perftools::profiles::Sample sample_;
 
   typedef std::tuple<uint64_t, int> Line;
   class LineHasher {
@@ -105,14 +137,14 @@ uint64_t ProfileProtoBuilder::LocationID(
     return LocationID(reinterpret_cast<uint64_t>(frame.method_id));
   }
 
-  string method_name, class_name, file_name, signature;
   int line_number = 0;
-  google::javaprofiler::GetStackFrameElements(jvmti_, frame, &file_name,
-                                              &class_name, &method_name,
-                                              &signature, &line_number);
+  const google::javaprofiler::MethodCache::MethodInfo &method =
+      method_cache_->Lookup(frame, &line_number);
+  string signature = method.signature;
   google::javaprofiler::FixMethodParameters(&signature);
 
-  return LocationID(class_name, method_name, signature, file_name, line_number);
+  return LocationID(method.class_name, method.method_name, signature,
+                    method.file_name, line_number);
 }
 
 uint64_t ProfileProtoBuilder::LocationID(uint64_t address) {
@@ -172,31 +204,60 @@ uint64_t ProfileProtoBuilder::LocationID(const string &class_name,
 }
 
 void ProfileProtoBuilder::Populate(
-    const char *profile_type, const google::javaprofiler::TraceMultiset &traces,
-    int64_t duration_ns, int64_t period_ns) {
+    const char *profile_type, const char *profile_unit, const char *attr_key,
+    const google::javaprofiler::TraceMultiset &traces, int64_t duration_ns,
+    int64_t period) {
   perftools::profiles::Profile *profile = builder_.mutable_profile();
+  attr_key_ = builder_.StringId(attr_key);
 
   profile->mutable_period_type()->set_type(builder_.StringId(profile_type));
-  profile->mutable_period_type()->set_unit(builder_.StringId("nanoseconds"));
-  profile->set_period(period_ns);
+  profile->mutable_period_type()->set_unit(builder_.StringId(profile_unit));
+  profile->set_period(period);
   perftools::profiles::ValueType *sample_type = profile->add_sample_type();
   sample_type->set_type(builder_.StringId("sample"));
   sample_type->set_unit(builder_.StringId("count"));
 
   sample_type = profile->add_sample_type();
   sample_type->set_type(builder_.StringId(profile_type));
-  sample_type->set_unit(builder_.StringId("nanoseconds"));
+  sample_type->set_unit(builder_.StringId(profile_unit));
 
   profile->set_duration_nanos(duration_ns);
 
+  // Resolve the methods of the call tree on the symbolizer threads first.
+  // The locations are then still added in node order, so the profile
+  // does not depend on how the methods were spread across threads.
+  if (symbolizers_ != nullptr) {
+    std::vector<jmethodID> methods;
+    for (size_t i = 0; i < traces.NodeCount(); i++) {
+      const google::javaprofiler::JVMPI_CallFrame &frame =
+          traces.NodeAt(i).frame;
+      if (frame.lineno != google::javaprofiler::kNativeFrameLineNum) {
+        methods.push_back(frame.method_id);
+      }
+    }
+    method_cache_->Prefetch(
+        methods, [this](int64_t n, const std::function<void(int64_t)> &fn) {
+          symbolizers_->ParallelFor(n, fn);
+        });
+  }
+
+  // Resolve each node of the call tree once, shared by all the traces
+  // going through it.
+  std::vector<uint64_t> node_locations(traces.NodeCount());
+  for (size_t i = 0; i < node_locations.size(); i++) {
+    node_locations[i] = LocationID(traces.NodeAt(i).frame);
+  }
+
   for (const auto &trace : traces) {
-    int64_t count = trace.second;
+    int64_t count = trace.count;
     if (count != 0) {
       std::vector<uint64_t> locations;
-      for (const auto &frame : trace.first.frames) {
-        locations.push_back(LocationID(frame));
+      for (int64_t node = trace.node;
+           node != google::javaprofiler::TraceMultiset::kNoNode;
+           node = traces.NodeAt(node).parent) {
+        locations.push_back(node_locations[node]);
       }
-      AddSample(locations, count, count * period_ns, trace.first.attr);
+      AddSample(locations, count, count * period, trace.attr);
     }
   }
 
@@ -212,35 +273,43 @@ void ProfileProtoBuilder::Populate(
 void ProfileProtoBuilder::AddSample(const std::vector<uint64_t> &locations,
                                     int64_t count, int64_t weight,
                                     int64_t attr) {
-  perftools::profiles::Profile *profile = builder_.mutable_profile();
-
-  perftools::profiles::Sample *sample = profile->add_sample();
-  sample->add_value(count);
+  sample_.Clear();
+  sample_.add_value(count);
   total_count_ += count;
-  sample->add_value(weight);
+  sample_.add_value(weight);
   total_weight_ += weight;
 
   for (const auto &location : locations) {
-    sample->add_location_id(location);
+    sample_.add_location_id(location);
   }
 
+  ThreadRunState run_state = RunStateOfAttr(attr);
+  attr = AttrWithoutRunState(attr);
   if (attr != 0) {
-    perftools::profiles::Label *label = sample->add_label();
-    label->set_key(builder_.StringId("attr"));
+    perftools::profiles::Label *label = sample_.add_label();
+    label->set_key(attr_key_);
     label->set_str(attr);
   }
+  if (run_state != kRunStateUnknown) {
+    perftools::profiles::Label *label = sample_.add_label();
+    label->set_key(builder_.StringId("run_state"));
+    label->set_str(builder_.StringId(RunStateName(run_state)));
+  }
+  builder_.AddSample(sample_);
 }
 
-string SerializeAndClearJavaCpuTraces(
+ChunkedBuffer SerializeAndClearJavaCpuTraces(
     jvmtiEnv *jvmti, const google::javaprofiler::NativeProcessInfo &native_info,
-    const char *profile_type, const std::vector<FrameCount> &extra_frames,
-    int64_t duration_ns, int64_t period_ns,
-    google::javaprofiler::TraceMultiset *traces) {
-  ProfileProtoBuilder b(jvmti, native_info);
-  b.Populate(profile_type, *traces, duration_ns, period_ns);
+    const char *profile_type, const char *profile_unit, const char *attr_key,
+    const std::vector<FrameCount> &extra_frames, int64_t duration_ns,
+    int64_t period, const Compression &compression,
+    AgentThreadPool *symbolizers, google::javaprofiler::TraceMultiset *traces) {
+  ProfileProtoBuilder b(jvmti, native_info, compression, symbolizers);
+  b.Populate(profile_type, profile_unit, attr_key, *traces, duration_ns,
+             period);
   for (const auto &f : extra_frames) {
     // TODO: Track and report attributes for artificial samples.
-    b.AddArtificialSample(f.name, f.value, f.value * period_ns, 0);
+    b.AddArtificialSample(f.name, f.value, f.value * period, 0);
   }
   LOG(INFO) << "Collected a profile: total count=" << b.TotalCount()
             << ", weight=" << b.TotalWeight();
@@ -249,5 +318,18 @@ string SerializeAndClearJavaCpuTraces(
   return b.Emit();
 }
 
+ChunkedBuffer EncodeProfile(const perftools::profiles::Profile &profile,
+                            const Compression &compression) {
+  ChunkedBuffer output;
+  ChunkedBuffer::OutputStream output_stream(&output);
+  std::unique_ptr<CompressingStream> compressed_stream =
+      NewCompressingStream(compression, &output_stream);
+  if (!profile.SerializeToZeroCopyStream(compressed_stream.get()) ||
+      !compressed_stream->Close()) {
+    return ChunkedBuffer();
+  }
+  return output;
+}
+
 }  // namespace profiler
 }  // namespace cloud
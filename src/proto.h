@@ -17,8 +17,12 @@
 #ifndef CLOUD_PROFILER_AGENT_JAVA_PROTO_H_
 #define CLOUD_PROFILER_AGENT_JAVA_PROTO_H_
 
+#include "src/chunked_buffer.h"
+#include "src/compression.h"
 #include "src/profiler.h"
+#include "src/thread_pool.h"
 #include "perftools/profiles/proto/builder.h"
+#include "third_party/javaprofiler/profile_proto_builder.h"
 
 namespace cloud {
 namespace profiler {
@@ -28,15 +32,44 @@ struct FrameCount {
   int64_t value;
 };
 
-// Generates a CPU profile in a compressed serialized profile.proto
-// from a collection of java stack traces, symbolized using the jvmti.
-// Data in traces will be cleared.
-string SerializeAndClearJavaCpuTraces(
+// Generates a CPU profile in a serialized profile.proto compressed as
+// requested from a collection of java stack traces, symbolized using the
+// jvmti. The sampling period and the values of the profile are expressed
+// in profile_unit. The attributes of the traces are labeled as attr_key.
+// Data in traces will be cleared. The methods are resolved on the
+// threads of symbolizers when not null, on the calling thread otherwise.
+ChunkedBuffer SerializeAndClearJavaCpuTraces(
     jvmtiEnv *jvmti, const google::javaprofiler::NativeProcessInfo &native_info,
-    const char *profile_type, const std::vector<FrameCount> &extra_frames,
-    int64_t duration_nanos, int64_t period_nanos,
+    const char *profile_type, const char *profile_unit, const char *attr_key,
+    const std::vector<FrameCount> &extra_frames, int64_t duration_nanos,
+    int64_t period,
+    const Compression &compression, AgentThreadPool *symbolizers,
     google::javaprofiler::TraceMultiset *traces);
 
+// Frame cache of the javaprofiler profile builders, for the stacks
+// returned by the jvmti GetStackTrace, which only hold Java frames.
+class JavaFrameCache : public google::javaprofiler::ProfileFrameCache {
+ public:
+  void ProcessTraces(const google::javaprofiler::ProfileStackTrace *traces,
+                     int num_traces) override {}
+
+  perftools::profiles::Location *GetLocation(
+      const google::javaprofiler::JVMPI_CallFrame &jvm_frame,
+      google::javaprofiler::LocationBuilder *location_builder) override {
+    return location_builder->LocationFor("", "[Unknown native]", "", 0);
+  }
+
+  string GetFunctionName(
+      const google::javaprofiler::JVMPI_CallFrame &jvm_frame) override {
+    return "";
+  }
+};
+
+// Serializes a profile built by the javaprofiler profile builders,
+// compressed as requested. Returns an empty buffer on error.
+ChunkedBuffer EncodeProfile(const perftools::profiles::Profile &profile,
+                            const Compression &compression);
+
 }  // namespace profiler
 }  // namespace cloud
 
@@ -0,0 +1,115 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "src/thread_pool.h"
+
+namespace cloud {
+namespace profiler {
+
+namespace {
+
+// Number of local references to reserve on the pool threads for each loop.
+const jint kLocalFrameCapacity = 64;
+
+}  // namespace
+
+int AgentThreadPool::Start(JNIEnv *jni, int num_threads) {
+  jclass cls = jni->FindClass("java/lang/Thread");
+  jmethodID constructor = jni->GetMethodID(cls, "<init>", "()V");
+  for (int i = 0; i < num_threads; i++) {
+    jobject thread = jni->NewGlobalRef(jni->NewObject(cls, constructor));
+    if (thread == nullptr) {
+      LOG(ERROR) << "Failed to construct cloud profiler pool thread";
+      break;
+    }
+
+    jvmtiError err = jvmti_->RunAgentThread(thread, ThreadMain, this,
+                                            JVMTI_THREAD_MIN_PRIORITY);
+    if (err) {
+      LOG(ERROR) << "Failed to start cloud profiler pool thread";
+      break;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    num_threads_++;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  return num_threads_;
+}
+
+void AgentThreadPool::Stop() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  stopping_ = true;
+  num_threads_ = 0;
+  work_cv_.notify_all();
+}
+
+void AgentThreadPool::ParallelFor(int64_t n,
+                                  const std::function<void(int64_t)> &fn) {
+  if (n <= 0) {
+    return;
+  }
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  task_ = &fn;
+  task_size_ = n;
+  next_index_ = 0;
+  generation_++;
+  busy_threads_ = num_threads_;
+  work_cv_.notify_all();
+  lock.unlock();
+
+  RunTask();
+
+  lock.lock();
+  done_cv_.wait(lock, [this] { return busy_threads_ == 0; });
+  task_ = nullptr;
+}
+
+void AgentThreadPool::RunTask() {
+  for (int64_t i = next_index_++; i < task_size_; i = next_index_++) {
+    (*task_)(i);
+  }
+}
+
+void AgentThreadPool::ThreadMain(jvmtiEnv *jvmti_env, JNIEnv *jni_env,
+                                 void *arg) {
+  AgentThreadPool *pool = static_cast<AgentThreadPool *>(arg);
+  int64_t generation = 0;
+
+  std::unique_lock<std::mutex> lock(pool->mutex_);
+  while (true) {
+    pool->work_cv_.wait(lock, [pool, generation] {
+      return pool->stopping_ || pool->generation_ != generation;
+    });
+    if (pool->stopping_) {
+      break;
+    }
+    generation = pool->generation_;
+    lock.unlock();
+
+    // This thread never returns to Java, release the local references
+    // created by JVMTI calls once the loop is done.
+    jni_env->PushLocalFrame(kLocalFrameCapacity);
+    pool->RunTask();
+    jni_env->PopLocalFrame(nullptr);
+
+    lock.lock();
+    if (--pool->busy_threads_ == 0) {
+      pool->done_cv_.notify_all();
+    }
+  }
+}
+
+}  // namespace profiler
+}  // namespace cloud
@@ -0,0 +1,92 @@
+/*
+ * Copyright 2018 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CLOUD_PROFILER_AGENT_JAVA_THREAD_POOL_H_
+#define CLOUD_PROFILER_AGENT_JAVA_THREAD_POOL_H_
+
+#include <atomic>
+#include <condition_variable>  // NOLINT(build/c++11)
+#include <functional>
+#include <mutex>  // NOLINT(build/c++11)
+
+#include "src/globals.h"
+
+namespace cloud {
+namespace profiler {
+
+// AgentThreadPool runs loops on a fixed set of JVMTI agent threads, so
+// that the loop bodies can make JVMTI calls. Local references created
+// by the loop bodies on the pool threads are released after each loop.
+class AgentThreadPool {
+ public:
+  explicit AgentThreadPool(jvmtiEnv *jvmti)
+      : jvmti_(jvmti),
+        num_threads_(0),
+        stopping_(false),
+        task_(nullptr),
+        task_size_(0),
+        next_index_(0),
+        generation_(0),
+        busy_threads_(0) {}
+
+  // Starts num_threads agent threads. Returns the number of threads
+  // actually started.
+  int Start(JNIEnv *jni, int num_threads);
+
+  // Makes the threads exit. Loops run after this use only the calling
+  // thread.
+  void Stop();
+
+  // Calls fn for every index in [0, n), spread across the pool threads
+  // and the calling thread, and returns once all the calls complete.
+  // Only one loop can run at a time.
+  void ParallelFor(int64_t n, const std::function<void(int64_t)> &fn);
+
+ private:
+  static void ThreadMain(jvmtiEnv *jvmti_env, JNIEnv *jni_env, void *arg);
+
+  // Runs loop bodies until all the indexes have been claimed.
+  void RunTask();
+
+  jvmtiEnv *jvmti_;
+
+  // Protects all the fields below except next_index_.
+  std::mutex mutex_;
+  // Signaled when a loop starts or the pool stops.
+  std::condition_variable work_cv_;
+  // Signaled when a pool thread is done with the current loop.
+  std::condition_variable done_cv_;
+
+  int num_threads_;
+  bool stopping_;
+
+  // The current loop, its number of indexes, and the next index to run.
+  const std::function<void(int64_t)> *task_;
+  int64_t task_size_;
+  std::atomic<int64_t> next_index_;
+
+  // Incremented for every loop, to let the pool threads tell them apart.
+  int64_t generation_;
+  // Number of pool threads not yet done with the current loop.
+  int busy_threads_;
+
+  DISALLOW_COPY_AND_ASSIGN(AgentThreadPool);
+};
+
+}  // namespace profiler
+}  // namespace cloud
+
+#endif  // CLOUD_PROFILER_AGENT_JAVA_THREAD_POOL_H_
@@ -14,11 +14,19 @@
 
 #include "src/threads.h"
 
+#include <fcntl.h>
 #include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/syscall.h>
 #include <time.h>
 #include <unistd.h>
 
+#include <unordered_set>
+
+#include "src/clock.h"
+
 namespace cloud {
 namespace profiler {
 
@@ -26,6 +34,11 @@ namespace {
 
 const timer_t kInvalidTimer = reinterpret_cast<timer_t>(-1LL);
 
+// Registration ordinal of the current thread, 0 when not registered.
+__thread int64_t current_ordinal;
+// Index plus one of the slot of the current thread, 0 when not registered.
+__thread int64_t current_slot;
+
 timer_t CreateTimer(pid_t tid) {
   struct sigevent sevp = {};
   sevp.sigev_notify = SIGEV_THREAD_ID;
@@ -62,62 +75,247 @@ void DeleteTimer(timer_t timer) {
 
 }  // namespace
 
-void ThreadTable::RegisterCurrent() {
-  pid_t tid = GetTid();
-  timer_t timer = kInvalidTimer;
-  if (use_timers_) {
-    timer = CreateTimer(tid);
+ThreadTable::~ThreadTable() {
+  for (auto &chunk : chunks_) {
+    delete[] chunk.load(std::memory_order_acquire);
   }
-  std::lock_guard<std::mutex> lock(thread_mutex_);
-  threads_.push_back({tid, timer});
-  if (timer != kInvalidTimer && period_usec_ > 0) {
-    SetTimer(timer, period_usec_);
+}
+
+ThreadTable::Slot *ThreadTable::AllocatedSlotAt(int64_t index) const {
+  Slot *slot = SlotAt(index);
+  if (slot == nullptr) {
+    // Registered threads and free slots are always in allocated chunks.
+    LOG(ERROR) << "Thread table slot " << index << " is not allocated";
+    abort();
   }
+  return slot;
 }
 
-void ThreadTable::UnregisterCurrent() {
+int64_t ThreadTable::AllocateSlot() {
+  uint64_t head = free_head_.load(std::memory_order_acquire);
+  while ((head & 0xffffffff) != 0) {
+    int64_t index = (head & 0xffffffff) - 1;
+    uint64_t next =
+        AllocatedSlotAt(index)->next_free.load(std::memory_order_relaxed);
+    uint64_t new_head = (((head >> 32) + 1) << 32) | next;
+    if (free_head_.compare_exchange_weak(head, new_head,
+                                         std::memory_order_acq_rel)) {
+      return index;
+    }
+  }
+
+  // No free slot, take a new one.
+  int64_t index = num_slots_.load(std::memory_order_relaxed);
+  do {
+    if (index >= kSlotsPerChunk * kMaxChunks) {
+      return -1;
+    }
+  } while (!num_slots_.compare_exchange_weak(index, index + 1,
+                                             std::memory_order_acq_rel));
+  std::atomic<Slot *> *chunk = &chunks_[index / kSlotsPerChunk];
+  if (chunk->load(std::memory_order_acquire) == nullptr) {
+    Slot *slots = new Slot[kSlotsPerChunk]();
+    for (int64_t i = 0; i < kSlotsPerChunk; i++) {
+      slots[i].timer = kInvalidTimer;
+    }
+    Slot *expected = nullptr;
+    if (!chunk->compare_exchange_strong(expected, slots,
+                                        std::memory_order_acq_rel)) {
+      // Allocated by another thread in the meantime.
+      delete[] slots;
+    }
+  }
+  return index;
+}
+
+void ThreadTable::FreeSlot(int64_t index) {
+  Slot *slot = AllocatedSlotAt(index);
+  uint64_t head = free_head_.load(std::memory_order_acquire);
+  uint64_t new_head;
+  do {
+    slot->next_free.store(head & 0xffffffff, std::memory_order_relaxed);
+    new_head = (((head >> 32) + 1) << 32) | static_cast<uint64_t>(index + 1);
+  } while (!free_head_.compare_exchange_weak(head, new_head,
+                                             std::memory_order_acq_rel));
+}
+
+void ThreadTable::RegisterCurrent() {
+  current_ordinal = ++registrations_;
+  int64_t index = AllocateSlot();
+  if (index < 0) {
+    LOG(ERROR) << "Too many threads, thread " << GetTid()
+               << " will not be profiled";
+    return;
+  }
+  current_slot = index + 1;
+  Slot *slot = AllocatedSlotAt(index);
   pid_t tid = GetTid();
-  std::lock_guard<std::mutex> lock(thread_mutex_);
-  for (auto i = threads_.begin(); i != threads_.end(); ++i) {
-    if (i->first == tid) {
-      if (i->second != kInvalidTimer) {
-        DeleteTimer(i->second);
-      }
-      threads_.erase(i);
-      return;
+  slot->tid.store(tid, std::memory_order_relaxed);
+  if (use_timers_) {
+    timer_t timer = CreateTimer(tid);
+    std::lock_guard<std::mutex> lock(timer_mutex_);
+    slot->timer = timer;
+    if (timer != kInvalidTimer && period_usec_ > 0) {
+      SetTimer(timer, period_usec_);
     }
   }
+  // Publishes the thread.
+  slot->generation.fetch_add(1, std::memory_order_release);
+  size_.fetch_add(1, std::memory_order_release);
 }
 
-int64_t ThreadTable::Size() const {
-  std::lock_guard<std::mutex> lock(thread_mutex_);
-  return threads_.size();
+void ThreadTable::UnregisterCurrent() {
+  current_ordinal = 0;
+  if (current_slot == 0) {
+    return;
+  }
+  int64_t index = current_slot - 1;
+  current_slot = 0;
+  Slot *slot = AllocatedSlotAt(index);
+  slot->generation.fetch_add(1, std::memory_order_release);
+  size_.fetch_sub(1, std::memory_order_release);
+  if (use_timers_) {
+    std::lock_guard<std::mutex> lock(timer_mutex_);
+    if (slot->timer != kInvalidTimer) {
+      DeleteTimer(slot->timer);
+    }
+    slot->timer = kInvalidTimer;
+  }
+  FreeSlot(index);
 }
 
 std::vector<pid_t> ThreadTable::Threads() const {
   std::vector<pid_t> tids;
-  std::lock_guard<std::mutex> lock(thread_mutex_);
-  for (const auto& t : threads_) {
-    tids.push_back(t.first);
-  }
+  tids.reserve(Size());
+  ForEachThread([&tids](pid_t tid) { tids.push_back(tid); });
   return tids;
 }
 
 void ThreadTable::StartTimers(int64_t period_usec) {
-  std::lock_guard<std::mutex> lock(thread_mutex_);
+  std::lock_guard<std::mutex> lock(timer_mutex_);
   period_usec_ = period_usec;
-  for (const auto& t : threads_) {
-    SetTimer(t.second, period_usec);
+  int64_t num_slots = num_slots_.load(std::memory_order_acquire);
+  for (int64_t i = 0; i < num_slots; i++) {
+    Slot *slot = SlotAt(i);
+    if (slot != nullptr && slot->timer != kInvalidTimer) {
+      SetTimer(slot->timer, period_usec);
+    }
   }
 }
 
 void ThreadTable::StopTimers() { StartTimers(0); }
 
+int64_t ThreadTable::CurrentOrdinal() { return current_ordinal; }
+
+const char *RunStateName(ThreadRunState state) {
+  switch (state) {
+    case kRunStateRunning:
+      return "running";
+    case kRunStateSleeping:
+      return "sleeping";
+    case kRunStateDiskSleep:
+      return "disk sleep";
+    case kRunStateStopped:
+      return "stopped";
+    case kRunStateZombie:
+      return "zombie";
+    case kRunStateIdle:
+      return "idle";
+    default:
+      return "unknown";
+  }
+}
+
+ThreadRunState RunStateReader::Read(pid_t tid) {
+  int &fd = fds_[tid];
+  if (fd <= 0) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/self/task/%d/stat", tid);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      fds_.erase(tid);
+      return kRunStateUnknown;
+    }
+  }
+
+  // The state follows the command name, which is in parentheses and may
+  // contain any character: "<tid> (<comm>) <state> ...".
+  char stat[128];
+  ssize_t size = pread(fd, stat, sizeof(stat) - 1, 0);
+  if (size <= 0) {
+    // The thread exited, its ID may be reused by another one.
+    close(fd);
+    fds_.erase(tid);
+    return kRunStateUnknown;
+  }
+  stat[size] = '\0';
+  const char *comm_end = strrchr(stat, ')');
+  if (comm_end == nullptr || comm_end[1] == '\0') {
+    return kRunStateUnknown;
+  }
+  switch (comm_end[2]) {
+    case 'R':
+      return kRunStateRunning;
+    case 'S':
+      return kRunStateSleeping;
+    case 'D':
+      return kRunStateDiskSleep;
+    case 'T':
+    case 't':
+      return kRunStateStopped;
+    case 'Z':
+    case 'X':
+      return kRunStateZombie;
+    case 'I':
+      return kRunStateIdle;
+    default:
+      return kRunStateUnknown;
+  }
+}
+
+void RunStateReader::Prune(const std::vector<pid_t> &live) {
+  std::unordered_set<pid_t> live_set(live.begin(), live.end());
+  for (auto it = fds_.begin(); it != fds_.end();) {
+    if (live_set.count(it->first) == 0) {
+      close(it->second);
+      it = fds_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+void RunStateReader::Close() { Prune(std::vector<pid_t>()); }
+
 pid_t GetTid() { return syscall(__NR_gettid); }
 
 bool TgKill(pid_t tid, int signum) {
   return syscall(__NR_tgkill, getpid(), tid, signum) == 0;
 }
 
+bool TgSigQueue(pid_t tid, int signum, void *value) {
+  siginfo_t info;
+  memset(&info, 0, sizeof(info));
+  info.si_signo = signum;
+  info.si_code = SI_QUEUE;
+  info.si_pid = getpid();
+  info.si_uid = getuid();
+  info.si_value.sival_ptr = value;
+  return syscall(__NR_rt_tgsigqueueinfo, getpid(), tid, signum, &info) == 0;
+}
+
+int64_t ThreadCpuNanos(pid_t tid) {
+  // pthread_getcpuclockid() only takes a pthread_t, so build the same
+  // per-thread scheduler clock from the kernel thread ID instead.
+  const clockid_t kCpuClockPerThread = 4, kCpuClockSched = 2;
+  clockid_t clock =
+      (~static_cast<clockid_t>(tid) << 3) | kCpuClockPerThread | kCpuClockSched;
+  struct timespec cpu;
+  if (clock_gettime(clock, &cpu) != 0) {
+    return -1;
+  }
+  return TimeSpecToNanos(cpu);
+}
+
 }  // namespace profiler
 }  // namespace cloud
@@ -18,8 +18,11 @@
 #define CLOUD_PROFILER_AGENT_JAVA_THREADS_H_
 
 #include <time.h>
+#include <atomic>
 #include <mutex>  // NOLINT(build/c++11)
+#include <unordered_map>
 #include <utility>
+#include <vector>
 
 #include "src/globals.h"
 
@@ -31,45 +34,183 @@ namespace profiler {
 // When configured to do so, it manages per thread CPU time timers and allows
 // starting and stopping them to generate SIGPROF signal when certain amount of
 // the CPU time expires.
+//
+// The threads are kept in an array of slots, allocated in chunks which are
+// never freed, with the free slots in a lock-free list. Registering and
+// unregistering a thread takes no lock unless timers are used, and the
+// registered threads can be visited without locking nor copying.
 class ThreadTable {
  public:
   explicit ThreadTable(bool use_timers)
-      : use_timers_(use_timers), period_usec_() {}
+      : use_timers_(use_timers),
+        period_usec_(),
+        registrations_(0),
+        size_(0),
+        num_slots_(0),
+        free_head_(0),
+        chunks_() {}
+  ~ThreadTable();
 
   // Registers the current thread.
   void RegisterCurrent();
   // Unregisters the current thread.
   void UnregisterCurrent();
   // Returns the number of registered threads.
-  int64_t Size() const;
+  int64_t Size() const { return size_.load(std::memory_order_acquire); }
   // Returns the IDs of all registered threads.
   std::vector<pid_t> Threads() const;
+  // Calls f(tid) for each registered thread. Threads registered or
+  // unregistered during the call may or may not be visited. The visit
+  // starts at slot first, modulo the number of slots, so that callers can
+  // rotate the order of the threads.
+  template <typename F>
+  void ForEachThread(const F &f, int64_t first = 0) const;
   // Starts per-thread timers.
   void StartTimers(int64_t period_usec);
   // Stops per-thread timers.
   void StopTimers();
   // Whether CPU time sampling is configured to use per-thread timers.
   bool UseTimers() const { return use_timers_; }
+  // Returns the position of the current thread in the order threads were
+  // registered in, starting at 1, or 0 if it is not registered. This is
+  // async-signal safe.
+  static int64_t CurrentOrdinal();
 
  private:
-  mutable std::mutex thread_mutex_;
-  // List of threads and associated timers. The timer ID is kInvalidTimer when
-  // the timer usage is off or the timer creation failed for the thread.
-  std::vector<std::pair<pid_t, timer_t>> threads_;
+  // A slot of the table. The generation is odd while a thread is
+  // registered in the slot, and incremented on each registration and
+  // unregistration, so that readers can tell when a slot was reused while
+  // they read it.
+  struct Slot {
+    std::atomic<uint32_t> generation;
+    std::atomic<pid_t> tid;
+    // The timer ID is kInvalidTimer when the timer usage is off or the
+    // timer creation failed for the thread.
+    timer_t timer;
+    // Index plus one of the next free slot, 0 for none.
+    std::atomic<uint32_t> next_free;
+  };
+
+  static const int64_t kSlotsPerChunk = 1024;
+  static const int64_t kMaxChunks = 256;
+
+  // Returns the slot at an index, or null if its chunk is not allocated.
+  Slot *SlotAt(int64_t index) const {
+    Slot *chunk = chunks_[index / kSlotsPerChunk].load(
+        std::memory_order_acquire);
+    return chunk == nullptr ? nullptr : &chunk[index % kSlotsPerChunk];
+  }
+  // Returns the slot at an index whose chunk is known to be allocated, as
+  // for the slots of registered threads and the free slots.
+  Slot *AllocatedSlotAt(int64_t index) const;
+  // Returns the index of a free slot, or -1 if the table is full.
+  int64_t AllocateSlot();
+  void FreeSlot(int64_t index);
+
+  // Serializes the timer operations, only used with timers.
+  std::mutex timer_mutex_;
   // True when the timer usage is requested.
   bool use_timers_;
   // Non-zero when the thread timers have been started.
   int64_t period_usec_;
+  // Number of calls to RegisterCurrent() so far.
+  std::atomic<int64_t> registrations_;
+  // Number of registered threads.
+  std::atomic<int64_t> size_;
+  // Number of slots ever allocated, free ones included.
+  std::atomic<int64_t> num_slots_;
+  // Head of the list of free slots: index plus one of the first slot in
+  // the low 32 bits, and a count of the updates of the head in the high
+  // ones, so that a head popped and pushed back fails a pending pop.
+  std::atomic<uint64_t> free_head_;
+  std::atomic<Slot *> chunks_[kMaxChunks];
 
   DISALLOW_COPY_AND_ASSIGN(ThreadTable);
 };
 
+template <typename F>
+void ThreadTable::ForEachThread(const F &f, int64_t first) const {
+  int64_t num_slots = num_slots_.load(std::memory_order_acquire);
+  for (int64_t i = 0; i < num_slots; i++) {
+    const Slot *slot = SlotAt((first + i) % num_slots);
+    if (slot == nullptr) {
+      continue;
+    }
+    uint32_t generation = slot->generation.load(std::memory_order_acquire);
+    if (generation % 2 == 0) {
+      continue;
+    }
+    pid_t tid = slot->tid.load(std::memory_order_acquire);
+    if (slot->generation.load(std::memory_order_acquire) == generation) {
+      f(tid);
+    }
+  }
+}
+
+// Scheduler run state of a thread, as reported by /proc.
+enum ThreadRunState {
+  kRunStateUnknown = 0,
+  kRunStateRunning,
+  kRunStateSleeping,
+  kRunStateDiskSleep,
+  kRunStateStopped,
+  kRunStateZombie,
+  kRunStateIdle,
+};
+
+// Returns the /proc name of a run state, e.g. "disk sleep".
+const char *RunStateName(ThreadRunState state);
+
+// The run state of a sampled thread is carried in the upper bits of the
+// attribute of its trace, below the sign bit of the int attributes.
+const int kRunStateShift = 24;
+
+inline int64_t AttrWithRunState(int64_t attr, ThreadRunState state) {
+  return attr | (static_cast<int64_t>(state) << kRunStateShift);
+}
+
+inline ThreadRunState RunStateOfAttr(int64_t attr) {
+  return static_cast<ThreadRunState>(attr >> kRunStateShift);
+}
+
+inline int64_t AttrWithoutRunState(int64_t attr) {
+  return attr & ((int64_t(1) << kRunStateShift) - 1);
+}
+
+// RunStateReader reads the run states of threads of the process from
+// /proc/self/task/<tid>/stat, keeping the files open across reads.
+class RunStateReader {
+ public:
+  RunStateReader() {}
+  ~RunStateReader() { Close(); }
+
+  // Returns the run state of a thread, or kRunStateUnknown on error.
+  ThreadRunState Read(pid_t tid);
+  // Closes the files of the threads not in live.
+  void Prune(const std::vector<pid_t> &live);
+  // Closes the files of all the threads.
+  void Close();
+
+ private:
+  std::unordered_map<pid_t, int> fds_;
+
+  DISALLOW_COPY_AND_ASSIGN(RunStateReader);
+};
+
 // Returns the thread ID of the current thread.
 pid_t GetTid();
 
 // Sends a signal to the specified thread.
 bool TgKill(pid_t tid, int signum);
 
+// Sends a signal to the specified thread along with a pointer, received
+// in the si_value of a siginfo with the SI_QUEUE code.
+bool TgSigQueue(pid_t tid, int signum, void *value);
+
+// Returns the cpu time consumed so far by a thread of the process, in
+// nanoseconds, or -1 if the thread exited.
+int64_t ThreadCpuNanos(pid_t tid);
+
 }  // namespace profiler
 }  // namespace cloud
 
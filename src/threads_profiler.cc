@@ -0,0 +1,133 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "src/threads_profiler.h"
+
+#include <algorithm>
+#include <vector>
+
+#include "src/clock.h"
+#include "src/proto.h"
+#include "src/throttler.h"
+#include "third_party/javaprofiler/stacktraces.h"
+
+DEFINE_bool(cprof_enable_threads_profiling, false,
+            "when true, collect snapshots of the stacks of all the Java "
+            "threads");
+DEFINE_int32(cprof_threads_pause_budget_msec, 50,
+             "longest pause of the JVM for a snapshot of the thread stacks, "
+             "in milliseconds; the stacks are truncated further while the "
+             "snapshots take longer");
+
+namespace cloud {
+namespace profiler {
+
+namespace {
+
+// Shallowest depth the stacks are truncated to when over the budget.
+const int kMinFrames = 16;
+
+// Local references to reserve for the threads of a snapshot.
+const jint kLocalFrameCapacity = 64;
+
+// Returns the java.lang.Thread.State like name of a jvmti thread state.
+const char *ThreadStateName(jint state) {
+  if (state & JVMTI_THREAD_STATE_BLOCKED_ON_MONITOR_ENTER) {
+    return "BLOCKED";
+  }
+  if (state & JVMTI_THREAD_STATE_WAITING_WITH_TIMEOUT) {
+    return "TIMED_WAITING";
+  }
+  if (state & JVMTI_THREAD_STATE_WAITING) {
+    return "WAITING";
+  }
+  if (state & JVMTI_THREAD_STATE_IN_NATIVE) {
+    return "RUNNABLE_NATIVE";
+  }
+  return "RUNNABLE";
+}
+
+}  // namespace
+
+ThreadsProfiler::ThreadsProfiler(jvmtiEnv *jvmti)
+    : jvmti_(jvmti), max_frames_(kMaxFramesToCapture) {}
+
+bool ThreadsProfiler::Enabled() {
+  return FLAGS_cprof_enable_threads_profiling;
+}
+
+ChunkedBuffer ThreadsProfiler::Collect(
+    JNIEnv *jni, const google::javaprofiler::NativeProcessInfo &native_info,
+    const Compression &compression, AgentThreadPool *symbolizers) {
+  // The snapshot returns a local reference per thread, released with the
+  // frame since this thread never returns to Java.
+  if (jni->PushLocalFrame(kLocalFrameCapacity) != JNI_OK) {
+    LOG(ERROR) << "Failed to reserve the local references of the snapshot";
+    return ChunkedBuffer();
+  }
+
+  // All the stacks are taken in the same safepoint.
+  Clock *clock = DefaultClock();
+  struct timespec start = clock->Now();
+  google::javaprofiler::JvmtiScopedPtr<jvmtiStackInfo> stacks(jvmti_);
+  jint thread_count = 0;
+  jvmtiError err =
+      jvmti_->GetAllStackTraces(max_frames_, stacks.GetRef(), &thread_count);
+  int64_t pause_ns = TimeSpecToNanos(clock->Now()) - TimeSpecToNanos(start);
+  if (err != JVMTI_ERROR_NONE) {
+    LOG(ERROR) << "Failed to get the thread stacks with error " << err;
+    jni->PopLocalFrame(nullptr);
+    return ChunkedBuffer();
+  }
+
+  google::javaprofiler::TraceMultiset traces;
+  std::vector<google::javaprofiler::JVMPI_CallFrame> frames(max_frames_);
+  int64_t live_threads = 0;
+  for (int i = 0; i < thread_count; i++) {
+    const jvmtiStackInfo &stack = stacks.Get()[i];
+    if (!(stack.state & JVMTI_THREAD_STATE_ALIVE)) {
+      continue;
+    }
+    for (int f = 0; f < stack.frame_count; f++) {
+      frames[f].lineno = static_cast<jint>(stack.frame_buffer[f].location);
+      frames[f].method_id = stack.frame_buffer[f].method;
+    }
+    int64_t attr = google::javaprofiler::AttributeTable::RegisterString(
+        ThreadStateName(stack.state));
+    traces.Add(attr, stack.frame_count, frames.data(), 1);
+    live_threads++;
+  }
+  jni->PopLocalFrame(nullptr);
+
+  int64_t budget_ns = FLAGS_cprof_threads_pause_budget_msec * kNanosPerMilli;
+  LOG(INFO) << "Snapshot of " << live_threads << " threads paused the JVM "
+            << "for " << pause_ns / 1000 << "us, " << max_frames_
+            << " frames deep";
+  if (pause_ns > budget_ns && max_frames_ > kMinFrames) {
+    max_frames_ = std::max(kMinFrames, max_frames_ / 2);
+    LOG(WARNING) << "Snapshot over its pause budget of "
+                 << FLAGS_cprof_threads_pause_budget_msec
+                 << "ms, next stacks truncated to " << max_frames_
+                 << " frames";
+  } else if (pause_ns < budget_ns / 4 && max_frames_ < kMaxFramesToCapture) {
+    max_frames_ = std::min(kMaxFramesToCapture, max_frames_ * 2);
+  }
+
+  return SerializeAndClearJavaCpuTraces(
+      jvmti_, native_info, kTypeThreads, "count", "state",
+      std::vector<FrameCount>(), 0, 1, compression, symbolizers, &traces);
+}
+
+}  // namespace profiler
+}  // namespace cloud
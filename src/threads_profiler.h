@@ -0,0 +1,57 @@
+/*
+ * Copyright 2018 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CLOUD_PROFILER_AGENT_JAVA_THREADS_PROFILER_H_
+#define CLOUD_PROFILER_AGENT_JAVA_THREADS_PROFILER_H_
+
+#include "src/chunked_buffer.h"
+#include "src/compression.h"
+#include "src/globals.h"
+#include "src/thread_pool.h"
+#include "third_party/javaprofiler/native.h"
+
+namespace cloud {
+namespace profiler {
+
+// ThreadsProfiler takes snapshots of the stacks of all the live Java
+// threads, within a single pause of the JVM. The snapshot profile counts
+// the threads by stack and state.
+class ThreadsProfiler {
+ public:
+  explicit ThreadsProfiler(jvmtiEnv *jvmti);
+
+  // Returns whether the threads profiles were requested.
+  static bool Enabled();
+
+  // Takes a snapshot of the thread stacks and returns its profile,
+  // compressed as requested, or an empty buffer on error. The depth of
+  // the stacks is reduced for the next snapshots while the JVM pauses
+  // longer than its budget.
+  ChunkedBuffer Collect(
+      JNIEnv *jni, const google::javaprofiler::NativeProcessInfo &native_info,
+      const Compression &compression, AgentThreadPool *symbolizers);
+
+ private:
+  jvmtiEnv *jvmti_;
+  int max_frames_;
+
+  DISALLOW_COPY_AND_ASSIGN(ThreadsProfiler);
+};
+
+}  // namespace profiler
+}  // namespace cloud
+
+#endif  // CLOUD_PROFILER_AGENT_JAVA_THREADS_PROFILER_H_
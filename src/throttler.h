@@ -19,6 +19,8 @@
 
 #include <memory>
 
+#include "src/chunked_buffer.h"
+#include "src/compression.h"
 #include "src/globals.h"
 
 namespace cloud {
@@ -27,6 +29,10 @@ namespace profiler {
 // Supported profile types.
 constexpr char kTypeCPU[] = "cpu";
 constexpr char kTypeWall[] = "wall";
+constexpr char kTypeHeap[] = "heap";
+constexpr char kTypeHeapAlloc[] = "alloc";
+constexpr char kTypeContention[] = "contention";
+constexpr char kTypeThreads[] = "threads";
 
 // Iterator-like abstraction used to guide a profiling loop comprising of
 // waiting for when the next profile may be collected and saving its data once
@@ -58,8 +64,25 @@ class Throttler {
   // by a successful call to WaitNext().
   virtual int64_t DurationNanos() = 0;
 
+  // Returns the compression the client should apply to the profile. pprof
+  // compatible gzip unless overridden.
+  virtual Compression ProfileCompression() { return Compression(); }
+
+  // Returns the type of the profile following the current one when both
+  // are to be collected over the same window, or an empty string. The
+  // following profile is then collected along with the current one, and
+  // uploaded after the next WaitNext(), which returns right away.
+  virtual string NextProfileType() { return ""; }
+
+  // Returns whether profiles are to be collected back to back, without
+  // stopping the sampling between them. WaitNext() then returns as soon
+  // as the previous profile is collected, ProfileType() and
+  // DurationNanos() stay the same, and Upload() can be called from
+  // another thread, concurrently with WaitNext().
+  virtual bool Continuous() { return false; }
+
   // Upload the compressed profile proto bytes. Returns false on error.
-  virtual bool Upload(string profile) = 0;
+  virtual bool Upload(const ChunkedBuffer &profile) = 0;
 };
 
 }  // namespace profiler
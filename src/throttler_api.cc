@@ -19,19 +19,31 @@
 
 #include "src/clock.h"
 #include "src/cloud_env.h"
+#include "src/contention_profiler.h"
+#include "src/heap_profiler.h"
 #include "src/pem_roots.h"
 #include "src/string.h"
+#include "src/threads_profiler.h"
 
 #include "google/devtools/cloudprofiler/v2/profiler.grpc.pb.h"
 #include "google/protobuf/duration.pb.h"  // NOLINT
 #include "google/rpc/error_details.pb.h"  // NOLINT
 
+#include "google/protobuf/io/coded_stream.h"
+#include "google/protobuf/io/zero_copy_stream_impl_lite.h"
+#include "google/protobuf/wire_format_lite.h"
+
 #include "grpc/grpc_security.h"
+#include "grpc/slice.h"
 #include "grpc/support/log.h"
 #include "grpc/support/string_util.h"
+#include "grpcpp/completion_queue.h"
 #include "grpcpp/create_channel.h"
+#include "grpcpp/generic/generic_stub.h"
 #include "grpcpp/security/credentials.h"
+#include "grpcpp/support/byte_buffer.h"
 #include "grpcpp/support/channel_arguments.h"
+#include "grpcpp/support/slice.h"
 
 // API curated profiling configuration.
 DEFINE_string(cprof_api_address, "cloudprofiler.googleapis.com",
@@ -68,6 +80,9 @@ const char kLanguageLabel[] = "language";
 const char kServiceVersionLabel[] = "version";
 // Range of random number
 const int64_t kRandomRange = 65536;
+// Full name of the UpdateProfile method of the profiler service.
+const char kUpdateProfileMethod[] =
+    "/google.devtools.cloudprofiler.v2.ProfilerService/UpdateProfile";
 
 // Routes GRPC logging through cloud profiler logger.
 // Otherwise GRPC would log to stderr.
@@ -96,9 +111,11 @@ grpc_ssl_roots_override_result OverrideSSLRoots(char** pem_root_certs) {
   return GRPC_SSL_ROOTS_OVERRIDE_OK;
 }
 
-// Creates the profiler gRPC API stub. Returns nullptr on error.
+// Creates the profiler gRPC API stub, and sets channel to its channel.
+// Returns nullptr on error.
 std::unique_ptr<api::grpc::ProfilerService::StubInterface>
-NewProfilerServiceStub(const string& addr) {
+NewProfilerServiceStub(const string& addr,
+                       std::shared_ptr<grpc::ChannelInterface>* channel) {
   std::shared_ptr<grpc::ChannelCredentials> creds;
   if (FLAGS_cprof_use_insecure_creds_for_testing) {
     creds = grpc::InsecureChannelCredentials();
@@ -120,11 +137,109 @@ NewProfilerServiceStub(const string& addr) {
       api::grpc::ProfilerService::NewStub(ch);
   if (stub == nullptr) {
     LOG(ERROR) << "Failed to initialize profiler service";
+    return nullptr;
   }
 
+  *channel = ch;
   return stub;
 }
 
+// Releases the reference to a profile chunk held by a gRPC slice.
+void UnrefChunk(void* chunk) {
+  delete static_cast<std::shared_ptr<ChunkedBuffer::Chunk>*>(chunk);
+}
+
+// Encodes an UpdateProfileRequest for profile, with profile_bytes set to
+// bytes. Only the profile metadata is copied: the slices of the buffer
+// reference the chunks of bytes.
+grpc::ByteBuffer UpdateProfileRequestBuffer(const api::Profile& profile,
+                                            const ChunkedBuffer& bytes) {
+  using google::protobuf::internal::WireFormatLite;
+  using google::protobuf::io::CodedOutputStream;
+
+  // The fields of a message can come in any order, so profile_bytes is
+  // appended to the encoded metadata.
+  string metadata;
+  profile.SerializeToString(&metadata);
+  const uint32_t bytes_tag = WireFormatLite::MakeTag(
+      api::Profile::kProfileBytesFieldNumber,
+      WireFormatLite::WIRETYPE_LENGTH_DELIMITED);
+  const uint64_t profile_size = metadata.size() +
+                                CodedOutputStream::VarintSize32(bytes_tag) +
+                                CodedOutputStream::VarintSize64(bytes.size()) +
+                                bytes.size();
+
+  string header;
+  {
+    google::protobuf::io::StringOutputStream stream(&header);
+    CodedOutputStream out(&stream);
+    out.WriteTag(WireFormatLite::MakeTag(
+        api::UpdateProfileRequest::kProfileFieldNumber,
+        WireFormatLite::WIRETYPE_LENGTH_DELIMITED));
+    out.WriteVarint64(profile_size);
+    out.WriteRaw(metadata.data(), metadata.size());
+    out.WriteTag(bytes_tag);
+    out.WriteVarint64(bytes.size());
+  }
+
+  std::vector<grpc::Slice> slices;
+  slices.emplace_back(header);
+  for (const auto& chunk : bytes.chunks()) {
+    if (chunk->size == 0) {
+      continue;
+    }
+    slices.emplace_back(
+        grpc_slice_new_with_user_data(
+            chunk->data.get(), chunk->size, UnrefChunk,
+            new std::shared_ptr<ChunkedBuffer::Chunk>(chunk)),
+        grpc::Slice::STEAL_REF);
+  }
+  return grpc::ByteBuffer(slices.data(), slices.size());
+}
+
+// Sends a serialized UpdateProfileRequest through the generic stub, and
+// parses the updated profile returned into response.
+grpc::Status UpdateProfile(grpc::GenericStub* stub, grpc::ClientContext* ctx,
+                           const grpc::ByteBuffer& req,
+                           api::Profile* response) {
+  grpc::CompletionQueue cq;
+  std::unique_ptr<grpc::GenericClientAsyncResponseReader> call =
+      stub->PrepareUnaryCall(ctx, kUpdateProfileMethod, req, &cq);
+  call->StartCall();
+  grpc::ByteBuffer response_buffer;
+  grpc::Status st;
+  call->Finish(&response_buffer, &st, nullptr);
+  void* tag;
+  bool ok;
+  bool got_event = cq.Next(&tag, &ok);
+  cq.Shutdown();
+  while (cq.Next(&tag, &ok)) {
+  }
+  if (!got_event) {
+    return grpc::Status(grpc::StatusCode::INTERNAL,
+                        "UpdateProfile call did not complete");
+  }
+  if (!st.ok()) {
+    return st;
+  }
+
+  std::vector<grpc::Slice> slices;
+  if (!response_buffer.Dump(&slices).ok()) {
+    return grpc::Status(grpc::StatusCode::INTERNAL,
+                        "Failed to read the UpdateProfile response");
+  }
+  string serialized;
+  for (const auto& slice : slices) {
+    serialized.append(reinterpret_cast<const char*>(slice.begin()),
+                      slice.size());
+  }
+  if (!response->ParseFromString(serialized)) {
+    return grpc::Status(grpc::StatusCode::INTERNAL,
+                        "Failed to parse the UpdateProfile response");
+  }
+  return st;
+}
+
 string DebugString(const grpc::Status& st) {
   std::ostringstream os;
   os << st.error_code() << " (" << st.error_message() << ")";  // NOLINT
@@ -228,10 +343,24 @@ APIThrottler::APIThrottler(
   gen_ = std::default_random_engine(clock_->Now().tv_nsec / 1000);
   dist_ = std::uniform_int_distribution<int64_t>(0, kRandomRange);
 
+  if (HeapMonitor::Enabled()) {
+    types_.push_back(api::HEAP);
+  }
+  if (ContentionMonitor::Enabled()) {
+    types_.push_back(api::CONTENTION);
+  }
+  if (ThreadsProfiler::Enabled()) {
+    types_.push_back(api::THREADS);
+  }
+
   if (!stub_) {  // Set in tests
     LOG(INFO) << "Will use profiler service " << FLAGS_cprof_api_address
               << " to create and upload profiles";
-    stub_ = NewProfilerServiceStub(FLAGS_cprof_api_address);
+    std::shared_ptr<grpc::ChannelInterface> channel;
+    stub_ = NewProfilerServiceStub(FLAGS_cprof_api_address, &channel);
+    if (channel != nullptr) {
+      generic_stub_.reset(new grpc::GenericStub(channel));
+    }
   }
 }
 
@@ -281,6 +410,12 @@ string APIThrottler::ProfileType() {
       return kTypeCPU;
     case api::WALL:
       return kTypeWall;
+    case api::HEAP:
+      return kTypeHeap;
+    case api::THREADS:
+      return kTypeThreads;
+    case api::CONTENTION:
+      return kTypeContention;
     default:
       const string& pt_name = api::ProfileType_Name(pt);
       LOG(ERROR) << "Unsupported profile type " << pt_name;
@@ -293,7 +428,7 @@ int64_t APIThrottler::DurationNanos() {
   return d.seconds() * kNanosPerSecond + d.nanos();
 }
 
-bool APIThrottler::Upload(string profile) {
+bool APIThrottler::Upload(const ChunkedBuffer& profile) {
   LOG(INFO) << "Uploading " << profile.size() << " bytes of '" << ProfileType()
             << "' profile data";
 
@@ -304,11 +439,17 @@ bool APIThrottler::Upload(string profile) {
     return false;
   }
 
-  api::UpdateProfileRequest req;
-  *req.mutable_profile() = profile_;
-
-  req.mutable_profile()->set_profile_bytes(std::move(profile));
-  grpc::Status st = stub_->UpdateProfile(&ctx, req, &profile_);
+  // The response replaces profile_, which is not needed past the request.
+  grpc::Status st;
+  if (generic_stub_ != nullptr) {
+    grpc::ByteBuffer req = UpdateProfileRequestBuffer(profile_, profile);
+    st = UpdateProfile(generic_stub_.get(), &ctx, req, &profile_);
+  } else {
+    api::UpdateProfileRequest req;
+    req.mutable_profile()->Swap(&profile_);
+    req.mutable_profile()->set_profile_bytes(profile.ToString());
+    st = stub_->UpdateProfile(&ctx, req, &profile_);
+  }
 
   if (!st.ok()) {
     // TODO: Recognize and retry transient errors.
@@ -27,6 +27,7 @@
 #include "google/devtools/cloudprofiler/v2/profiler.grpc.pb.h"
 
 #include "grpcpp/client_context.h"
+#include "grpcpp/generic/generic_stub.h"
 #include "grpcpp/support/status.h"
 
 namespace cloud {
@@ -51,7 +52,7 @@ class APIThrottler : public Throttler {
   bool WaitNext() override;
   string ProfileType() override;
   int64_t DurationNanos() override;
-  bool Upload(string profile) override;
+  bool Upload(const ChunkedBuffer& profile) override;
 
  private:
   // Takes a backoff on profile creation error. The backoff duration
@@ -65,6 +66,9 @@ class APIThrottler : public Throttler {
   std::unique_ptr<
       google::devtools::cloudprofiler::v2::grpc::ProfilerService::StubInterface>
       stub_;
+  // Generic stub on the channel of stub_, used to upload the profile
+  // bytes without copying them. Not set in tests.
+  std::unique_ptr<grpc::GenericStub> generic_stub_;
   google::devtools::cloudprofiler::v2::Profile profile_;
   std::vector<google::devtools::cloudprofiler::v2::ProfileType> types_;
 
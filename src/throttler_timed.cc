@@ -15,7 +15,12 @@
 #include "src/throttler_timed.h"
 
 #include <algorithm>
+#include <sstream>
 
+#include "src/contention_profiler.h"
+#include "src/heap_profiler.h"
+#include "src/perf_events.h"
+#include "src/threads_profiler.h"
 #include "src/uploader_file.h"
 #include "src/uploader_gcs.h"
 
@@ -24,6 +29,25 @@ DEFINE_int32(cprof_duration_sec, cloud::profiler::kProfileDurationSeconds, "");
 DEFINE_int32(cprof_delay_sec, 0, "");
 DEFINE_int32(cprof_max_count, cloud::profiler::kProfileMaxCount, "");
 DEFINE_string(cprof_force, "", "");
+DEFINE_string(cprof_perf_events, "",
+              "comma separated hardware event profiles to collect in each "
+              "interval, among cycles, instructions, llc-misses and "
+              "branch-misses");
+DEFINE_bool(cprof_continuous, false,
+            "collect profiles back to back without stopping the sampling, "
+            "each uploaded while the next one is collected; collects cpu "
+            "profiles unless cprof_force is set");
+DEFINE_bool(cprof_concurrent, false,
+            "collect the cpu and wall profiles of an interval over the same "
+            "window, rather than one after the other; with "
+            "cprof_wall_rt_signal=false, the signals of both profilers "
+            "collide, biasing the wall profile against running threads");
+DEFINE_string(cprof_file_compression, "gzip:1",
+              "compression of the profiles saved to the local filesystem, "
+              "as <format>[:<level>] with format one of none, gzip, zstd, lz4");
+DEFINE_string(cprof_gcs_compression, "gzip:9",
+              "compression of the profiles uploaded to Google Cloud Storage, "
+              "as <format>[:<level>] with format one of none, gzip, zstd, lz4");
 
 namespace cloud {
 namespace profiler {
@@ -61,6 +85,37 @@ string TryStripPrefix(const string& s, const string& prefix) {
   return StartsWith(s, prefix) ? s.substr(prefix.size()) : s;
 }
 
+// Gets the hardware event profile types from the flags, skipping the
+// unknown ones.
+std::vector<string> PerfEventTypes() {
+  std::vector<string> types;
+  std::stringstream stream(FLAGS_cprof_perf_events);
+  string type;
+  while (std::getline(stream, type, ',')) {
+    PerfEvent event;
+    int64_t period;
+    if (type.empty()) {
+      continue;
+    }
+    if (!LookupHardwareEvent(type, &event, &period)) {
+      LOG(ERROR) << "Unrecognized hardware event '" << type << "', skipping";
+      continue;
+    }
+    types.push_back(type);
+  }
+  return types;
+}
+
+// Parses a compression flag, falling back to gzip when it is invalid.
+Compression CompressionFromFlag(const string& spec) {
+  Compression compression;
+  if (!ParseCompression(spec, &compression)) {
+    LOG(ERROR) << "Using the default gzip compression";
+    compression = Compression();
+  }
+  return compression;
+}
+
 std::unique_ptr<ProfileUploader> UploaderFromFlags(const string& path) {
   if (path.empty()) {
     LOG(ERROR) << "Expected non-empty profile path";
@@ -70,10 +125,12 @@ std::unique_ptr<ProfileUploader> UploaderFromFlags(const string& path) {
   if (filename != path) {
     LOG(INFO) << "Will upload profiles to Google Cloud Storage";
     return std::unique_ptr<ProfileUploader>(
-        new GcsUploader(DefaultCloudEnv(), filename));
+        new GcsUploader(DefaultCloudEnv(), filename,
+                        CompressionFromFlag(FLAGS_cprof_gcs_compression)));
   } else {
     LOG(INFO) << "Will save profiles to the local filesystem";
-    return std::unique_ptr<ProfileUploader>(new FileUploader(filename));
+    return std::unique_ptr<ProfileUploader>(new FileUploader(
+        filename, CompressionFromFlag(FLAGS_cprof_file_compression)));
   }
 }
 
@@ -84,11 +141,48 @@ TimedThrottler::TimedThrottler(const string& path)
 
 TimedThrottler::TimedThrottler(std::unique_ptr<ProfileUploader> uploader,
                                Clock* clock, bool fixed_seed)
-    : clock_(clock), profile_count_(), uploader_(std::move(uploader)) {
+    : clock_(clock),
+      continuous_(FLAGS_cprof_continuous),
+      concurrent_(FLAGS_cprof_concurrent),
+      heap_(!continuous_ && HeapMonitor::Enabled()),
+      threads_(!continuous_ && ThreadsProfiler::Enabled()),
+      profile_count_(),
+      uploader_(std::move(uploader)) {
   interval_ns_ = GetConfiguration(&duration_cpu_ns_, &duration_wall_ns_);
+  if (!continuous_) {
+    perf_event_types_ = PerfEventTypes();
+  }
+  duration_perf_ns_ = FLAGS_cprof_duration_sec * kNanosPerSecond;
+  duration_contention_ns_ = !continuous_ && ContentionMonitor::Enabled()
+                                ? FLAGS_cprof_duration_sec * kNanosPerSecond
+                                : 0;
+  if (continuous_ && duration_cpu_ns_ > 0 && duration_wall_ns_ > 0) {
+    // Only one type can be sampled at a time, and it never stops.
+    duration_wall_ns_ = 0;
+  }
   LOG(INFO) << "sampling duration: cpu=" << duration_cpu_ns_ / kNanosPerSecond
             << "s, wall=" << duration_wall_ns_ / kNanosPerSecond << "s";
-  LOG(INFO) << "sampling interval: " << interval_ns_ / kNanosPerSecond << "s";
+  if (!perf_event_types_.empty()) {
+    LOG(INFO) << "sampling duration: " << perf_event_types_.size()
+              << " hardware events=" << duration_perf_ns_ / kNanosPerSecond
+              << "s each";
+  }
+  if (duration_contention_ns_ > 0) {
+    LOG(INFO) << "sampling duration: contention="
+              << duration_contention_ns_ / kNanosPerSecond << "s";
+  }
+  if (heap_) {
+    LOG(INFO) << "collecting heap profiles";
+  }
+  if (threads_) {
+    LOG(INFO) << "collecting threads profiles";
+  }
+  if (continuous_) {
+    LOG(INFO) << "sampling continuously";
+  } else {
+    LOG(INFO) << "sampling interval: " << interval_ns_ / kNanosPerSecond
+              << "s";
+  }
   LOG(INFO) << "sampling delay: " << FLAGS_cprof_delay_sec << "s";
 
   struct timespec now = clock_->Now();
@@ -106,13 +200,26 @@ TimedThrottler::TimedThrottler(std::unique_ptr<ProfileUploader> uploader,
   gen_ = std::default_random_engine(fixed_seed ? 10 : now.tv_nsec / 1000);
   dist_ = std::uniform_int_distribution<int64_t>(0, kRandomRange);
 
+  if (continuous_) {
+    // The profile type never changes, so that Upload() does not race
+    // with WaitNext().
+    if (duration_cpu_ns_ > 0) {
+      cur_.push_back({kTypeCPU, duration_cpu_ns_});
+    } else if (duration_wall_ns_ > 0) {
+      cur_.push_back({kTypeWall, duration_wall_ns_});
+    }
+    return;
+  }
+
   // This will get popped on the first WaitNext() call.
   cur_.push_back({"", 0});
 }
 
 bool TimedThrottler::WaitNext() {
-  if (!uploader_ || (duration_cpu_ns_ == 0 && duration_wall_ns_ == 0)) {
-    // Refuse profiling if both CPU and wall are disabled or no uploader.
+  if (!uploader_ || (duration_cpu_ns_ == 0 && duration_wall_ns_ == 0 &&
+                     perf_event_types_.empty() && !heap_ && !threads_ &&
+                     duration_contention_ns_ == 0)) {
+    // Refuse profiling if all the types are disabled or no uploader.
     LOG(WARNING) << "Profiling disabled";
     return false;
   }
@@ -122,6 +229,17 @@ bool TimedThrottler::WaitNext() {
     return false;
   }
 
+  if (continuous_) {
+    if (FLAGS_cprof_max_count > 0 && profile_count_ >= FLAGS_cprof_max_count) {
+      LOG(INFO) << "Reached maximum number of profiles to collect";
+      return false;
+    }
+    if (profile_count_++ == 0) {
+      clock_->SleepUntil(next_interval_);
+    }
+    return true;
+  }
+
   cur_.pop_back();
   if (cur_.empty()) {
     if (FLAGS_cprof_max_count > 0 && profile_count_ >= FLAGS_cprof_max_count) {
@@ -131,7 +249,13 @@ bool TimedThrottler::WaitNext() {
     profile_count_++;
 
     int64_t random_value = dist_(gen_);
-    int64_t wait_range_ns = interval_ns_ - duration_cpu_ns_ - duration_wall_ns_;
+    // Concurrent profiles share their window.
+    int64_t wait_range_ns =
+        concurrent_
+            ? interval_ns_ - std::max(duration_cpu_ns_, duration_wall_ns_)
+            : interval_ns_ - duration_cpu_ns_ - duration_wall_ns_;
+    wait_range_ns -= perf_event_types_.size() * duration_perf_ns_;
+    wait_range_ns -= duration_contention_ns_;
     if (wait_range_ns < 0) {
       wait_range_ns = 0;
     }
@@ -142,14 +266,40 @@ bool TimedThrottler::WaitNext() {
     clock_->SleepUntil(profiling_start);
     next_interval_ = TimeAdd(next_interval_, NanosToTimeSpec(interval_ns_));
 
-    if (duration_cpu_ns_ > 0) {
+    // Concurrent cpu and wall profiles are shuffled as a single unit, so
+    // that they stay next to each other.
+    bool paired = concurrent_ && duration_cpu_ns_ > 0 && duration_wall_ns_ > 0;
+    if (duration_cpu_ns_ > 0 && !paired) {
       cur_.push_back({kTypeCPU, duration_cpu_ns_});
     }
-    if (duration_wall_ns_ > 0) {
+    if (duration_wall_ns_ > 0 && !paired) {
       cur_.push_back({kTypeWall, duration_wall_ns_});
     }
+    for (const string& type : perf_event_types_) {
+      cur_.push_back({type, duration_perf_ns_});
+    }
+    if (duration_contention_ns_ > 0) {
+      cur_.push_back({kTypeContention, duration_contention_ns_});
+    }
+    if (heap_) {
+      // Snapshots of the sampled allocations, taken right away.
+      cur_.push_back({kTypeHeap, 0});
+      cur_.push_back({kTypeHeapAlloc, 0});
+    }
+    if (threads_) {
+      cur_.push_back({kTypeThreads, 0});
+    }
     // Randomize the profile type order.
     std::shuffle(cur_.begin(), cur_.end(), gen_);
+    if (paired) {
+      std::pair<string, int64_t> pair[] = {{kTypeCPU, duration_cpu_ns_},
+                                           {kTypeWall, duration_wall_ns_}};
+      if (dist_(gen_) % 2 == 0) {
+        std::swap(pair[0], pair[1]);
+      }
+      size_t position = dist_(gen_) % (cur_.size() + 1);
+      cur_.insert(cur_.begin() + position, pair, pair + 2);
+    }
   }
 
   return true;
@@ -163,7 +313,19 @@ int64_t TimedThrottler::DurationNanos() {
   return cur_.empty() ? 0 : cur_.back().second;
 }
 
-bool TimedThrottler::Upload(string profile) {
+string TimedThrottler::NextProfileType() {
+  if (!concurrent_ || cur_.size() < 2 ||
+      cur_[cur_.size() - 2].second != cur_.back().second) {
+    return "";
+  }
+  return cur_[cur_.size() - 2].first;
+}
+
+Compression TimedThrottler::ProfileCompression() {
+  return uploader_ ? uploader_->ProfileCompression() : Compression();
+}
+
+bool TimedThrottler::Upload(const ChunkedBuffer& profile) {
   if (cur_.empty() || !uploader_) {
     return false;
   }
@@ -19,6 +19,7 @@
 
 #include <memory>
 #include <random>
+#include <vector>
 
 #include "src/clock.h"
 #include "src/throttler.h"
@@ -42,11 +43,25 @@ class TimedThrottler : public Throttler {
   bool WaitNext() override;
   string ProfileType() override;
   int64_t DurationNanos() override;
-  bool Upload(string profile) override;
+  string NextProfileType() override;
+  Compression ProfileCompression() override;
+  bool Continuous() override { return continuous_; }
+  bool Upload(const ChunkedBuffer& profile) override;
 
  private:
   Clock* clock_;
+  bool continuous_;
+  bool concurrent_;
+  // Whether to collect the heap profiles, when the heap is sampled.
+  bool heap_;
+  // Whether to collect snapshots of the thread stacks.
+  bool threads_;
   int64_t duration_cpu_ns_, duration_wall_ns_;
+  // Hardware event profiles collected after the cpu and wall ones.
+  std::vector<string> perf_event_types_;
+  int64_t duration_perf_ns_;
+  // Zero unless the contention profiles are enabled.
+  int64_t duration_contention_ns_;
   int64_t interval_ns_;
 
   std::default_random_engine gen_;
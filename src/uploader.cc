@@ -19,12 +19,14 @@
 namespace cloud {
 namespace profiler {
 
-string ProfilePath(const string& prefix, const string& profile_type) {
+string ProfilePath(const string& prefix, const string& profile_type,
+                   const Compression& compression) {
   using std::chrono::system_clock;
   int64_t timestamp = std::chrono::duration_cast<std::chrono::seconds>(
                           system_clock::now().time_since_epoch())
                           .count();
-  return prefix + profile_type + "_" + std::to_string(timestamp) + ".pb.gz";
+  return prefix + profile_type + "_" + std::to_string(timestamp) +
+         CompressionExtension(compression);
 }
 
 }  // namespace profiler
@@ -17,6 +17,8 @@
 #ifndef CLOUD_PROFILER_AGENT_JAVA_UPLOADER_H_
 #define CLOUD_PROFILER_AGENT_JAVA_UPLOADER_H_
 
+#include "src/chunked_buffer.h"
+#include "src/compression.h"
 #include "src/globals.h"
 
 namespace cloud {
@@ -25,12 +27,18 @@ namespace profiler {
 class ProfileUploader {
  public:
   virtual ~ProfileUploader() {}
-  virtual bool Upload(const string &profile_type, const string &profile) = 0;
+  virtual bool Upload(const string &profile_type,
+                      const ChunkedBuffer &profile) = 0;
+
+  // Returns the compression the uploaded profiles should use.
+  virtual Compression ProfileCompression() const { return Compression(); }
 };
 
 // Returns the path to use for a profile.  The path will contain the current
-// timestamp which makes it fairly (but not necessarily globally) unique.
-string ProfilePath(const string& prefix, const string& profile_type);
+// timestamp which makes it fairly (but not necessarily globally) unique, and
+// end with the extension matching the compression of the profile.
+string ProfilePath(const string& prefix, const string& profile_type,
+                   const Compression& compression);
 
 }  // namespace profiler
 }  // namespace cloud
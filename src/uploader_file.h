@@ -26,10 +26,12 @@ namespace profiler {
 
 class FileUploader : public cloud::profiler::ProfileUploader {
  public:
-  explicit FileUploader(const string& prefix) : prefix_(prefix) {}
+  FileUploader(const string& prefix, const Compression& compression)
+      : prefix_(prefix), compression_(compression) {}
 
-  bool Upload(const string &profile_type, const string &profile) override {
-    string filename = ProfilePath(prefix_, profile_type);
+  bool Upload(const string &profile_type,
+              const ChunkedBuffer &profile) override {
+    string filename = ProfilePath(prefix_, profile_type, compression_);
 
     FILE *f = fopen(filename.c_str(), "w");
     if (f == nullptr) {
@@ -39,8 +41,11 @@ class FileUploader : public cloud::profiler::ProfileUploader {
 
     LOG(INFO) << "Saving profile to " << filename;
 
-    int count = profile.size();
-    int wrote = fwrite(profile.c_str(), 1, count, f);
+    size_t count = profile.size();
+    size_t wrote = 0;
+    for (const auto &chunk : profile.chunks()) {
+      wrote += fwrite(chunk->data.get(), 1, chunk->size, f);
+    }
     fclose(f);
 
     if (wrote != count) {
@@ -50,8 +55,11 @@ class FileUploader : public cloud::profiler::ProfileUploader {
     return true;
   }
 
+  Compression ProfileCompression() const override { return compression_; }
+
  private:
   string prefix_;
+  Compression compression_;
   DISALLOW_COPY_AND_ASSIGN(FileUploader);
 };
 
@@ -28,7 +28,8 @@ namespace profiler {
 
 const char kGcsHost[] = "https://storage.googleapis.com";
 
-bool GcsUploader::Upload(const string &profile_type, const string &profile) {
+bool GcsUploader::Upload(const string &profile_type,
+                         const ChunkedBuffer &profile) {
   LOG(INFO) << "Uploading " << profile.size() << " byte " << profile_type
             << " profile to GCS";
 
@@ -44,7 +45,8 @@ bool GcsUploader::Upload(const string &profile_type, const string &profile) {
   uploadReq.AddHeader("Content-Length", std::to_string(profile.size()));
   uploadReq.SetTimeout(FLAGS_cprof_gcs_upload_timeout_sec);
 
-  string url = string(kGcsHost) + "/" + ProfilePath(prefix_, profile_type);
+  string url = string(kGcsHost) + "/" +
+               ProfilePath(prefix_, profile_type, compression_);
   if (!uploadReq.DoPut(url, profile)) {
     LOG(ERROR) << "Error making profile upload HTTP request to GCS";
     return false;
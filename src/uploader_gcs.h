@@ -35,16 +35,20 @@ class HTTPRequest;
 class GcsUploader : public cloud::profiler::ProfileUploader {
  public:
   // Constructs an uploader to GCS which uses the specified caller-owned
-  // environment object and the specified profile path prefix.
-  GcsUploader(CloudEnv* env, const string& prefix)
-      : env_(env), prefix_(prefix) {}
+  // environment object, profile path prefix and profile compression.
+  GcsUploader(CloudEnv* env, const string& prefix,
+              const Compression& compression)
+      : env_(env), prefix_(prefix), compression_(compression) {}
 
   // Implements ProfileUploader interface.
-  bool Upload(const string& profile_type, const string& profile) override;
+  bool Upload(const string& profile_type,
+              const ChunkedBuffer& profile) override;
+  Compression ProfileCompression() const override { return compression_; }
 
  private:
   CloudEnv* env_;
   string prefix_;
+  Compression compression_;
   DISALLOW_COPY_AND_ASSIGN(GcsUploader);
 };
 
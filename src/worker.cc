@@ -14,7 +14,12 @@
 
 #include "src/worker.h"
 
+#include <condition_variable>  // NOLINT(build/c++11)
+#include <deque>
+
 #include "src/clock.h"
+#include "src/contention_profiler.h"
+#include "src/heap_profiler.h"
 #include "src/profiler.h"
 #include "src/throttler_api.h"
 #include "src/throttler_timed.h"
@@ -28,6 +33,9 @@ DEFINE_int32(cprof_cpu_sampling_period_msec, 10,
              "sampling period for CPU time profiling, in milliseconds");
 DEFINE_int32(cprof_wall_sampling_period_msec, 100,
              "sampling period for wall time profiling, in milliseconds");
+DEFINE_int32(cprof_symbolizer_threads, 2,
+             "number of additional threads resolving the methods of a "
+             "profile, 0 to resolve them on the profiling thread only");
 
 namespace cloud {
 namespace profiler {
@@ -51,6 +59,7 @@ void Worker::Start(JNIEnv *jni) {
     return;
   }
 
+  symbolizers_.Start(jni, FLAGS_cprof_symbolizer_threads);
   enabled_ = FLAGS_cprof_enabled;
 }
 
@@ -58,19 +67,182 @@ void Worker::Stop() {
   // Signal the worker thread to exit and wait until it does.
   stopping_.store(true, std::memory_order_release);
   std::lock_guard<std::mutex> lock(mutex_);
+  symbolizers_.Stop();
 }
 
 namespace {
 
-string Collect(Profiler *p,
-               google::javaprofiler::NativeProcessInfo *native_info) {
+// Number of windows of a continuous collection that can wait for the
+// upload thread before the oldest are discarded.
+const size_t kMaxQueuedWindows = 2;
+
+// Number of local references to reserve on the upload thread per window.
+const jint kLocalFrameCapacity = 64;
+
+// WindowUploader serializes and uploads the windows of a continuous
+// collection on an agent thread, while the next ones are being sampled.
+class WindowUploader {
+ public:
+  WindowUploader(jvmtiEnv *jvmti, Throttler *throttler,
+                 AgentThreadPool *symbolizers)
+      : jvmti_(jvmti),
+        throttler_(throttler),
+        symbolizers_(symbolizers),
+        native_info_("/proc/self/maps"),
+        running_(false),
+        stopping_(false) {}
+
+  // Starts the upload thread. Returns false on error, in which case the
+  // windows are uploaded by Push() itself.
+  bool Start(JNIEnv *jni) {
+    jclass cls = jni->FindClass("java/lang/Thread");
+    jmethodID constructor = jni->GetMethodID(cls, "<init>", "()V");
+    jobject thread = jni->NewGlobalRef(jni->NewObject(cls, constructor));
+    if (thread == nullptr) {
+      LOG(ERROR) << "Failed to construct cloud profiler upload thread";
+      return false;
+    }
+
+    running_ = true;
+    jvmtiError err = jvmti_->RunAgentThread(thread, ThreadMain, this,
+                                            JVMTI_THREAD_MIN_PRIORITY);
+    if (err) {
+      LOG(ERROR) << "Failed to start cloud profiler upload thread";
+      running_ = false;
+      return false;
+    }
+    return true;
+  }
+
+  // Queues a window for upload, discarding the oldest queued one when
+  // the uploads are falling behind.
+  void Push(std::unique_ptr<Profiler::Window> window) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!running_) {
+      lock.unlock();
+      Upload(window.get());
+      return;
+    }
+    if (windows_.size() >= kMaxQueuedWindows) {
+      LOG(WARNING) << "Profile uploads falling behind, discarding a "
+                   << windows_.front()->profile_type << " profile";
+      windows_.pop_front();
+    }
+    windows_.push_back(std::move(window));
+    cv_.notify_all();
+  }
+
+  // Uploads the windows still queued, and waits for the upload thread
+  // to exit.
+  void Stop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    stopping_ = true;
+    cv_.notify_all();
+    cv_.wait(lock, [this] { return !running_; });
+  }
+
+ private:
+  static void ThreadMain(jvmtiEnv *jvmti_env, JNIEnv *jni_env, void *arg) {
+    WindowUploader *u = static_cast<WindowUploader *>(arg);
+
+    std::unique_lock<std::mutex> lock(u->mutex_);
+    while (true) {
+      u->cv_.wait(lock, [u] { return u->stopping_ || !u->windows_.empty(); });
+      if (u->windows_.empty()) {
+        break;
+      }
+      std::unique_ptr<Profiler::Window> window =
+          std::move(u->windows_.front());
+      u->windows_.pop_front();
+      lock.unlock();
+
+      // This thread never returns to Java, release the local references
+      // created while serializing once the window is done.
+      jni_env->PushLocalFrame(kLocalFrameCapacity);
+      u->Upload(window.get());
+      jni_env->PopLocalFrame(nullptr);
+
+      lock.lock();
+    }
+    u->running_ = false;
+    u->cv_.notify_all();
+  }
+
+  void Upload(Profiler::Window *window) {
+    native_info_.Refresh();
+    ChunkedBuffer profile = Profiler::SerializeWindow(
+        jvmti_, window, native_info_, throttler_->ProfileCompression(),
+        symbolizers_);
+    if (profile.empty()) {
+      LOG(ERROR) << "No profile bytes collected, skipping the upload";
+      return;
+    }
+    if (!throttler_->Upload(profile)) {
+      LOG(ERROR) << "Error on profile upload, discarding the profile";
+    }
+  }
+
+  jvmtiEnv *jvmti_;
+  Throttler *throttler_;
+  AgentThreadPool *symbolizers_;
+  // Only used by the thread running the uploads.
+  google::javaprofiler::NativeProcessInfo native_info_;
+
+  // Protects the fields below.
+  std::mutex mutex_;
+  // Signaled when a window is queued, on stop, and on thread exit.
+  std::condition_variable cv_;
+  std::deque<std::unique_ptr<Profiler::Window>> windows_;
+  bool running_;
+  bool stopping_;
+
+  DISALLOW_COPY_AND_ASSIGN(WindowUploader);
+};
+
+ChunkedBuffer Collect(Profiler *p,
+                      google::javaprofiler::NativeProcessInfo *native_info,
+                      const Compression &compression,
+                      AgentThreadPool *symbolizers) {
   const char *profile_type = p->ProfileType();
   if (!p->Collect()) {
     LOG(ERROR) << "Failure: Could not collect " << profile_type << " profile";
-    return "";
+    return ChunkedBuffer();
   }
   native_info->Refresh();
-  return p->SerializeProfile(*native_info);
+  return p->SerializeProfile(*native_info, compression, symbolizers);
+}
+
+bool IsHardwareEventType(const string &profile_type) {
+  PerfEvent event;
+  int64_t period;
+  return LookupHardwareEvent(profile_type, &event, &period);
+}
+
+// Collects a cpu and a wall profile over the same window.
+void CollectCpuAndWall(jvmtiEnv *jvmti, ThreadTable *threads,
+                       int64_t duration_nanos,
+                       google::javaprofiler::NativeProcessInfo *native_info,
+                       const Compression &compression,
+                       AgentThreadPool *symbolizers, ChunkedBuffer *cpu_profile,
+                       ChunkedBuffer *wall_profile) {
+  CPUProfiler cpu(jvmti, threads, duration_nanos,
+                  FLAGS_cprof_cpu_sampling_period_msec * kNanosPerMilli);
+  WallProfiler wall(jvmti, threads, duration_nanos,
+                    FLAGS_cprof_wall_sampling_period_msec * kNanosPerMilli);
+  bool cpu_ok, wall_ok;
+  CollectConcurrently(&cpu, &wall, duration_nanos, &cpu_ok, &wall_ok);
+  native_info->Refresh();
+  if (cpu_ok) {
+    *cpu_profile = cpu.SerializeProfile(*native_info, compression, symbolizers);
+  } else {
+    LOG(ERROR) << "Failure: Could not collect cpu profile";
+  }
+  if (wall_ok) {
+    *wall_profile =
+        wall.SerializeProfile(*native_info, compression, symbolizers);
+  } else {
+    LOG(ERROR) << "Failure: Could not collect wall profile";
+  }
 }
 
 }  // namespace
@@ -93,8 +265,22 @@ void Worker::ProfileThread(jvmtiEnv *jvmti_env, JNIEnv *jni_env, void *arg) {
           : std::unique_ptr<Throttler>(
                 new TimedThrottler(FLAGS_cprof_profile_filename));
 
+  if (t->Continuous()) {
+    w->ProfileContinuously(jni_env, t.get());
+    LOG(INFO) << "Exiting the profiling loop";
+    return;
+  }
+
+  // Profile collected along with the previous one, uploaded if the
+  // throttler moves on to its type right away, else dropped as stale.
+  string pending_type;
+  ChunkedBuffer pending;
   while (t->WaitNext()) {
     std::lock_guard<std::mutex> lock(w->mutex_);
+    string paired_type;
+    paired_type.swap(pending_type);
+    ChunkedBuffer paired = std::move(pending);
+    pending = ChunkedBuffer();
     if (w->stopping_) {
       // The worker is exiting.
       break;
@@ -103,18 +289,48 @@ void Worker::ProfileThread(jvmtiEnv *jvmti_env, JNIEnv *jni_env, void *arg) {
       // Skip the collection and upload steps when profiling is disabled.
       continue;
     }
-    string profile;
+    ChunkedBuffer profile;
     string pt = t->ProfileType();
-    if (pt == kTypeCPU) {
+    string next_pt = t->NextProfileType();
+    if (!paired_type.empty() && pt == paired_type) {
+      profile = std::move(paired);
+    } else if ((pt == kTypeCPU && next_pt == kTypeWall) ||
+               (pt == kTypeWall && next_pt == kTypeCPU)) {
+      ChunkedBuffer cpu_profile, wall_profile;
+      CollectCpuAndWall(w->jvmti_, w->threads_, t->DurationNanos(), &n,
+                        t->ProfileCompression(), &w->symbolizers_,
+                        &cpu_profile, &wall_profile);
+      profile = std::move(pt == kTypeCPU ? cpu_profile : wall_profile);
+      pending = std::move(pt == kTypeCPU ? wall_profile : cpu_profile);
+      pending_type = next_pt;
+    } else if (pt == kTypeCPU) {
       CPUProfiler p(w->jvmti_, w->threads_, t->DurationNanos(),
                     FLAGS_cprof_cpu_sampling_period_msec * kNanosPerMilli);
-      profile = Collect(&p, &n);
+      profile = Collect(&p, &n, t->ProfileCompression(), &w->symbolizers_);
     } else if (pt == kTypeWall) {
       // Note that the requested sampling period for the wall profiling may be
       // increased if the number of live threads is too large.
       WallProfiler p(w->jvmti_, w->threads_, t->DurationNanos(),
                      FLAGS_cprof_wall_sampling_period_msec * kNanosPerMilli);
-      profile = Collect(&p, &n);
+      profile = Collect(&p, &n, t->ProfileCompression(), &w->symbolizers_);
+    } else if (IsHardwareEventType(pt)) {
+      PerfEventProfiler p(
+          w->jvmti_, w->threads_, t->DurationNanos(), pt,
+          FLAGS_cprof_cpu_sampling_period_msec * kNanosPerMilli);
+      profile = Collect(&p, &n, t->ProfileCompression(), &w->symbolizers_);
+    } else if (pt == kTypeHeap) {
+      profile = HeapMonitor::InuseProfile(w->jvmti_, jni_env,
+                                          t->ProfileCompression());
+    } else if (pt == kTypeHeapAlloc) {
+      profile = HeapMonitor::AllocProfile(w->jvmti_, jni_env,
+                                          t->ProfileCompression());
+    } else if (pt == kTypeThreads) {
+      n.Refresh();
+      profile = w->threads_profiler_.Collect(
+          jni_env, n, t->ProfileCompression(), &w->symbolizers_);
+    } else if (pt == kTypeContention) {
+      profile = ContentionMonitor::Collect(w->jvmti_, t->DurationNanos(),
+                                           t->ProfileCompression());
     } else {
       LOG(ERROR) << "Unknown profile type '" << pt << "', skipping the upload";
       continue;
@@ -130,5 +346,86 @@ void Worker::ProfileThread(jvmtiEnv *jvmti_env, JNIEnv *jni_env, void *arg) {
   LOG(INFO) << "Exiting the profiling loop";
 }
 
+void Worker::ProfileContinuously(JNIEnv *jni, Throttler *t) {
+  WindowUploader uploader(jvmti_, t, &symbolizers_);
+  if (!uploader.Start(jni)) {
+    LOG(WARNING) << "Uploading the profiles from the profiling thread";
+  }
+
+  Clock *clock = DefaultClock();
+  std::unique_ptr<Profiler> p;
+  struct timespec window = NanosToTimeSpec(t->DurationNanos());
+  struct timespec finish_line;
+  bool sampling = false;
+  bool more = true;
+  while (more) {
+    more = t->WaitNext();
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (stopping_ || !more || !enabled_) {
+      if (sampling) {
+        // The samples taken since the last window are dropped.
+        p->Stop();
+        sampling = false;
+      }
+      if (stopping_ || !more) {
+        // Done while holding the lock, so that the uploads complete
+        // before Stop() returns.
+        uploader.Stop();
+        break;
+      }
+      // Check again after a window whether profiling got enabled.
+      clock->SleepFor(window);
+      continue;
+    }
+
+    if (p == nullptr) {
+      string pt = t->ProfileType();
+      if (pt == kTypeCPU) {
+        p.reset(new CPUProfiler(
+            jvmti_, threads_, t->DurationNanos(),
+            FLAGS_cprof_cpu_sampling_period_msec * kNanosPerMilli));
+      } else if (pt == kTypeWall) {
+        // The sampling period is computed once, from the number of live
+        // threads at start.
+        p.reset(new WallProfiler(
+            jvmti_, threads_, t->DurationNanos(),
+            FLAGS_cprof_wall_sampling_period_msec * kNanosPerMilli));
+      } else {
+        LOG(ERROR) << "Unknown profile type '" << pt << "', not profiling";
+        uploader.Stop();
+        break;
+      }
+    }
+
+    if (!sampling) {
+      p->Reset();
+      if (!p->Start()) {
+        LOG(ERROR) << "Failure: Could not start " << p->ProfileType()
+                   << " profiling";
+        clock->SleepFor(window);
+        continue;
+      }
+      sampling = true;
+      finish_line = clock->Now();
+    }
+
+    // Windows are cut on a fixed schedule, so that they do not drift
+    // with the time spent taking them.
+    finish_line = TimeAdd(finish_line, window);
+    bool ok = p->Sample(finish_line);
+    p->Flush();
+    std::unique_ptr<Profiler::Window> w = p->TakeWindow();
+    if (!ok) {
+      LOG(ERROR) << "Failure: Could not collect " << p->ProfileType()
+                 << " profile";
+      p->Stop();
+      sampling = false;
+      clock->SleepUntil(finish_line);
+      continue;
+    }
+    uploader.Push(std::move(w));
+  }
+}
+
 }  // namespace profiler
 }  // namespace cloud
@@ -21,7 +21,9 @@
 #include <mutex>  // NOLINT
 
 #include "src/globals.h"
+#include "src/thread_pool.h"
 #include "src/threads.h"
+#include "src/threads_profiler.h"
 #include "src/throttler.h"
 
 namespace cloud {
@@ -30,7 +32,11 @@ namespace profiler {
 class Worker {
  public:
   Worker(jvmtiEnv *jvmti, ThreadTable *threads)
-      : jvmti_(jvmti), threads_(threads), stopping_() {}
+      : jvmti_(jvmti),
+        threads_(threads),
+        symbolizers_(jvmti),
+        threads_profiler_(jvmti),
+        stopping_() {}
 
   void Start(JNIEnv *jni);
   void Stop();
@@ -41,8 +47,15 @@ class Worker {
  private:
   static void ProfileThread(jvmtiEnv *jvmti_env, JNIEnv *jni_env, void *arg);
 
+  // Collects profiles back to back for a continuous throttler, while
+  // another thread serializes and uploads the previous ones.
+  void ProfileContinuously(JNIEnv *jni, Throttler *t);
+
   jvmtiEnv *jvmti_;
   ThreadTable *threads_;
+  AgentThreadPool symbolizers_;  // Resolves the methods of the profiles.
+  // Keeps the depth of the snapshots within their pause budget.
+  ThreadsProfiler threads_profiler_;
   std::mutex mutex_;  // Held by the worker thread while it's running.
   std::atomic<bool> stopping_;
   static std::atomic<bool> enabled_;
@@ -17,6 +17,8 @@
 #include <inttypes.h>
 #include <jni.h>
 #include <jvmti.h>
+#include <algorithm>
+#include <atomic>
 #include <cstring>
 
 #include "third_party/javaprofiler/stacktrace_fixer.h"
@@ -69,9 +71,8 @@ void GetMethodName(jvmtiEnv *jvmti, jmethodID method_id, string *method_name,
 
   signature_ptr.AbandonBecauseOfError();
   name_ptr.AbandonBecauseOfError();
-  static int once = 0;
-  if (!once) {
-    once = 1;
+  static std::atomic<bool> once(false);
+  if (!once.exchange(true)) {
     if (error == JVMTI_ERROR_INVALID_METHODID) {
       LOG(INFO) << "One of your monitoring interfaces "
                    "is having trouble resolving its stack traces. "
@@ -125,56 +126,71 @@ static void GetClassAndFileName(jvmtiEnv *jvmti, jmethodID method_id,
 
 }  // end namespace
 
-jint GetLineNumber(jvmtiEnv *jvmti, jmethodID method, jlocation location) {
+bool LineNumberTable::Load(jvmtiEnv *jvmti, jmethodID method) {
+  entries_.clear();
+
   jint entry_count;
   JvmtiScopedPtr<jvmtiLineNumberEntry> table_ptr_ctr(jvmti);
-  jint line_number = -1;
-
-  // Shortcut for native methods.
-  if (location < 0) {
-    return -1;
-  }
-
   int jvmti_error =
       jvmti->GetLineNumberTable(method, &entry_count, table_ptr_ctr.GetRef());
 
   if (JVMTI_ERROR_NONE != jvmti_error || entry_count <= 0) {
     if (JVMTI_ERROR_ABSENT_INFORMATION == jvmti_error) {
-      static bool no_debug_info = false;
-      if (!no_debug_info) {
+      static std::atomic<bool> no_debug_info(false);
+      if (!no_debug_info.exchange(true)) {
         LOG(INFO)
             << "No line number information was found in your bytecode."
                " Some monitoring interfaces may report -1 ""for line numbers.";
-        no_debug_info = true;
       }
     }
 
     table_ptr_ctr.AbandonBecauseOfError();
-    return -1;
+    return false;
   }
 
   jvmtiLineNumberEntry *table_ptr = table_ptr_ctr.Get();
-  if (entry_count == 1) {
-    return table_ptr[0].line_number;
-  }
-
-  jlocation last_location = table_ptr[0].start_location;
-  for (int l = 1; l < entry_count; l++) {
-    // ... and if you see one that is in the right place for your
-    // location, you've found the line number!
-    if ((location < table_ptr[l].start_location) &&
-        (location >= last_location)) {
-      line_number = table_ptr[l - 1].line_number;
-      return line_number;
-    }
-    last_location = table_ptr[l].start_location;
+  entries_.assign(table_ptr, table_ptr + entry_count);
+  // Tables are usually sorted already. Keep entries starting at the same
+  // location in order, the last one of them applies.
+  std::stable_sort(entries_.begin(), entries_.end(),
+                   [](const jvmtiLineNumberEntry &e1,
+                      const jvmtiLineNumberEntry &e2) {
+                     return e1.start_location < e2.start_location;
+                   });
+  return true;
+}
+
+jint LineNumberTable::Lookup(jlocation location) const {
+  // Shortcut for native methods.
+  if (location < 0 || entries_.empty()) {
+    return -1;
   }
 
-  if (location >= last_location) {
-    return table_ptr[entry_count - 1].line_number;
+  if (entries_.size() == 1) {
+    return entries_[0].line_number;
+  }
+
+  // Find the last entry starting at or before the location.
+  auto next = std::upper_bound(
+      entries_.begin(), entries_.end(), location,
+      [](jlocation l, const jvmtiLineNumberEntry &e) {
+        return l < e.start_location;
+      });
+  if (next == entries_.begin()) {
+    return -1;
+  }
+  return (next - 1)->line_number;
+}
+
+jint GetLineNumber(jvmtiEnv *jvmti, jmethodID method, jlocation location) {
+  // Shortcut for native methods.
+  if (location < 0) {
+    return -1;
   }
 
-  return -1;
+  LineNumberTable table;
+  table.Load(jvmti, method);
+  return table.Lookup(location);
 }
 
 static void FillFieldsWithUnknown(string *file_name, string *class_name,
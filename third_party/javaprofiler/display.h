@@ -16,6 +16,7 @@
 
 #include <jvmti.h>
 #include <string>
+#include <vector>
 
 #include "third_party/javaprofiler/globals.h"
 #include "third_party/javaprofiler/native.h"
@@ -27,6 +28,24 @@
 namespace google {
 namespace javaprofiler {
 
+// A copy of the line number table of a method, sorted by location so
+// that lines can be looked up with a binary search.
+class LineNumberTable {
+ public:
+  LineNumberTable() {}
+
+  // Replaces the contents with the line number table of the method.
+  // Returns false, leaving the table empty, if it is not available.
+  bool Load(jvmtiEnv *jvmti, jmethodID method);
+
+  // Returns the Java line number for the location.
+  // Returns -1 if it is unknown or for native methods.
+  jint Lookup(jlocation location) const;
+
+ private:
+  std::vector<jvmtiLineNumberEntry> entries_;
+};
+
 // Walks the line number table and return the associated Java line number from a
 // given method and location.
 // Returns -1 on error or for native methods.
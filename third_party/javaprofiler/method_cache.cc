@@ -0,0 +1,124 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "third_party/javaprofiler/method_cache.h"
+
+#include <memory>
+#include <unordered_set>
+#include <utility>
+
+namespace google {
+namespace javaprofiler {
+
+void MethodCache::BeginProfile() {
+  profile_++;
+  for (auto it = methods_.begin(); it != methods_.end();) {
+    if (profile_ - it->second.profile > kMaxIdleProfiles) {
+      it = methods_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+void MethodCache::Prefetch(const std::vector<jmethodID> &methods,
+                           const ParallelRunner &run) {
+  if (jvmti_ == nullptr) {
+    return;
+  }
+
+  // Methods not yet checked for this profile, and whether they are cached.
+  std::vector<jmethodID> pending;
+  std::vector<bool> cached;
+  std::unordered_set<jmethodID> seen;
+  for (jmethodID method_id : methods) {
+    if (!seen.insert(method_id).second) {
+      continue;
+    }
+    auto it = methods_.find(method_id);
+    if (it == methods_.end() || it->second.profile != profile_) {
+      pending.push_back(method_id);
+      cached.push_back(it != methods_.end());
+    }
+  }
+
+  // Not a std::vector<bool>, as the loop writes its elements concurrently.
+  std::unique_ptr<bool[]> valid(new bool[pending.size()]);
+  std::vector<CachedMethod> resolved(pending.size());
+  run(pending.size(), [&](int64_t i) {
+    valid[i] = IsValid(pending[i]);
+    if (valid[i] && !cached[i]) {
+      Resolve(pending[i], &resolved[i]);
+    }
+  });
+
+  for (size_t i = 0; i < pending.size(); i++) {
+    if (!valid[i]) {
+      // Left for Lookup to symbolize without caching.
+      methods_.erase(pending[i]);
+    } else if (cached[i]) {
+      methods_[pending[i]].profile = profile_;
+    } else {
+      resolved[i].profile = profile_;
+      methods_.emplace(pending[i], std::move(resolved[i]));
+    }
+  }
+}
+
+const MethodCache::MethodInfo &MethodCache::Lookup(const JVMPI_CallFrame &frame,
+                                                  int *line_number) {
+  auto it = methods_.find(frame.method_id);
+  if (it == methods_.end() || it->second.profile != profile_) {
+    if (jvmti_ == nullptr || !IsValid(frame.method_id)) {
+      if (it != methods_.end()) {
+        methods_.erase(it);
+      }
+      GetStackFrameElements(jvmti_, frame, &uncached_.file_name,
+                            &uncached_.class_name, &uncached_.method_name,
+                            &uncached_.signature, line_number);
+      return uncached_;
+    }
+
+    if (it == methods_.end()) {
+      CachedMethod method;
+      Resolve(frame.method_id, &method);
+      *line_number = method.line_numbers.Lookup(frame.lineno);
+      method.profile = profile_;
+      return methods_.emplace(frame.method_id, std::move(method))
+          .first->second.info;
+    }
+    it->second.profile = profile_;
+  }
+
+  CachedMethod &method = it->second;
+  *line_number = method.line_numbers.Lookup(frame.lineno);
+  return method.info;
+}
+
+bool MethodCache::IsValid(jmethodID method_id) const {
+  jint modifiers;
+  return jvmti_->GetMethodModifiers(method_id, &modifiers) ==
+         JVMTI_ERROR_NONE;
+}
+
+void MethodCache::Resolve(jmethodID method_id, CachedMethod *method) const {
+  JVMPI_CallFrame frame = {0, method_id};
+  GetStackFrameElements(jvmti_, frame, &method->info.file_name,
+                        &method->info.class_name, &method->info.method_name,
+                        &method->info.signature, nullptr);
+  method->line_numbers.Load(jvmti_, method_id);
+}
+
+}  // namespace javaprofiler
+}  // namespace google
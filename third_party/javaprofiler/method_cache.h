@@ -0,0 +1,116 @@
+/*
+ * Copyright 2018 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef THIRD_PARTY_JAVAPROFILER_METHOD_CACHE_H_
+#define THIRD_PARTY_JAVAPROFILER_METHOD_CACHE_H_
+
+#include <jvmti.h>
+
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+#include "third_party/javaprofiler/display.h"
+#include "third_party/javaprofiler/globals.h"
+#include "third_party/javaprofiler/stacktrace_decls.h"
+
+namespace google {
+namespace javaprofiler {
+
+// MethodCache keeps the symbols of the Java methods found in stack
+// traces across profiles, so that symbolizing the methods seen in
+// earlier profiles does not go through JVMTI again. This includes the
+// line number table of each method, so resolving the line of any
+// frame is a binary search.
+//
+// jmethodIDs are invalidated when their class is unloaded, so each
+// cached method is checked once per profile, on first use, with a single
+// JVMTI call. Methods that fail the check are no longer cached, and
+// methods not used for kMaxIdleProfiles profiles are dropped, releasing
+// their line number tables along with them.
+//
+// Not thread safe.
+class MethodCache {
+ public:
+  // Symbols of a method, as filled by GetStackFrameElements().
+  struct MethodInfo {
+    string file_name;
+    string class_name;
+    string method_name;
+    string signature;
+  };
+
+  // Runs a loop, possibly on several threads: calls its second argument
+  // for every index below its first one, and returns once all the calls
+  // complete.
+  typedef std::function<void(int64_t, const std::function<void(int64_t)> &)>
+      ParallelRunner;
+
+  explicit MethodCache(jvmtiEnv *jvmti) : jvmti_(jvmti), profile_(0) {}
+
+  // Starts symbolizing a new profile. Cached methods are checked again
+  // on their first lookup, and those unused for too long are dropped.
+  void BeginProfile();
+
+  // Checks and resolves the given methods ahead of their lookups, making
+  // the JVMTI calls in a loop run by run. The cache itself is only
+  // updated by the calling thread, in the order of methods, so it does
+  // not depend on how run schedules the loop.
+  void Prefetch(const std::vector<jmethodID> &methods,
+                const ParallelRunner &run);
+
+  // Returns the symbols of the method of a Java frame, and fills
+  // line_number with the line of the frame. The result is valid until
+  // the next call.
+  const MethodInfo &Lookup(const JVMPI_CallFrame &frame, int *line_number);
+
+  // Returns the number of cached methods.
+  size_t Size() const { return methods_.size(); }
+
+ private:
+  struct CachedMethod {
+    MethodInfo info;
+    LineNumberTable line_numbers;
+    // Last profile the method was checked for.
+    int64_t profile;
+  };
+
+  // Number of profiles a method is kept for without being used.
+  static const int64_t kMaxIdleProfiles = 16;
+
+  // Returns whether method is still valid. GetMethodModifiers fails with
+  // JVMTI_ERROR_INVALID_METHODID once the class of the method is
+  // unloaded, and does not allocate.
+  bool IsValid(jmethodID method_id) const;
+
+  // Fills the symbols and line number table of a valid method. Can run
+  // concurrently with other calls to Resolve.
+  void Resolve(jmethodID method_id, CachedMethod *method) const;
+
+  jvmtiEnv *jvmti_;
+  int64_t profile_;
+  std::unordered_map<jmethodID, CachedMethod> methods_;
+
+  // Holds the symbols of the last method that could not be cached.
+  MethodInfo uncached_;
+
+  DISALLOW_COPY_AND_ASSIGN(MethodCache);
+};
+
+}  // namespace javaprofiler
+}  // namespace google
+
+#endif  // THIRD_PARTY_JAVAPROFILER_METHOD_CACHE_H_
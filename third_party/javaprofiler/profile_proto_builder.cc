@@ -12,6 +12,8 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <math.h>
+
 #include "third_party/javaprofiler/display.h"
 #include "third_party/javaprofiler/stacktrace_fixer.h"
 #include "third_party/javaprofiler/profile_proto_builder.h"
@@ -26,7 +28,7 @@ const int kMetric = 1;
 
 ProfileProtoBuilder::ProfileProtoBuilder(jvmtiEnv *jvmti_env,
                                          ProfileFrameCache *native_cache,
-                                         int64 sampling_rate,
+                                         int64_t sampling_rate,
                                          const SampleType &count_type,
                                          const SampleType &metric_type)
     : jvmti_env_(jvmti_env), native_cache_(native_cache),
@@ -46,7 +48,7 @@ void ProfileProtoBuilder::AddTraces(const ProfileStackTrace *traces,
 }
 
 void ProfileProtoBuilder::AddTraces(const ProfileStackTrace *traces,
-                                    const int32 *counts,
+                                    const int32_t *counts,
                                     int num_traces) {
   native_cache_->ProcessTraces(traces, num_traces);
 
@@ -107,24 +109,24 @@ void ProfileProtoBuilder::SetPeriodType(const SampleType &metric_type) {
 }
 
 void ProfileProtoBuilder::UpdateSampleValues(
-    perftools::profiles::Sample *sample, jint count, jint size) {
+    perftools::profiles::Sample *sample, int64_t count, int64_t size) {
   sample->set_value(kCount, sample->value(kCount) + count);
   sample->set_value(kMetric, sample->value(kMetric) + size);
 }
 
 void ProfileProtoBuilder::InitSampleValues(
-    perftools::profiles::Sample *sample, jint metric) {
+    perftools::profiles::Sample *sample, int64_t metric) {
   InitSampleValues(sample, 1, metric);
 }
 
 void ProfileProtoBuilder::InitSampleValues(
-    perftools::profiles::Sample *sample, jint count, jint metric) {
+    perftools::profiles::Sample *sample, int64_t count, int64_t metric) {
   sample->add_value(count);
   sample->add_value(metric);
 }
 
 void ProfileProtoBuilder::AddTrace(const ProfileStackTrace &trace,
-                                   int32 count) {
+                                   int32_t count) {
   auto sample = trace_samples_.SampleFor(*trace.trace);
 
   if (sample != nullptr) {
@@ -201,7 +203,7 @@ void ProfileProtoBuilder::AddNativeInfo(
   stack_state->NativeFrame(function_name);
 
   if (!stack_state->SkipFrame()) {
-    location->set_address(reinterpret_cast<uint64>(jvm_frame.method_id));
+    location->set_address(reinterpret_cast<uint64_t>(jvm_frame.method_id));
     sample->add_location_id(location->id());
   }
 }
@@ -211,8 +213,8 @@ size_t LocationBuilder::LocationInfoHash::operator()(
 
   unsigned int h = 1;
 
-  hash<string> hash_string;
-  hash<int> hash_int;
+  std::hash<string> hash_string;
+  std::hash<int> hash_int;
 
   h = 31U * h + hash_string(info.class_name);
   h = 31U * h + hash_string(info.function_name);
@@ -316,7 +318,8 @@ void TraceSamples::Add(const JVMPI_CallTrace &trace,
   traces_[trace] = sample;
 }
 
-double CalculateSamplingRatio(int64 rate, int64 count, int64 metric_value) {
+double CalculateSamplingRatio(int64_t rate, int64_t count,
+                              int64_t metric_value) {
   if (rate <= 1) {
     return 1.0;
   }
@@ -335,19 +338,25 @@ double CalculateSamplingRatio(int64 rate, int64 count, int64 metric_value) {
 }
 
 std::unique_ptr<ProfileProtoBuilder> ProfileProtoBuilder::ForHeap(
-    jvmtiEnv *jvmti_env, int64 sampling_rate, ProfileFrameCache *cache) {
+    jvmtiEnv *jvmti_env, int64_t sampling_rate, ProfileFrameCache *cache) {
   return std::unique_ptr<ProfileProtoBuilder>(new HeapProfileProtoBuilder(
       jvmti_env, sampling_rate, cache));
 }
 
+std::unique_ptr<ProfileProtoBuilder> ProfileProtoBuilder::ForHeapAlloc(
+    jvmtiEnv *jvmti_env, int64_t sampling_rate, ProfileFrameCache *cache) {
+  return std::unique_ptr<ProfileProtoBuilder>(new HeapAllocProfileProtoBuilder(
+      jvmti_env, sampling_rate, cache));
+}
+
 std::unique_ptr<ProfileProtoBuilder> ProfileProtoBuilder::ForCpu(
-    jvmtiEnv *jvmti_env, int64 sampling_rate, ProfileFrameCache *cache) {
+    jvmtiEnv *jvmti_env, int64_t sampling_rate, ProfileFrameCache *cache) {
   return std::unique_ptr<ProfileProtoBuilder>(
       new CpuProfileProtoBuilder(jvmti_env, sampling_rate, cache));
 }
 
 std::unique_ptr<ProfileProtoBuilder> ProfileProtoBuilder::ForContention(
-    jvmtiEnv *jvmti_env, int64 sampling_rate, ProfileFrameCache *cache) {
+    jvmtiEnv *jvmti_env, int64_t sampling_rate, ProfileFrameCache *cache) {
   return std::unique_ptr<ProfileProtoBuilder>(
       new ContentionProfileProtoBuilder(jvmti_env, sampling_rate, cache));
 }
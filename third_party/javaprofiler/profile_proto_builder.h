@@ -20,10 +20,11 @@
 #include <link.h>
 #include <memory>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "perftools/profiles/proto/builder.h"
-#include "third_party/java/jdk/include/jvmti.h"
+#include "third_party/javaprofiler/globals.h"
 #include "third_party/javaprofiler/stacktrace_decls.h"
 
 namespace google {
@@ -31,7 +32,7 @@ namespace javaprofiler {
 
 struct ProfileStackTrace {
   JVMPI_CallTrace *trace;
-  jint metric_value;
+  int64_t metric_value;
 };
 
 // Store proto sample objects for specific stack traces.
@@ -50,7 +51,7 @@ class TraceSamples {
                     const JVMPI_CallTrace &trace2) const;
   };
 
-  __gnu_cxx::hash_map<JVMPI_CallTrace, perftools::profiles::Sample *, TraceHash,
+  std::unordered_map<JVMPI_CallTrace, perftools::profiles::Sample *, TraceHash,
                       TraceEquals>
       traces_;
 };
@@ -88,7 +89,7 @@ class LocationBuilder {
 
   perftools::profiles::Builder *builder_;
 
-  __gnu_cxx::hash_map<LocationInfo, perftools::profiles::Location *,
+  std::unordered_map<LocationInfo, perftools::profiles::Location *,
                       LocationInfoHash, LocationInfoEquals>
       locations_;
 };
@@ -119,7 +120,7 @@ class ProfileProtoBuilder {
   // Add traces to the proto, where each trace has a defined count
   // of occurrences.
   void AddTraces(const ProfileStackTrace *traces,
-                 const int32 *counts,
+                 const int32_t *counts,
                  int num_traces);
 
   // Add a "fake" trace with a single frame. Used to represent JVM
@@ -131,13 +132,16 @@ class ProfileProtoBuilder {
   virtual std::unique_ptr<perftools::profiles::Profile> CreateProto() = 0;
 
   static std::unique_ptr<ProfileProtoBuilder> ForHeap(
-      jvmtiEnv *jvmti_env, int64 sampling_rate, ProfileFrameCache *cache);
+      jvmtiEnv *jvmti_env, int64_t sampling_rate, ProfileFrameCache *cache);
+
+  static std::unique_ptr<ProfileProtoBuilder> ForHeapAlloc(
+      jvmtiEnv *jvmti_env, int64_t sampling_rate, ProfileFrameCache *cache);
 
   static std::unique_ptr<ProfileProtoBuilder> ForCpu(
-      jvmtiEnv *jvmti_env, int64 sampling_rate, ProfileFrameCache *cache);
+      jvmtiEnv *jvmti_env, int64_t sampling_rate, ProfileFrameCache *cache);
 
   static std::unique_ptr<ProfileProtoBuilder> ForContention(
-      jvmtiEnv *jvmti_env, int64 sampling_rate, ProfileFrameCache *cache);
+      jvmtiEnv *jvmti_env, int64_t sampling_rate, ProfileFrameCache *cache);
 
  protected:
   struct SampleType {
@@ -150,7 +154,7 @@ class ProfileProtoBuilder {
 
   ProfileProtoBuilder(jvmtiEnv *jvmti_env,
                       ProfileFrameCache *native_cache,
-                      int64 sampling_rate,
+                      int64_t sampling_rate,
                       const SampleType &count_type,
                       const SampleType &metric_type);
 
@@ -207,12 +211,12 @@ class ProfileProtoBuilder {
 
   void AddSampleType(const SampleType &sample_type);
   void SetPeriodType(const SampleType &metric_type);
-  void InitSampleValues(perftools::profiles::Sample *sample, jint metric);
-  void InitSampleValues(perftools::profiles::Sample *sample, jint count,
-                        jint metric);
-  void UpdateSampleValues(perftools::profiles::Sample *sample, jint count,
-                          jint size);
-  void AddTrace(const ProfileStackTrace &trace, int32 count);
+  void InitSampleValues(perftools::profiles::Sample *sample, int64_t metric);
+  void InitSampleValues(perftools::profiles::Sample *sample, int64_t count,
+                        int64_t metric);
+  void UpdateSampleValues(perftools::profiles::Sample *sample, int64_t count,
+                          int64_t size);
+  void AddTrace(const ProfileStackTrace &trace, int32_t count);
   void AddJavaInfo(const google::javaprofiler::JVMPI_CallFrame &jvm_frame,
                    perftools::profiles::Profile *profile,
                    perftools::profiles::Sample *sample,
@@ -228,7 +232,7 @@ class ProfileProtoBuilder {
   ProfileFrameCache *native_cache_;
   TraceSamples trace_samples_;
   LocationBuilder location_builder_;
-  int64 sampling_rate_ = 0;
+  int64_t sampling_rate_ = 0;
 };
 
 // Computes the ratio to use to scale heap data to unsample it.
@@ -237,12 +241,13 @@ class ProfileProtoBuilder {
 // on a poisson process to determine which samples to collect, based
 // on the desired average collection rate R. The probability of a
 // sample of size S to appear in that profile is 1-exp(-S/R).
-double CalculateSamplingRatio(int64 rate, int64 count, int64 metric_value);
+double CalculateSamplingRatio(int64_t rate, int64_t count,
+                              int64_t metric_value);
 
 class CpuProfileProtoBuilder : public ProfileProtoBuilder {
  public:
   CpuProfileProtoBuilder(jvmtiEnv *jvmti_env,
-                         int64 sampling_rate,
+                         int64_t sampling_rate,
                          ProfileFrameCache *cache)
       : ProfileProtoBuilder(jvmti_env, cache, sampling_rate,
                             ProfileProtoBuilder::SampleType("samples", "count"),
@@ -262,13 +267,14 @@ class CpuProfileProtoBuilder : public ProfileProtoBuilder {
 class HeapProfileProtoBuilder : public ProfileProtoBuilder {
  public:
   HeapProfileProtoBuilder(jvmtiEnv *jvmti_env,
-                          int64 sampling_rate,
+                          int64_t sampling_rate,
                           ProfileFrameCache *cache)
       : ProfileProtoBuilder(jvmti_env, cache, sampling_rate,
                             ProfileProtoBuilder::SampleType("inuse_objects",
                                                             "count"),
                             ProfileProtoBuilder::SampleType("inuse_space",
                                                             "bytes")) {
+    builder_.mutable_profile()->set_period(sampling_rate);
   }
 
   std::unique_ptr<perftools::profiles::Profile> CreateProto() override {
@@ -276,6 +282,16 @@ class HeapProfileProtoBuilder : public ProfileProtoBuilder {
   }
 
  protected:
+  HeapProfileProtoBuilder(jvmtiEnv *jvmti_env,
+                          ProfileFrameCache *cache,
+                          int64_t sampling_rate,
+                          const SampleType &count_type,
+                          const SampleType &metric_type)
+      : ProfileProtoBuilder(jvmti_env, cache, sampling_rate, count_type,
+                            metric_type) {
+    builder_.mutable_profile()->set_period(sampling_rate);
+  }
+
   int SkipTopNativeFrames(const JVMPI_CallTrace &trace) override {
     for (int i = 0; i < trace.num_frames; ++i) {
       if (trace.frames[i].lineno !=
@@ -288,10 +304,25 @@ class HeapProfileProtoBuilder : public ProfileProtoBuilder {
   }
 };
 
+// Same as the heap profile, for all the sampled allocations rather than
+// only the live ones.
+class HeapAllocProfileProtoBuilder : public HeapProfileProtoBuilder {
+ public:
+  HeapAllocProfileProtoBuilder(jvmtiEnv *jvmti_env,
+                               int64_t sampling_rate,
+                               ProfileFrameCache *cache)
+      : HeapProfileProtoBuilder(jvmti_env, cache, sampling_rate,
+                                ProfileProtoBuilder::SampleType(
+                                    "alloc_objects", "count"),
+                                ProfileProtoBuilder::SampleType(
+                                    "alloc_space", "bytes")) {
+  }
+};
+
 class ContentionProfileProtoBuilder : public ProfileProtoBuilder {
  public:
   ContentionProfileProtoBuilder(jvmtiEnv *jvmti_env,
-                                int64 sampling_rate,
+                                int64_t sampling_rate,
                                 ProfileFrameCache *cache)
       : ProfileProtoBuilder(jvmti_env, cache, sampling_rate,
                             ProfileProtoBuilder::SampleType("contentions",
@@ -14,6 +14,13 @@
 
 #include "third_party/javaprofiler/stacktraces.h"
 
+#include <errno.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+
 namespace google {
 namespace javaprofiler {
 
@@ -25,25 +32,209 @@ std::mutex *AttributeTable::mutex_;
 std::unordered_map<string, int> *AttributeTable::string_map_;
 std::vector<string> *AttributeTable::strings_;
 
+namespace {
+
+// Size of the header at the start of each overflow segment, holding the
+// amount of the segment frame arena in use. Keeps the entries that
+// follow on their own cache lines.
+const size_t kOverflowHeaderBytes = 64;
+
+// Returns the non-zero tag identifying entries for traces with the
+// given hash. Uses the top bits, as the low bits pick the probe start.
+inline uint8_t HashTag(uint64_t hash_val) {
+  uint8_t tag = static_cast<uint8_t>(hash_val >> 56);
+  return tag != 0 ? tag : 1;
+}
+
+}  // namespace
+
+AsyncSafeTraceMultiset::AsyncSafeTraceMultiset(int64_t max_traces)
+    : overflow_state_(0),
+      arena_(0),
+      arena_pending_(false),
+      overflow_(nullptr),
+      overflow_size_(0),
+      max_overflow_segments_(0),
+      max_traces_((max_traces + 63) / 64 * 64),
+      primary_arena_frames_(max_traces_ * kAverageFramesPerTrace) {
+  location_words_ =
+      (max_traces_ + kOverflowSegmentEntries * kMaxOverflowSegments) / 64;
+  dirty_ = new std::atomic<uint64_t>[location_words_];
+  retired_ = new uint64_t[location_words_];
+  traces_ = new TraceData[max_traces_];
+  tags_ = new std::atomic<uint8_t>[max_traces_];
+  frame_arena_[0] = new JVMPI_CallFrame[primary_arena_frames_];
+  frame_arena_[1] = new JVMPI_CallFrame[primary_arena_frames_];
+
+  // Only the address space is reserved here. Pages are backed on first
+  // touch by Add() and given back by EndHarvest().
+  size_t size = kMaxOverflowSegments * OverflowSegmentBytes();
+  void *overflow = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (overflow == MAP_FAILED) {
+    LOG(WARNING) << "Failed to map trace overflow segments, errno " << errno;
+  } else {
+    overflow_ = static_cast<char *>(overflow);
+    overflow_size_ = size;
+    max_overflow_segments_ = kMaxOverflowSegments;
+  }
+  Reset();
+}
+
+AsyncSafeTraceMultiset::~AsyncSafeTraceMultiset() {
+  if (overflow_ != nullptr) {
+    munmap(overflow_, overflow_size_);
+  }
+  delete[] frame_arena_[1];
+  delete[] frame_arena_[0];
+  delete[] tags_;
+  delete[] traces_;
+  delete[] retired_;
+  delete[] dirty_;
+}
+
+void AsyncSafeTraceMultiset::Reset() {
+  // The frame arenas are not cleared, only frames below frames_used_
+  // are ever read.
+  memset(traces_, 0, max_traces_ * sizeof(traces_[0]));
+  memset(tags_, 0, max_traces_ * sizeof(tags_[0]));
+  for (int64_t i = 0; i < location_words_; i++) {
+    dirty_[i] = 0;
+    retired_[i] = 0;
+  }
+  frames_used_[0] = 0;
+  frames_used_[1] = 0;
+  arena_ = 0;
+  arena_pending_ = false;
+  if (overflow_ != nullptr) {
+    madvise(overflow_, overflow_size_, MADV_DONTNEED);
+  }
+  overflow_state_ = 0;
+  epoch_ = 0;
+  active_insertions_[0] = 0;
+  active_insertions_[1] = 0;
+}
+
+size_t AsyncSafeTraceMultiset::OverflowSegmentBytes() {
+  return kOverflowHeaderBytes +
+         kOverflowSegmentEntries *
+             (sizeof(TraceData) + sizeof(std::atomic<uint8_t>) +
+              kAverageFramesPerTrace * sizeof(JVMPI_CallFrame));
+}
+
+AsyncSafeTraceMultiset::TraceTable AsyncSafeTraceMultiset::PrimaryTable() {
+  int arena = arena_.load(std::memory_order_acquire);
+  return TraceTable{0, traces_, tags_, max_traces_, frame_arena_[arena],
+                    &frames_used_[arena], primary_arena_frames_};
+}
+
+AsyncSafeTraceMultiset::TraceTable AsyncSafeTraceMultiset::OverflowTable(
+    int64_t segment) {
+  char *base = overflow_ + segment * OverflowSegmentBytes();
+  std::atomic<int64_t> *frames_used =
+      reinterpret_cast<std::atomic<int64_t> *>(base);
+  TraceData *traces =
+      reinterpret_cast<TraceData *>(base + kOverflowHeaderBytes);
+  JVMPI_CallFrame *frames =
+      reinterpret_cast<JVMPI_CallFrame *>(traces + kOverflowSegmentEntries);
+  std::atomic<uint8_t> *tags = reinterpret_cast<std::atomic<uint8_t> *>(
+      frames + kOverflowSegmentEntries * kAverageFramesPerTrace);
+  return TraceTable{max_traces_ + segment * kOverflowSegmentEntries,
+                    traces,
+                    tags,
+                    kOverflowSegmentEntries,
+                    frames,
+                    frames_used,
+                    kOverflowSegmentEntries * kAverageFramesPerTrace};
+}
+
+AsyncSafeTraceMultiset::TraceTable AsyncSafeTraceMultiset::TableFor(
+    int64_t location, int64_t *index) {
+  if (location < max_traces_) {
+    *index = location;
+    return PrimaryTable();
+  }
+  int64_t offset = location - max_traces_;
+  *index = offset % kOverflowSegmentEntries;
+  return OverflowTable(offset / kOverflowSegmentEntries);
+}
+
+void AsyncSafeTraceMultiset::MarkDirty(int64_t location) {
+  std::atomic<uint64_t> &word = dirty_[location / 64];
+  uint64_t bit = uint64_t(1) << (location % 64);
+  // Avoid writing to the shared word when the bit is already set.
+  if ((word.load() & bit) == 0) {
+    word.fetch_or(bit);
+  }
+}
+
+uint64_t AsyncSafeTraceMultiset::TakeDirtyLocations(int64_t first) {
+  std::atomic<uint64_t> &word = dirty_[first / 64];
+  return word.load() != 0 ? word.exchange(0) : 0;
+}
+
+JVMPI_CallFrame *AsyncSafeTraceMultiset::AllocateFrames(
+    const TraceTable &table, int num_frames) {
+  int64_t used = table.frames_used->load(std::memory_order_relaxed);
+  do {
+    if (used + num_frames > table.frames_size) {
+      return nullptr;
+    }
+  } while (!table.frames_used->compare_exchange_weak(
+      used, used + num_frames, std::memory_order_relaxed));
+  return &table.frames[used];
+}
+
 bool AsyncSafeTraceMultiset::Add(int attr, JVMPI_CallTrace *trace) {
   uint64_t hash_val = CalculateHash(attr, trace->num_frames, &trace->frames[0]);
 
-  active_insertions_.fetch_add(1, std::memory_order_acquire);
-  for (int64_t i = 0; i < MaxEntries(); i++) {
-    int64_t idx = (i + hash_val) % MaxEntries();
-    auto &entry = traces_[idx];
+  // The insertion stays active in its epoch until it no longer touches
+  // the set, so that the harvester can wait for the readers of retired
+  // entries and the writers to the storage it is about to reclaim. If
+  // the epoch advanced before the insertion was counted, the harvester
+  // may not have seen it, so count it again in the new epoch.
+  int64_t epoch = epoch_.load();
+  active_insertions_[epoch & 1].fetch_add(1);
+  for (int64_t current = epoch_.load(); current != epoch;
+       current = epoch_.load()) {
+    active_insertions_[epoch & 1].fetch_add(-1);
+    epoch = current;
+    active_insertions_[epoch & 1].fetch_add(1);
+  }
+  bool added = AddToTable(PrimaryTable(), hash_val, attr, trace) ||
+               AddToOverflow(hash_val, attr, trace);
+  // We still need storage ordering between this store and preceding
+  // loads, even if we did nothing.
+  active_insertions_[epoch & 1].fetch_add(-1, std::memory_order_release);
+  return added;
+}
+
+bool AsyncSafeTraceMultiset::AddToTable(const TraceTable &table,
+                                        uint64_t hash_val, int attr,
+                                        JVMPI_CallTrace *trace) {
+  uint8_t tag = HashTag(hash_val);
+  for (int64_t i = 0; i < table.size; i++) {
+    int64_t idx = (i + hash_val) % table.size;
+    uint8_t entry_tag = table.tags[idx].load(std::memory_order_relaxed);
+    if (entry_tag != 0 && entry_tag != tag) {
+      // Holds a different trace, no need to look at the entry.
+      continue;
+    }
+    auto &entry = table.traces[idx];
     int64_t count_zero = 0;
     int64_t count = entry.count.load(std::memory_order_acquire);
     switch (count) {
       case 0:
         if (entry.count.compare_exchange_weak(count_zero, kTraceCountLocked,
                                               std::memory_order_relaxed)) {
-          // This entry is reserved, there is no danger of interacting
-          // with Extract, so decrement active_insertions early.
-          active_insertions_.fetch_add(-1, std::memory_order_release);
-          // memcpy is not async safe
-          JVMPI_CallFrame *fb = frame_buffer_[idx];
           int num_frames = trace->num_frames;
+          JVMPI_CallFrame *fb = AllocateFrames(table, num_frames);
+          if (fb == nullptr) {
+            // The arena is full, no other trace fits in this table.
+            entry.count.store(0, std::memory_order_release);
+            return false;
+          }
+          // memcpy is not async safe
           for (int frame_num = 0; frame_num < num_frames; ++frame_num) {
             fb[frame_num].lineno = trace->frames[frame_num].lineno;
             fb[frame_num].method_id = trace->frames[frame_num].method_id;
@@ -51,7 +242,12 @@ bool AsyncSafeTraceMultiset::Add(int attr, JVMPI_CallTrace *trace) {
           entry.trace.frames = fb;
           entry.trace.num_frames = num_frames;
           entry.attr = attr;
+          entry.hash = hash_val;
+          table.tags[idx].store(tag, std::memory_order_relaxed);
           entry.count.store(int64_t(1), std::memory_order_release);
+          // Marked once published, so that a harvest that misses the new
+          // entry sees it marked on the next round.
+          MarkDirty(table.location + idx);
           return true;
         }
         break;
@@ -59,35 +255,63 @@ bool AsyncSafeTraceMultiset::Add(int attr, JVMPI_CallTrace *trace) {
         // This entry is being updated by another thread. Move on.
         // Worst case we may end with multiple entries with the same trace.
         break;
+      case kTraceCountRetired:
+        // This entry has been extracted and is waiting to be freed.
+        break;
       default:
-        if (attr == entry.attr && trace->num_frames == entry.trace.num_frames &&
+        if (hash_val == entry.hash && attr == entry.attr &&
+            trace->num_frames == entry.trace.num_frames &&
             Equal(trace->num_frames, entry.trace.frames, trace->frames)) {
           // Bump using a compare-swap instead of fetch_add to ensure
-          // it hasn't been locked by a thread doing Extract().
-          // Reload count in case it was updated while we were
-          // examining the trace.
+          // it hasn't been locked or retired by a thread doing
+          // Extract(). Reload count in case it was updated while we
+          // were examining the trace.
+          // Marked before bumping, so that a harvest clearing the mark
+          // still extracts the entry before its frames are reclaimed.
+          MarkDirty(table.location + idx);
           count = entry.count.load(std::memory_order_relaxed);
-          if (count != kTraceCountLocked &&
+          if (count > 0 &&
               entry.count.compare_exchange_weak(count, count + 1,
                                                 std::memory_order_relaxed)) {
-            active_insertions_.fetch_add(-1, std::memory_order_release);
             return true;
           }
         }
     }
   }
-  // Did nothing, but we still need storage ordering between this
-  // store and preceding loads.
-  active_insertions_.fetch_add(-1, std::memory_order_release);
+  return false;
+}
+
+bool AsyncSafeTraceMultiset::AddToOverflow(uint64_t hash_val, int attr,
+                                           JVMPI_CallTrace *trace) {
+  int64_t state = overflow_state_.load();
+  int64_t segment = 0;
+  while ((state & kOverflowSealed) == 0) {
+    for (; segment < state; segment++) {
+      if (AddToTable(OverflowTable(segment), hash_val, attr, trace)) {
+        return true;
+      }
+    }
+    if (state >= max_overflow_segments_) {
+      return false;
+    }
+    // All segments in use are full, claim the next one. On failure
+    // another thread claimed it or the segments got sealed, so retry
+    // with the updated state.
+    if (overflow_state_.compare_exchange_weak(state, state + 1)) {
+      state++;
+    }
+  }
   return false;
 }
 
 int AsyncSafeTraceMultiset::Extract(int location, int64_t *attr, int max_frames,
                                     JVMPI_CallFrame *frames, int64_t *count) {
-  if (location < 0 || location >= MaxEntries()) {
+  if (location < 0 || location >= ActiveEntries()) {
     return 0;
   }
-  auto &entry = traces_[location];
+  int64_t idx;
+  TraceTable table = TableFor(location, &idx);
+  auto &entry = table.traces[idx];
   int64_t c = entry.count.load(std::memory_order_acquire);
   if (c <= 0) {
     // Unused or in process of being updated, skip for now.
@@ -101,77 +325,321 @@ int AsyncSafeTraceMultiset::Extract(int location, int64_t *attr, int max_frames,
   c = entry.count.exchange(kTraceCountLocked, std::memory_order_acquire);
 
   *attr = entry.attr;
-  bool all_quiet = false;
   for (int i = 0; i < num_frames; ++i) {
     frames[i].lineno = entry.trace.frames[i].lineno;
     frames[i].method_id = entry.trace.frames[i].method_id;
-    if (all_quiet == false &&
-        active_insertions_.load(std::memory_order_acquire) == 0) {
-      all_quiet = true;
+  }
+
+  // Calls to Add() in progress may still be comparing against this
+  // entry, so it cannot be reused until they complete. Retiring it
+  // keeps them from bumping it, as they only bump positive counts.
+  table.tags[idx].store(0, std::memory_order_relaxed);
+  entry.count.store(kTraceCountRetired, std::memory_order_release);
+  retired_[location / 64] |= uint64_t(1) << (location % 64);
+  *count = c;
+  return num_frames;
+}
+
+bool AsyncSafeTraceMultiset::WaitForInsertions(int parity, int max_spins) {
+  for (int i = 0; active_insertions_[parity].load() != 0; i++) {
+    if (i >= max_spins) {
+      return false;
+    }
+    if (i % kSpinsPerYield == kSpinsPerYield - 1) {
+      // The Add() may be on a preempted thread, as when there are more
+      // threads than cores, and only complete once this one yields.
+      sched_yield();
+    }
+  }
+  return true;
+}
+
+bool AsyncSafeTraceMultiset::AdvanceEpoch(int max_spins) {
+  int64_t epoch = epoch_.load();
+  // Calls to Add() from the epoch before the current one share their
+  // counter with the next epoch, and must complete before advancing.
+  if (!WaitForInsertions((epoch + 1) & 1, max_spins)) {
+    return false;
+  }
+  epoch_.store(epoch + 1);
+  return WaitForInsertions(epoch & 1, max_spins);
+}
+
+void AsyncSafeTraceMultiset::FreeRetired() {
+  for (int64_t word = 0; word < location_words_; word++) {
+    for (uint64_t retired = retired_[word]; retired != 0;
+         retired &= retired - 1) {
+      int64_t idx;
+      TraceTable table = TableFor(word * 64 + __builtin_ctzll(retired), &idx);
+      table.traces[idx].count.store(0, std::memory_order_release);
     }
+    retired_[word] = 0;
+  }
+}
+
+void AsyncSafeTraceMultiset::ReleaseRetiredEntries() {
+  if (AdvanceEpoch(kMaxReleaseSpins)) {
+    FreeRetired();
+  }
+}
+
+bool AsyncSafeTraceMultiset::BeginHarvest() {
+  // If the previous harvest could not reclaim the other arena, keep
+  // using the current one until it does.
+  if (!arena_pending_) {
+    arena_.store(1 - arena_.load(std::memory_order_relaxed));
+    arena_pending_ = true;
+  }
+  overflow_state_.fetch_or(kOverflowSealed);
+
+  // Any Add() counted in the next epoch sees the new arena and the seal,
+  // so once the insertions from earlier epochs complete the storage
+  // being reclaimed is no longer written to, and the retired entries
+  // are no longer read.
+  if (!AdvanceEpoch(kMaxQuiescenceSpins)) {
+    overflow_state_.fetch_and(~kOverflowSealed);
+    return false;
+  }
+  FreeRetired();
+  return true;
+}
+
+void AsyncSafeTraceMultiset::EndHarvest() {
+  frames_used_[1 - arena_.load(std::memory_order_relaxed)].store(
+      0, std::memory_order_relaxed);
+  arena_pending_ = false;
+
+  int64_t segments = overflow_state_.load() & ~kOverflowSealed;
+  // The discarded pages read back as zeroes, that is as unused entries
+  // and empty frame arenas, so the retired overflow entries are freed.
+  madvise(overflow_, segments * OverflowSegmentBytes(), MADV_DONTNEED);
+  for (int64_t word = max_traces_ / 64; word < location_words_; word++) {
+    retired_[word] = 0;
   }
+  overflow_state_.store(0, std::memory_order_release);
+}
+
+namespace {
+
+// Marks a free slot in the indexes of TraceMultiset.
+const int64_t kEmptySlot = -1;
 
-  if (!all_quiet) {
-    while (active_insertions_.load(std::memory_order_acquire) != 0) {
-      // spin
-      // TODO: Introduce a limit to detect and break
-      // deadlock
+// Initial number of slots of the indexes of TraceMultiset.
+const size_t kMinIndexSlots = 64;
+
+// Odd constants used to mix the leaf node and attribute of traces.
+const uint64_t kNodeHashMultiplier = 0xd6e8feb86659fd93ULL;
+const uint64_t kAttrHashMultiplier = 0x9e3779b97f4a7c15ULL;
+
+// Rebuilds an open-addressed index of records, each with a hash, with
+// twice as many slots.
+template <typename Record>
+void GrowIndex(const std::vector<Record> &records,
+               std::vector<int64_t> *index) {
+  std::vector<int64_t> grown(std::max(index->size() * 2, kMinIndexSlots),
+                             kEmptySlot);
+  size_t mask = grown.size() - 1;
+  for (size_t i = 0; i < records.size(); i++) {
+    size_t slot = records[i].hash & mask;
+    while (grown[slot] != kEmptySlot) {
+      slot = (slot + 1) & mask;
     }
+    grown[slot] = i;
   }
+  index->swap(grown);
+}
 
-  entry.count.store(0, std::memory_order_release);
-  *count = c;
-  return num_frames;
+}  // namespace
+
+int64_t TraceMultiset::InternNode(int64_t parent,
+                                  const JVMPI_CallFrame &frame) {
+  uint64_t hash = CalculateHash(parent, 1, &frame);
+  if ((nodes_.size() + 1) * 2 > node_index_.size()) {
+    GrowIndex(nodes_, &node_index_);
+  }
+  size_t mask = node_index_.size() - 1;
+  for (size_t slot = hash & mask;; slot = (slot + 1) & mask) {
+    int64_t id = node_index_[slot];
+    if (id == kEmptySlot) {
+      id = nodes_.size();
+      node_index_[slot] = id;
+      int depth = parent == kNoNode ? 1 : nodes_[parent].depth + 1;
+      nodes_.push_back(Node{hash, parent, depth, frame});
+      return id;
+    }
+    const Node &node = nodes_[id];
+    if (node.hash == hash && node.parent == parent &&
+        Equal(1, &node.frame, &frame)) {
+      return id;
+    }
+  }
 }
 
-void TraceMultiset::Add(int64_t attr, int num_frames, JVMPI_CallFrame *frames,
-                        int64_t count) {
-  CallTrace t;
-  t.attr = attr;
-  t.frames = std::vector<JVMPI_CallFrame>(frames, frames + num_frames);
+bool TraceMultiset::NodeMatches(int64_t node, int num_frames,
+                                const JVMPI_CallFrame *frames) const {
+  // The hash of the sequence has already matched, so this is only a
+  // walk up the tree on a match, or on a collision which must not merge
+  // two different traces.
+  if (nodes_[node].depth != num_frames) {
+    return false;
+  }
+  for (int i = 0; i < num_frames; i++) {
+    const Node &current = nodes_[node];
+    if (current.frame.method_id != frames[i].method_id ||
+        current.frame.lineno != frames[i].lineno) {
+      return false;
+    }
+    node = current.parent;
+  }
+  return true;
+}
+
+int64_t TraceMultiset::InternSequence(int num_frames,
+                                      const JVMPI_CallFrame *frames) {
+  if (num_frames == 0) {
+    return kNoNode;
+  }
+  uint64_t hash = CalculateHash(0, num_frames, frames);
+  if ((sequences_.size() + 1) * 2 > sequence_index_.size()) {
+    GrowIndex(sequences_, &sequence_index_);
+  }
+  size_t mask = sequence_index_.size() - 1;
+  for (size_t slot = hash & mask;; slot = (slot + 1) & mask) {
+    int64_t id = sequence_index_[slot];
+    if (id == kEmptySlot) {
+      // New sequence, walk down the tree from the outermost frame.
+      int64_t node = kNoNode;
+      for (int i = num_frames - 1; i >= 0; i--) {
+        node = InternNode(node, frames[i]);
+      }
+      sequence_index_[slot] = sequences_.size();
+      sequences_.push_back(Sequence{hash, node});
+      return node;
+    }
+    const Sequence &sequence = sequences_[id];
+    if (sequence.hash == hash &&
+        NodeMatches(sequence.node, num_frames, frames)) {
+      return sequence.node;
+    }
+  }
+}
 
-  auto entry = traces_.find(t);
-  if (entry != traces_.end()) {
-    entry->second += count;
-    return;
+void TraceMultiset::Add(int64_t attr, int num_frames,
+                        const JVMPI_CallFrame *frames, int64_t count) {
+  int64_t node = InternSequence(num_frames, frames);
+  uint64_t hash = static_cast<uint64_t>(node) * kNodeHashMultiplier +
+                  static_cast<uint64_t>(attr) * kAttrHashMultiplier;
+  if ((traces_.size() + 1) * 2 > trace_index_.size()) {
+    GrowIndex(traces_, &trace_index_);
+  }
+  size_t mask = trace_index_.size() - 1;
+  for (size_t slot = hash & mask;; slot = (slot + 1) & mask) {
+    int64_t id = trace_index_[slot];
+    if (id == kEmptySlot) {
+      trace_index_[slot] = traces_.size();
+      traces_.push_back(Entry{hash, attr, node, static_cast<uint64_t>(count)});
+      return;
+    }
+    Entry &entry = traces_[id];
+    if (entry.node == node && entry.attr == attr) {
+      entry.count += count;
+      return;
+    }
   }
-  traces_.emplace(std::move(t), count);
+}
+
+TraceMultiset::Trace TraceMultiset::TraceAt(size_t index) const {
+  const Entry &entry = traces_[index];
+  int num_frames = entry.node == kNoNode ? 0 : nodes_[entry.node].depth;
+  return Trace{entry.attr, num_frames, entry.node, entry.count};
+}
+
+void TraceMultiset::Clear() {
+  std::vector<Node>().swap(nodes_);
+  std::vector<Sequence>().swap(sequences_);
+  std::vector<Entry>().swap(traces_);
+  std::vector<int64_t>().swap(node_index_);
+  std::vector<int64_t>().swap(sequence_index_);
+  std::vector<int64_t>().swap(trace_index_);
 }
 
 int HarvestSamples(AsyncSafeTraceMultiset *from, TraceMultiset *to) {
+  bool reclaim = from->BeginHarvest();
   int trace_count = 0;
-  int64_t num_traces = from->MaxEntries();
-  for (int64_t i = 0; i < num_traces; i++) {
-    JVMPI_CallFrame frame[kMaxFramesToCapture];
-    int64_t attr, count;
+  int64_t num_traces = from->ActiveEntries();
+  for (int64_t first = 0; first < num_traces; first += 64) {
+    uint64_t dirty = from->TakeDirtyLocations(first);
+    while (dirty != 0) {
+      int64_t i = first + __builtin_ctzll(dirty);
+      dirty &= dirty - 1;
+
+      JVMPI_CallFrame frame[kMaxFramesToCapture];
+      int64_t attr, count;
 
-    int num_frames =
-        from->Extract(i, &attr, kMaxFramesToCapture, &frame[0], &count);
-    if (num_frames > 0 && count > 0) {
-      ++trace_count;
-      to->Add(attr, num_frames, &frame[0], count);
+      int num_frames =
+          from->Extract(i, &attr, kMaxFramesToCapture, &frame[0], &count);
+      if (num_frames > 0 && count > 0) {
+        ++trace_count;
+        to->Add(attr, num_frames, &frame[0], count);
+      }
     }
   }
+  if (reclaim) {
+    from->EndHarvest();
+  }
+  from->ReleaseRetiredEntries();
   return trace_count;
 }
 
+namespace {
+
+// Odd constants with well distributed bits, used to seed and mix the
+// hash lanes.
+const uint64_t kHashSeed = 0xa0761d6478bd642fULL;
+const uint64_t kHashMultiplier = 0xe7037ed1a0b428dbULL;
+const uint64_t kHashLane = 0x8ebc6af09c88c6e3ULL;
+
+// Multiplies the two values and folds the high half of the product
+// into the low half.
+inline uint64_t HashMix(uint64_t a, uint64_t b) {
+#ifdef __SIZEOF_INT128__
+  __uint128_t product = static_cast<__uint128_t>(a) * b;
+  return static_cast<uint64_t>(product) ^
+         static_cast<uint64_t>(product >> 64);
+#else
+  uint64_t product = a * (b | 1);
+  return product ^ (product >> 29);
+#endif
+}
+
+// Packs a frame into a single word. Line numbers are BCIs, which fit in
+// the top 16 bits left unused by user-space jmethodID pointers.
+inline uint64_t HashFrame(const JVMPI_CallFrame &frame) {
+  uint64_t lineno = static_cast<uint32_t>(frame.lineno);
+  return reinterpret_cast<uintptr_t>(frame.method_id) ^
+         (lineno << 48 | lineno >> 16);
+}
+
+}  // namespace
+
 uint64_t CalculateHash(int64_t attr, int num_frames,
                        const JVMPI_CallFrame *frame) {
-  // Make hash-value
-  uint64_t h = attr;
-  h += h << 10;
-  h ^= h >> 6;
-  for (int i = 0; i < num_frames; i++) {
-    h += reinterpret_cast<uintptr_t>(frame[i].method_id);
-    h += h << 10;
-    h ^= h >> 6;
-    h += static_cast<uintptr_t>(frame[i].lineno);
-    h += h << 10;
-    h ^= h >> 6;
-  }
-  h += h << 3;
-  h ^= h >> 11;
-  return h;
+  // Absorbs two frames per multiplication in each of two independent
+  // lanes, so that consecutive multiplications can overlap. This only
+  // uses integer arithmetic, and is safe to call from a signal handler.
+  uint64_t a = static_cast<uint64_t>(attr) ^ kHashSeed;
+  uint64_t b = static_cast<uint64_t>(num_frames) ^ kHashLane;
+  int i = 0;
+  for (; i + 4 <= num_frames; i += 4) {
+    a = HashMix(a ^ HashFrame(frame[i]), HashFrame(frame[i + 1]) ^
+                                             kHashMultiplier);
+    b = HashMix(b ^ HashFrame(frame[i + 2]), HashFrame(frame[i + 3]) ^
+                                                 kHashLane);
+  }
+  for (; i < num_frames; i++) {
+    a = HashMix(a ^ HashFrame(frame[i]), kHashMultiplier);
+  }
+  return HashMix(a ^ kHashSeed, b ^ kHashMultiplier);
 }
 
 bool Equal(int num_frames, const JVMPI_CallFrame *f1,
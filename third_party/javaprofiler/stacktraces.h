@@ -110,20 +110,42 @@ class AttributeTable {
 // The synchronization is implemented by using a sentinel count value
 // to reserve entries. Add() will reserve the first available entry,
 // save the stack frame, and then release the entry for other calls to
-// Add() or Extract(). Extract() will reserve the entry, wait until no
-// additions are in progress, and then release the entry to be reused
-// by a subsequent call to Add(). It is important for Extract() to
-// wait until no additions are in progress to avoid releasing the
-// entry while another thread is inspecting it.
+// Add() or Extract(). Extract() will reserve the entry, copy the trace,
+// and then retire the entry. Retired entries are only released to be
+// reused by a subsequent call to Add() once the additions that were in
+// progress have completed, to avoid releasing the entry while another
+// thread is inspecting it.
+//
+// Traces are stored in a primary table, of kDefaultMaxStackTraces
+// entries unless a different capacity is given to the constructor. To
+// absorb bursts of distinct traces between harvests, Add() falls back
+// to a chain of overflow segments when the primary table is full. The
+// segments are mmapped up front without reserving backing memory, and
+// are claimed by Add() with a compare-and-swap on the number of
+// segments in use.
+//
+// The frames of each trace are stored with their actual length in a
+// bump-pointer arena owned by the table holding the trace. The primary
+// table alternates between two arenas: BeginHarvest() switches Add()
+// over to the other arena, and once every trace referencing the old
+// one has been extracted, EndHarvest() rewinds it. Overflow segments
+// have their own arena, released along with the segment by
+// EndHarvest(), so the steady-state footprint is that of the primary
+// table.
 class AsyncSafeTraceMultiset {
  public:
-  AsyncSafeTraceMultiset() { Reset(); }
+  // TODO: Re-evaluate MaxStackTraces, to minimize storage
+  // consumption while maintaining good performance and avoiding
+  // overflow.
+  static const int64_t kDefaultMaxStackTraces = 4096;
 
-  void Reset() {
-    memset(traces_, 0, sizeof(traces_));
-    memset(frame_buffer_, 0, sizeof(frame_buffer_));
-    active_insertions_ = 0;
-  }
+  // Creates a set whose primary table holds max_traces entries, rounded
+  // up to a multiple of 64.
+  explicit AsyncSafeTraceMultiset(
+      int64_t max_traces = kDefaultMaxStackTraces);
+  ~AsyncSafeTraceMultiset();
+
+  void Reset();
 
   // Add a trace to the set. If it is already present, increment its
   // count. This operation is thread safe and async safe.
@@ -134,39 +156,187 @@ class AsyncSafeTraceMultiset {
   // written starting at frames[0], up to max_frames. returns 0 if
   // there is no valid trace at this location.  This operation is
   // thread safe with respect to Add() but only a single call to
-  // Extract can be done at a time.
+  // Extract can be done at a time. It does not wait for Add(): the
+  // location is retired, and only reused after ReleaseRetiredEntries()
+  // or BeginHarvest() find that no Add() that may still be reading it
+  // is in progress.
   int Extract(int location, int64_t *attr, int max_frames,
               JVMPI_CallFrame *frames, int64_t *count);
 
-  int64_t MaxEntries() const { return kMaxStackTraces; }
+  int64_t MaxEntries() const {
+    return max_traces_ + kOverflowSegmentEntries * max_overflow_segments_;
+  }
+
+  // Returns the number of locations that may currently hold a trace,
+  // covering the primary table and the overflow segments in use.
+  // Locations at or beyond this value are empty.
+  int64_t ActiveEntries() const {
+    int64_t segments = overflow_state_.load(std::memory_order_acquire) &
+                       ~kOverflowSealed;
+    return max_traces_ + kOverflowSegmentEntries * segments;
+  }
+
+  // Returns a mask of the locations in [first, first + 64) whose trace
+  // was added or updated since the previous call covering them, and
+  // clears it. first must be a multiple of 64. Only the locations in the
+  // mask need to be passed to Extract(); traces being added concurrently
+  // are reported by a later call. Must be called from the thread calling
+  // Extract().
+  uint64_t TakeDirtyLocations(int64_t first);
+
+  // Prepares for extracting all the traces in the set. Switches Add()
+  // to the other primary arena, prevents it from using the overflow
+  // segments, and waits for any Add() in progress to complete. If this
+  // returns true, all dirty locations up to ActiveEntries() must be
+  // drained with Extract() and then EndHarvest() must be called.
+  // Returns false if the set did not quiesce, in which case the storage
+  // stays in use and will be reclaimed by a later harvest. Must be
+  // called from the thread calling Extract().
+  bool BeginHarvest();
+
+  // Makes the locations retired by Extract() available to Add() again if
+  // every Add() that started before them has completed. Waits a bounded
+  // time for that, and otherwise leaves them to a later call. Must be
+  // called from the thread calling Extract().
+  void ReleaseRetiredEntries();
+
+  // Reclaims the storage drained since a successful BeginHarvest():
+  // rewinds the previous primary arena and releases the memory of the
+  // overflow segments, making them available to Add() again.
+  void EndHarvest();
 
  private:
   struct TraceData {
+    // Result of CalculateHash() for the trace, compared before the
+    // frames when looking for a matching entry.
+    uint64_t hash;
     // attr is an integer attribute for the stack trace. On encode
     // this will represent a sample label.
     int attr;
     // trace is a triple containing the JNIEnv and the individual call frames.
-    // The frames are stored in AsyncSafeTraceMultiset::frame_buffer_
+    // The frames are stored in the frame arena of the table holding the
+    // entry.
     JVMPI_CallTrace trace;
     // Number of times a trace has been encountered.
     // 0 indicates that the trace is unused
-    // <0 values are reserved, used for concurrency control.
+    // <0 values are reserved, used for concurrency control and for
+    // entries retired by Extract().
     std::atomic<int64_t> count;
   };
 
-  // TODO: Re-evaluate MaxStackTraces, to minimize storage
-  // consumption while maintaining good performance and avoiding
-  // overflow.
-  static const int kMaxStackTraces = 2048;
+  // An open-addressed table of traces, along with the arena its frames
+  // are allocated from. The primary table is embedded in the multiset;
+  // overflow tables point into the mmapped segments.
+  //
+  // Each entry has a one-byte tag derived from the hash of its trace,
+  // stored apart from the entries so that probing can skip entries
+  // holding other traces while scanning a compact array. The tag is 0
+  // while the entry is unused or being updated.
+  struct TraceTable {
+    // Location of the first entry of the table, as seen by Extract().
+    int64_t location;
+    TraceData *traces;
+    std::atomic<uint8_t> *tags;
+    int64_t size;
+    JVMPI_CallFrame *frames;
+    std::atomic<int64_t> *frames_used;
+    int64_t frames_size;
+  };
+
+  bool AddToTable(const TraceTable &table, uint64_t hash_val, int attr,
+                  JVMPI_CallTrace *trace);
+  bool AddToOverflow(uint64_t hash_val, int attr, JVMPI_CallTrace *trace);
+  static JVMPI_CallFrame *AllocateFrames(const TraceTable &table,
+                                         int num_frames);
+  TraceTable PrimaryTable();
+  TraceTable OverflowTable(int64_t segment);
+  TraceTable TableFor(int64_t location, int64_t *index);
+  static size_t OverflowSegmentBytes();
+  void MarkDirty(int64_t location);
+  bool WaitForInsertions(int parity, int max_spins);
+  bool AdvanceEpoch(int max_spins);
+  void FreeRetired();
+
+  // Expected average number of frames per trace, used to size the frame
+  // arenas. Deeper traces are fine as long as the average holds.
+  static const int64_t kAverageFramesPerTrace = 32;
+
+  // Number of entries held by each overflow segment.
+  static const int64_t kOverflowSegmentEntries = 512;
+
+  // Maximum number of overflow segments that can be chained.
+  static const int64_t kMaxOverflowSegments = 8;
+
+  // Bit set in overflow_state_ while the overflow segments are being
+  // drained, preventing Add() from using them.
+  static const int64_t kOverflowSealed = int64_t(1) << 32;
+
+  // Maximum number of iterations BeginHarvest() waits for Add() calls
+  // in progress to complete before giving up.
+  static const int kMaxQuiescenceSpins = 1 << 20;
+
+  // Maximum number of iterations ReleaseRetiredEntries() waits for Add()
+  // calls in progress to complete before giving up.
+  static const int kMaxReleaseSpins = 1 << 10;
+
+  // Number of iterations after which the harvester yields while waiting
+  // for Add() calls in progress to complete.
+  static const int kSpinsPerYield = 256;
 
   // Sentinel to use as trace count while the frames are being updated.
   static const int64_t kTraceCountLocked = -1;
 
-  // Number of calls to Add() currently in progress.
-  std::atomic<int> active_insertions_;
-
-  TraceData traces_[kMaxStackTraces];
-  JVMPI_CallFrame frame_buffer_[kMaxStackTraces][kMaxFramesToCapture];
+  // Trace count of an entry drained by Extract() that Add() may still be
+  // reading. It is not matched or reused until freed by FreeRetired().
+  static const int64_t kTraceCountRetired = -2;
+
+  // Incremented by the harvester to tell apart the calls to Add() that
+  // started before a point from those that started after it.
+  std::atomic<int64_t> epoch_;
+
+  // Number of calls to Add() currently in progress, indexed by the
+  // parity of the epoch they started in.
+  std::atomic<int> active_insertions_[2];
+
+  // Number of overflow segments claimed by Add(), possibly combined
+  // with kOverflowSealed.
+  std::atomic<int64_t> overflow_state_;
+
+  // Index of the primary arena Add() allocates frames from.
+  std::atomic<int> arena_;
+
+  // Whether the primary arena not in use still holds frames that must
+  // be extracted before it can be rewound.
+  bool arena_pending_;
+
+  // Base address and size of the mapping holding the overflow segments,
+  // which is nullptr if it could not be mapped.
+  char *overflow_;
+  size_t overflow_size_;
+  int64_t max_overflow_segments_;
+
+  // One bit per location, set by Add() when the count of its trace
+  // changes and cleared by TakeDirtyLocations(), so harvesting only
+  // visits the locations in use.
+  std::atomic<uint64_t> *dirty_;
+
+  // One bit per location retired by Extract() and not yet freed. Only
+  // used by the harvester thread.
+  uint64_t *retired_;
+
+  // Number of words in dirty_ and retired_, covering the primary table
+  // and all the overflow segments.
+  int64_t location_words_;
+
+  // Number of entries in the primary table, and of frames in each of
+  // its arenas.
+  int64_t max_traces_;
+  int64_t primary_arena_frames_;
+
+  TraceData *traces_;
+  std::atomic<uint8_t> *tags_;
+  std::atomic<int64_t> frames_used_[2];
+  JVMPI_CallFrame *frame_arena_[2];
   DISALLOW_COPY_AND_ASSIGN(AsyncSafeTraceMultiset);
 };
 
@@ -175,58 +345,122 @@ class AsyncSafeTraceMultiset {
 // collected atomically from AsyncSafeTraceMultiset, which implements
 // async and thread safe add/extract methods, but has fixed maximum
 // size.
+//
+// Frames are stored as a call tree: each distinct frame under a given
+// caller is a node stored once, and a trace is identified by the node
+// of its leaf frame, so common prefixes such as thread roots are shared
+// between traces. Traces are keyed on their attribute and leaf node. An
+// index over the 64-bit hashes of whole frame sequences finds the leaf
+// node of a known sequence without walking the tree, so adding a trace
+// already in the set does not allocate. A sequence found by its hash is
+// only reused if its depth and every frame up its path to the root match,
+// as distinct sequences can share a hash.
 class TraceMultiset {
- private:
-  typedef struct {
-    std::vector<JVMPI_CallFrame> frames;
+ public:
+  // Node ID of the parent of outermost frames, and of empty traces.
+  static const int64_t kNoNode = -1;
+
+  // A frame in the call tree. Nodes are numbered from 0 in the order
+  // they are created, so parents come before their children.
+  struct Node {
+    uint64_t hash;
+    int64_t parent;
+    // Number of frames from the outermost one down to this one.
+    int depth;
+    JVMPI_CallFrame frame;
+  };
+
+  // A trace in the set along with its count. Its frames are node and
+  // its ancestors, starting with the leaf.
+  struct Trace {
     int64_t attr;
-  } CallTrace;
+    int num_frames;
+    int64_t node;
+    uint64_t count;
+  };
+
+  class const_iterator {
+   public:
+    const_iterator(const TraceMultiset *set, size_t index)
+        : set_(set), index_(index) {}
 
-  struct CallTraceHash {
-    std::size_t operator()(const CallTrace &trace) const {
-      return CalculateHash(trace.attr, trace.frames.size(),
-                           trace.frames.data());
+    Trace operator*() const { return set_->TraceAt(index_); }
+
+    const_iterator &operator++() {
+      ++index_;
+      return *this;
     }
-  };
 
-  struct CallTraceEqual {
-    bool operator()(const CallTrace &t1, const CallTrace &t2) const {
-      if (t1.attr != t2.attr) {
-        return false;
-      }
-      if (t1.frames.size() != t2.frames.size()) {
-        return false;
-      }
-      return Equal(t1.frames.size(), t1.frames.data(), t2.frames.data());
+    bool operator==(const const_iterator &other) const {
+      return index_ == other.index_;
+    }
+    bool operator!=(const const_iterator &other) const {
+      return index_ != other.index_;
     }
-  };
 
-  typedef std::unordered_map<CallTrace, uint64_t, CallTraceHash, CallTraceEqual>
-      CountMap;
+   private:
+    const TraceMultiset *set_;
+    size_t index_;
+  };
 
- public:
   TraceMultiset() {}
 
   // Add a trace to the array. If it is already in the array,
   // increment its count.
-  void Add(int64_t attr, int num_frames, JVMPI_CallFrame *frames,
+  void Add(int64_t attr, int num_frames, const JVMPI_CallFrame *frames,
            int64_t count);
 
-  typedef CountMap::iterator iterator;
-  typedef CountMap::const_iterator const_iterator;
+  const_iterator begin() const { return const_iterator(this, 0); }
+  const_iterator end() const { return const_iterator(this, traces_.size()); }
 
-  iterator begin() { return traces_.begin(); }
-  iterator end() { return traces_.end(); }
+  // Returns the number of distinct traces in the set.
+  size_t Size() const { return traces_.size(); }
 
-  const_iterator begin() const { return const_iterator(traces_.begin()); }
-  const_iterator end() const { return const_iterator(traces_.end()); }
+  // Returns the number of nodes in the call tree, and each of them.
+  size_t NodeCount() const { return nodes_.size(); }
+  const Node &NodeAt(int64_t id) const { return nodes_[id]; }
 
-  iterator erase(iterator it) { return traces_.erase(it); }
-
-  void Clear() { traces_.clear(); }
+  // Removes all the traces and releases their memory.
+  void Clear();
 
  private:
-  CountMap traces_;
+  // A distinct sequence of frames added to the set, and its leaf node.
+  struct Sequence {
+    uint64_t hash;
+    int64_t node;
+  };
+
+  struct Entry {
+    uint64_t hash;
+    int64_t attr;
+    int64_t node;
+    uint64_t count;
+  };
+
+  // Returns the leaf node for the given frames, adding the missing nodes
+  // to the call tree if needed.
+  int64_t InternSequence(int num_frames, const JVMPI_CallFrame *frames);
+
+  // Returns the child of parent for the given frame, adding it if needed.
+  int64_t InternNode(int64_t parent, const JVMPI_CallFrame &frame);
+
+  // Returns whether the leaf node of a sequence with the same hash as
+  // the given frames is for those frames.
+  bool NodeMatches(int64_t node, int num_frames,
+                   const JVMPI_CallFrame *frames) const;
+
+  Trace TraceAt(size_t index) const;
+
+  std::vector<Node> nodes_;
+  std::vector<Sequence> sequences_;
+  std::vector<Entry> traces_;
+
+  // Open-addressed indexes into nodes_, sequences_ and traces_, sized to
+  // a power of two and at most half full.
+  std::vector<int64_t> node_index_;
+  std::vector<int64_t> sequence_index_;
+  std::vector<int64_t> trace_index_;
+
   DISALLOW_COPY_AND_ASSIGN(TraceMultiset);
 };
 
@@ -23,9 +23,13 @@
 #include <utility>
 #include <vector>
 #include "glog/logging.h"
+#include "google/protobuf/io/coded_stream.h"
 #include "google/protobuf/io/gzip_stream.h"
 #include "google/protobuf/io/zero_copy_stream_impl.h"
+#include "google/protobuf/wire_format_lite.h"
 
+using google::protobuf::internal::WireFormatLite;
+using google::protobuf::io::CodedOutputStream;
 using google::protobuf::io::StringOutputStream;
 using google::protobuf::io::GzipOutputStream;
 using google::protobuf::io::FileOutputStream;
@@ -39,6 +43,8 @@ Builder::Builder() : profile_(new Profile()) {
   profile_->add_string_table("");
 }
 
+Builder::~Builder() {}
+
 int64 Builder::StringId(const char *str) {
   if (str == nullptr || !str[0]) {
     return 0;
@@ -79,6 +85,47 @@ uint64 Builder::FunctionId(const char *name, const char *system_name,
   return index;
 }
 
+bool Builder::AddSample(const Sample &sample) {
+  if (sample.value_size() != profile_->sample_type_size()) {
+    LOG(ERROR) << "Found sample with " << sample.value_size()
+               << " values, expecting " << profile_->sample_type_size();
+    return false;
+  }
+  if (coded_stream_ == nullptr) {
+    *profile_->add_sample() = sample;
+    return true;
+  }
+
+  // The fields of a message can come in any order, so each sample is
+  // encoded as a field of the profile ahead of the other fields.
+  const uint32_t size = static_cast<uint32_t>(sample.ByteSizeLong());
+  coded_stream_->WriteTag(WireFormatLite::MakeTag(
+      Profile::kSampleFieldNumber,
+      WireFormatLite::WIRETYPE_LENGTH_DELIMITED));
+  coded_stream_->WriteVarint32(size);
+  sample.SerializeWithCachedSizes(coded_stream_.get());
+  return true;
+}
+
+void Builder::StreamSamples(
+    google::protobuf::io::ZeroCopyOutputStream *output) {
+  coded_stream_.reset(new CodedOutputStream(output));
+}
+
+bool Builder::FinishStream() {
+  CHECK(coded_stream_ != nullptr) << "Samples are not streamed";
+  bool ok = profile_ && Finalize() &&
+            profile_->SerializeToCodedStream(coded_stream_.get());
+  // Destroying the coded stream hands its buffered bytes back to the
+  // underlying stream.
+  ok = !coded_stream_->HadError() && ok;
+  coded_stream_.reset();
+  if (!ok) {
+    LOG(ERROR) << "Failed to serialize the profile stream";
+  }
+  return ok;
+}
+
 bool Builder::Emit(string *output) {
   *output = "";
   if (!profile_ || !Finalize()) {
@@ -210,7 +257,7 @@ bool Builder::CheckValid(const Profile &profile) {
 // - Creates missing locations for unsymbolized profiles.
 // - Associates locations to the corresponding mappings.
 bool Builder::Finalize() {
-  if (profile_->location_size() == 0) {
+  if (profile_->location_size() == 0 && coded_stream_ == nullptr) {
     std::unordered_map<uint64, uint64> address_to_id;
     for (auto &sample : *profile_->mutable_sample()) {
       // Copy sample locations into a temp vector, and then clear and
@@ -32,6 +32,15 @@ typedef std::string string;
 }
 #include "perftools/profiles/proto/profile.pb.h"
 
+namespace google {
+namespace protobuf {
+namespace io {
+class CodedOutputStream;
+class ZeroCopyOutputStream;
+}  // namespace io
+}  // namespace protobuf
+}  // namespace google
+
 namespace perftools {
 namespace profiles {
 
@@ -45,6 +54,7 @@ namespace profiles {
 class Builder {
  public:
   Builder();
+  ~Builder();
 
   // Adds a string to the profile string table if not already present.
   // Returns a unique integer id for this string.
@@ -56,6 +66,25 @@ class Builder {
   uint64 FunctionId(const char *name, const char *system_name,
                     const char *file, int64 start_line);
 
+  // Adds a sample to the profile, or encodes it right away when
+  // streaming samples. The sample types of the profile must be set
+  // first. Returns false, dropping the sample, if it does not have one
+  // value per sample type.
+  bool AddSample(const Sample &sample);
+
+  // Starts encoding the samples added through AddSample directly into
+  // output, which can compress them, instead of holding them in the
+  // profile. FinishStream appends the rest of the profile. Memory use
+  // is then bounded by the string, function and location tables rather
+  // than by the number of samples. The locations must be added
+  // explicitly, as Finalize cannot derive them from the samples.
+  void StreamSamples(google::protobuf::io::ZeroCopyOutputStream *output);
+
+  // Finalizes the profile and encodes all but its samples into the
+  // stream given to StreamSamples. Returns whether the encoding was
+  // successful. The caller remains in charge of closing the stream.
+  bool FinishStream();
+
   // Adds mappings for the currently running binary to the profile.
   void AddCurrentMappings();
 
@@ -119,6 +148,9 @@ class Builder {
 
   // Actual profile being updated.
   std::unique_ptr<Profile> profile_;
+
+  // Encodes the samples, when streaming them.
+  std::unique_ptr<google::protobuf::io::CodedOutputStream> coded_stream_;
 };
 
 }  // namespace profiles